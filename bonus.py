@@ -1,5 +1,7 @@
-import sklearn
+import sklearn.datasets
 import matplotlib.pyplot as plt
+import numpy as np
+import mykmeanssp
 
 
 def get_correct_circle(ax, center, radius):
@@ -17,12 +19,8 @@ def get_correct_circle(ax, center, radius):
 
 def plot_bonus():
     data = sklearn.datasets.load_iris()
-    inertias = []    
-
-    for K in range(1, 11):
-        kmeans = sklearn.cluster.KMeans(n_clusters=K, random_state=0, init='k-means++') 
-        kmeans.fit(data.data)
-        inertias.append(kmeans.inertia_)
+    selection = mykmeanssp.select_k(np.ascontiguousarray(data.data, dtype=np.float64), 1, 10, seed=0)
+    inertias = selection["inertias"]
     print(inertias)
     
 
@@ -34,7 +32,8 @@ def plot_bonus():
     ax.set_xticks(range(1, 11))
 
 
-    elbow_x, elbow_y = 2, inertias[1]   
+    elbow_x = selection["elbow"]
+    elbow_y = inertias[elbow_x - 1]
 
 
     fig.canvas.draw()  # This is needed to get the correct data ratio
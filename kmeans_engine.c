@@ -0,0 +1,4543 @@
+#define _POSIX_C_SOURCE 200112L
+#ifdef __linux__
+/* CPU affinity of worker threads */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netdb.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef KMEANS_USE_BLAS
+#include <cblas.h>
+#endif
+
+#ifdef KMEANS_USE_NUMA
+/* numa.h declares C99 inline functions */
+#define inline __inline__
+#include <numa.h>
+#undef inline
+#endif
+
+#include "kmeans_engine.h"
+
+/*
+MEMORY MANAGEMENT
+ */
+
+void *engine_malloc(size_t size) {
+  void *ptr = malloc(size);
+
+  if (ptr == NULL && size != 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+void *engine_calloc(size_t count, size_t size) {
+  void *ptr = calloc(count, size);
+
+  if (ptr == NULL && count != 0 && size != 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+/* Scratch buffer of one thread, see thread_scratch */
+struct ThreadScratch {
+  double *buffer;
+  size_t size;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_scratch(void *arg) {
+  struct ThreadScratch *scratch = arg;
+
+  free(scratch->buffer);
+  free(scratch);
+}
+
+static void create_scratch_key(void) {
+  pthread_key_create(&scratch_key, free_thread_scratch);
+}
+
+static double *thread_scratch(size_t count) {
+  /*
+  At least count doubles owned by the calling thread, for the assignment kernels. The pool's
+  threads outlive every pass, so each allocates its buffer on first use, grows it when a pass
+  needs more and keeps it until the thread exits. The buffer is only valid until the thread's
+  next call.
+   */
+  struct ThreadScratch *scratch;
+
+  pthread_once(&scratch_once, create_scratch_key);
+  scratch = pthread_getspecific(scratch_key);
+  if (scratch == NULL) {
+    scratch = engine_calloc(1, sizeof(struct ThreadScratch));
+    pthread_setspecific(scratch_key, scratch);
+  }
+  if (scratch->size < count) {
+    free(scratch->buffer);
+    scratch->buffer = engine_malloc(count * sizeof(double));
+    scratch->size = count;
+  }
+  return scratch->buffer;
+}
+
+struct Dataset *try_create_dataset(int num_points, int dim) {
+  /* create_dataset for callers that recover from running out of memory, NULL if it did */
+  struct Dataset *data = malloc(sizeof(struct Dataset));
+
+  if (data == NULL) {
+    return NULL;
+  }
+  data->points = malloc((size_t)num_points * dim * sizeof(double));
+  if (data->points == NULL && num_points > 0) {
+    free(data);
+    return NULL;
+  }
+  data->storage = STORAGE_DENSE;
+  data->kernels = select_kernels(dim);
+  data->values = NULL;
+  data->indices = NULL;
+  data->indptr = NULL;
+  data->codes = NULL;
+  data->scale = NULL;
+  data->offset = NULL;
+  data->norms = NULL;
+  data->weights = NULL;
+  data->spherical = 0;
+  data->num_points = num_points;
+  data->dim = dim;
+  return data;
+}
+
+struct Dataset *create_dataset(int num_points, int dim) {
+  struct Dataset *data = try_create_dataset(num_points, dim);
+
+  if (data == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  return data;
+}
+
+struct Dataset *create_csr_dataset(int num_points, int dim, long nnz) {
+  struct Dataset *data = engine_malloc(sizeof(struct Dataset));
+
+  data->storage = STORAGE_CSR;
+  data->kernels = select_kernels(dim);
+  data->points = NULL;
+  data->values = engine_malloc((size_t)nnz * sizeof(double));
+  data->indices = engine_malloc((size_t)nnz * sizeof(int));
+  data->indptr = engine_malloc(((size_t)num_points + 1) * sizeof(long));
+  data->codes = NULL;
+  data->scale = NULL;
+  data->offset = NULL;
+  data->norms = NULL;
+  data->weights = NULL;
+  data->spherical = 0;
+  data->num_points = num_points;
+  data->dim = dim;
+  return data;
+}
+
+struct Dataset *create_quantized_dataset(int num_points, int dim, const double *mins, const double *maxs) {
+  /*
+  Points are stored as one byte per coordinate, scalar quantized over [mins[j], maxs[j]].
+  Codes are filled in afterwards with quantize_point.
+   */
+  struct Dataset *data = engine_malloc(sizeof(struct Dataset));
+  int j;
+
+  data->storage = STORAGE_QUANTIZED;
+  data->kernels = select_kernels(dim);
+  data->points = NULL;
+  data->values = NULL;
+  data->indices = NULL;
+  data->indptr = NULL;
+  data->codes = engine_malloc((size_t)num_points * dim);
+  data->scale = engine_malloc(dim * sizeof(double));
+  data->offset = engine_malloc(dim * sizeof(double));
+  data->norms = NULL;
+  data->weights = NULL;
+  data->spherical = 0;
+  data->num_points = num_points;
+  data->dim = dim;
+
+  for (j = 0; j < dim; j++) {
+    data->offset[j] = mins[j];
+    data->scale[j] = (maxs[j] - mins[j]) / QUANTIZE_LEVELS;
+  }
+  return data;
+}
+
+void free_dataset(struct Dataset **data_address) {
+  struct Dataset *data;
+
+  if (data_address == NULL || *data_address == NULL) {
+    return;
+  }
+  data = *data_address;
+
+  free(data->points);
+  free(data->values);
+  free(data->indices);
+  free(data->indptr);
+  free(data->codes);
+  free(data->scale);
+  free(data->offset);
+  free(data->norms);
+  free(data->weights);
+  free(data);
+  *data_address = NULL;
+}
+
+
+/*
+POINT FUNCTIONS
+ */
+
+double squared_distance(const double *point, const double *other, int dim) {
+  double total = 0.0;
+  double diff;
+  int i;
+
+  for (i = 0; i < dim; i++) {
+    diff = point[i] - other[i];
+    total += diff * diff;
+  }
+  return total;
+}
+
+double euclidean_distance(const double *point, const double *other, int dim) {
+  return sqrt(squared_distance(point, other, dim));
+}
+
+void point_addition(double *point, const double *other, int dim) {
+  /*
+  Set point coordinates to be the sum of point and other's coordinates.
+  Precondition: point is the centroid next-in-line
+   */
+  int i;
+
+  for (i = 0; i < dim; i++) {
+    point[i] += other[i];
+  }
+}
+
+void point_division(double *point, double divisor, int dim) {
+  /*
+  Set point coordinates to be the division of point's coordinates by divisior.
+  Precondition: point is the centroid next-in-line
+   */
+  int i;
+
+  for (i = 0; i < dim; i++) {
+    point[i] = point[i] / divisor;
+  }
+}
+
+
+
+/*
+DIMENSION SPECIALIZED KERNELS
+Each sum is written as one flat left-to-right chain, so the unrolled kernels add the same
+terms in the same order as the generic loops and give bit-identical results.
+ */
+
+#define SQUARE_DIFF(i) ((x[i] - y[i]) * (x[i] - y[i]))
+#define SQUARES_2(i) SQUARE_DIFF(i) + SQUARE_DIFF(i + 1)
+#define SQUARES_4(i) SQUARES_2(i) + SQUARES_2(i + 2)
+#define SQUARES_8(i) SQUARES_4(i) + SQUARES_4(i + 4)
+#define SQUARES_16(i) SQUARES_8(i) + SQUARES_8(i + 8)
+
+#define PRODUCT(i) (x[i] * y[i])
+#define PRODUCTS_2(i) PRODUCT(i) + PRODUCT(i + 1)
+#define PRODUCTS_4(i) PRODUCTS_2(i) + PRODUCTS_2(i + 2)
+#define PRODUCTS_8(i) PRODUCTS_4(i) + PRODUCTS_4(i + 4)
+#define PRODUCTS_16(i) PRODUCTS_8(i) + PRODUCTS_8(i + 8)
+
+#define ADD_COORD(i) x[i] += y[i];
+#define ADD_2(i) ADD_COORD(i) ADD_COORD(i + 1)
+#define ADD_4(i) ADD_2(i) ADD_2(i + 2)
+#define ADD_8(i) ADD_4(i) ADD_4(i + 4)
+#define ADD_16(i) ADD_8(i) ADD_8(i + 8)
+
+#define DEFINE_KERNELS(D, SQUARES, PRODUCTS, ADDS) \
+  static double squared_distance_##D(const double *x, const double *y, int dim) { \
+    (void)dim; \
+    return 0.0 + SQUARES; \
+  } \
+  static int closest_centroid_##D(const double *centroids, int K, int dim, const double *y) { \
+    const double *x = centroids; \
+    double closest_dist = 0.0 + SQUARES; \
+    double dist; \
+    int closest = 0; \
+    int k; \
+    (void)dim; \
+    for (k = 1; k < K; k++) { \
+      x = centroids + (size_t)k * D; \
+      dist = 0.0 + SQUARES; \
+      if (dist < closest_dist) { \
+        closest_dist = dist; \
+        closest = k; \
+      } \
+    } \
+    return closest; \
+  } \
+  static int most_similar_centroid_##D(const double *centroids, int K, int dim, const double *y) { \
+    const double *x = centroids; \
+    double best_dot = 0.0 + PRODUCTS; \
+    double dot; \
+    int best = 0; \
+    int k; \
+    (void)dim; \
+    for (k = 1; k < K; k++) { \
+      x = centroids + (size_t)k * D; \
+      dot = 0.0 + PRODUCTS; \
+      if (dot > best_dot) { \
+        best_dot = dot; \
+        best = k; \
+      } \
+    } \
+    return best; \
+  } \
+  static void point_addition_##D(double *x, const double *y, int dim) { \
+    (void)dim; \
+    ADDS \
+  }
+
+DEFINE_KERNELS(2, SQUARES_2(0), PRODUCTS_2(0), ADD_2(0))
+DEFINE_KERNELS(3, SQUARES_2(0) + SQUARE_DIFF(2), PRODUCTS_2(0) + PRODUCT(2), ADD_2(0) ADD_COORD(2))
+DEFINE_KERNELS(4, SQUARES_4(0), PRODUCTS_4(0), ADD_4(0))
+DEFINE_KERNELS(8, SQUARES_8(0), PRODUCTS_8(0), ADD_8(0))
+DEFINE_KERNELS(16, SQUARES_16(0), PRODUCTS_16(0), ADD_16(0))
+
+static int closest_centroid_generic(const double *centroids, int K, int dim, const double *point) {
+  double closest_dist = squared_distance(point, centroids, dim);
+  double dist;
+  int closest = 0;
+  int k;
+
+  for (k = 1; k < K; k++) {
+    dist = squared_distance(point, centroids + (size_t)k * dim, dim);
+    if (dist < closest_dist) {
+      closest_dist = dist;
+      closest = k;
+    }
+  }
+  return closest;
+}
+
+static int most_similar_centroid_generic(const double *centroids, int K, int dim, const double *point) {
+  const double *centroid;
+  double best_dot = 0.0;
+  double dot;
+  int best = 0;
+  int k;
+  int i;
+
+  for (k = 0; k < K; k++) {
+    centroid = centroids + (size_t)k * dim;
+    dot = 0.0;
+    for (i = 0; i < dim; i++) {
+      dot += point[i] * centroid[i];
+    }
+    if (k == 0 || dot > best_dot) {
+      best_dot = dot;
+      best = k;
+    }
+  }
+  return best;
+}
+
+static const struct PointKernels fixed_kernels[] = {
+  {2, squared_distance_2, closest_centroid_2, most_similar_centroid_2, point_addition_2},
+  {3, squared_distance_3, closest_centroid_3, most_similar_centroid_3, point_addition_3},
+  {4, squared_distance_4, closest_centroid_4, most_similar_centroid_4, point_addition_4},
+  {8, squared_distance_8, closest_centroid_8, most_similar_centroid_8, point_addition_8},
+  {16, squared_distance_16, closest_centroid_16, most_similar_centroid_16, point_addition_16}
+};
+
+static const struct PointKernels generic_kernels = {0, squared_distance, closest_centroid_generic,
+                                                    most_similar_centroid_generic, point_addition};
+
+const struct PointKernels *select_kernels(int dim) {
+  size_t i;
+
+  for (i = 0; i < sizeof(fixed_kernels) / sizeof(fixed_kernels[0]); i++) {
+    if (fixed_kernels[i].dim == dim) {
+      return &fixed_kernels[i];
+    }
+  }
+  return &generic_kernels;
+}
+
+void compute_norms(const double *points, int num_points, int dim, double *norms) {
+  int i;
+  int j;
+  double total;
+  const double *point;
+
+  for (i = 0; i < num_points; i++) {
+    point = points + (size_t)i * dim;
+    total = 0.0;
+    for (j = 0; j < dim; j++) {
+      total += point[j] * point[j];
+    }
+    norms[i] = total;
+  }
+}
+
+double normalize_point(double *point, int dim) {
+  /* Scale point to unit length and return its former length; zero vectors are left as they are */
+  double norm = 0.0;
+  int i;
+
+  for (i = 0; i < dim; i++) {
+    norm += point[i] * point[i];
+  }
+  norm = sqrt(norm);
+  if (norm > 0.0) {
+    for (i = 0; i < dim; i++) {
+      point[i] /= norm;
+    }
+  }
+  return norm;
+}
+
+void normalize_dataset(struct Dataset *data) {
+  /*
+  Scale every point to unit length once, for spherical k-means: on unit vectors the closest
+  unit centroid is the one with the largest dot product, i.e. the largest cosine similarity.
+  Precondition: data is dense or CSR.
+   */
+  double norm;
+  long j;
+  int i;
+
+  for (i = 0; i < data->num_points; i++) {
+    if (data->storage == STORAGE_CSR) {
+      norm = 0.0;
+      for (j = data->indptr[i]; j < data->indptr[i + 1]; j++) {
+        norm += data->values[j] * data->values[j];
+      }
+      norm = sqrt(norm);
+      for (j = data->indptr[i]; j < data->indptr[i + 1] && norm > 0.0; j++) {
+        data->values[j] /= norm;
+      }
+    }
+    else {
+      normalize_point(data->points + (size_t)i * data->dim, data->dim);
+    }
+  }
+
+  free(data->norms);
+  data->norms = NULL;
+  data->spherical = 1;
+}
+
+void prepare_norms(struct Dataset *data) {
+  /* Point norms do not change between iterations or between calls on the same dataset */
+  int i;
+  long j;
+  double total;
+
+  if (data->norms != NULL) {
+    return;
+  }
+  data->norms = engine_malloc((size_t)data->num_points * sizeof(double));
+
+  if (data->storage == STORAGE_CSR) {
+    for (i = 0; i < data->num_points; i++) {
+      total = 0.0;
+      for (j = data->indptr[i]; j < data->indptr[i + 1]; j++) {
+        total += data->values[j] * data->values[j];
+      }
+      data->norms[i] = total;
+    }
+  }
+  else {
+    compute_norms(data->points, data->num_points, data->dim, data->norms);
+  }
+}
+
+double point_weight(const struct Dataset *data, int index) {
+  return data->weights == NULL ? 1.0 : data->weights[index];
+}
+
+void add_point_to_sum(const struct Dataset *data, int index, double *sum) {
+  /* Adds the point scaled by its weight */
+  const double *point;
+  const unsigned char *codes;
+  double weight = point_weight(data, index);
+  long j;
+
+  if (data->storage == STORAGE_CSR) {
+    for (j = data->indptr[index]; j < data->indptr[index + 1]; j++) {
+      sum[data->indices[j]] += weight * data->values[j];
+    }
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    codes = data->codes + (size_t)index * data->dim;
+    for (j = 0; j < data->dim; j++) {
+      sum[j] += weight * (data->offset[j] + data->scale[j] * codes[j]);
+    }
+  }
+  else if (data->weights == NULL) {
+    data->kernels->addition(sum, data->points + (size_t)index * data->dim, data->dim);
+  }
+  else {
+    point = data->points + (size_t)index * data->dim;
+    for (j = 0; j < data->dim; j++) {
+      sum[j] += weight * point[j];
+    }
+  }
+}
+
+void subtract_point_from_sum(const struct Dataset *data, int index, double *sum) {
+  const double *point;
+  const unsigned char *codes;
+  double weight = point_weight(data, index);
+  long j;
+
+  if (data->storage == STORAGE_CSR) {
+    for (j = data->indptr[index]; j < data->indptr[index + 1]; j++) {
+      sum[data->indices[j]] -= weight * data->values[j];
+    }
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    codes = data->codes + (size_t)index * data->dim;
+    for (j = 0; j < data->dim; j++) {
+      sum[j] -= weight * (data->offset[j] + data->scale[j] * codes[j]);
+    }
+  }
+  else {
+    point = data->points + (size_t)index * data->dim;
+    for (j = 0; j < data->dim; j++) {
+      sum[j] -= weight * point[j];
+    }
+  }
+}
+
+void decode_point(const struct Dataset *data, int index, double *point) {
+  /* Dense coordinates of a point of any storage layout */
+  const unsigned char *codes;
+  long j;
+
+  if (data->storage == STORAGE_CSR) {
+    memset(point, 0, data->dim * sizeof(double));
+    for (j = data->indptr[index]; j < data->indptr[index + 1]; j++) {
+      point[data->indices[j]] = data->values[j];
+    }
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    codes = data->codes + (size_t)index * data->dim;
+    for (j = 0; j < data->dim; j++) {
+      point[j] = data->offset[j] + data->scale[j] * codes[j];
+    }
+  }
+  else {
+    memcpy(point, data->points + (size_t)index * data->dim, data->dim * sizeof(double));
+  }
+}
+
+void quantize_point(struct Dataset *data, int index, const double *point) {
+  unsigned char *codes = data->codes + (size_t)index * data->dim;
+  double level;
+  int j;
+
+  for (j = 0; j < data->dim; j++) {
+    level = data->scale[j] > 0.0 ? (point[j] - data->offset[j]) / data->scale[j] + 0.5 : 0.0;
+    if (level < 0.0) {
+      level = 0.0;
+    }
+    if (level > QUANTIZE_LEVELS) {
+      level = QUANTIZE_LEVELS;
+    }
+    codes[j] = (unsigned char)level;
+  }
+}
+
+
+/*
+ASSIGNMENT FUNCTIONS
+ */
+
+int closest_centroid(const struct PointKernels *kernels, const double *centroids, int K, int dim,
+                     const double *point) {
+  /* Ties go to the lowest centroid index */
+  return kernels->closest(centroids, K, dim, point);
+}
+
+#ifndef KMEANS_USE_BLAS
+static void dot_micro_kernel(const double *points, const double *centroids, int len, int stride,
+                             double *dots, int dots_stride) {
+  /*
+  Accumulate the MICRO_ROWS x MICRO_COLS dot products of a full register tile into dots.
+  Each point and centroid coordinate is loaded once per step of the dimension loop.
+   */
+  const double *x0 = points;
+  const double *x1 = points + stride;
+  const double *x2 = points + 2 * (size_t)stride;
+  const double *x3 = points + 3 * (size_t)stride;
+  const double *c0 = centroids;
+  const double *c1 = centroids + stride;
+  const double *c2 = centroids + 2 * (size_t)stride;
+  const double *c3 = centroids + 3 * (size_t)stride;
+  double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+  double a10 = 0, a11 = 0, a12 = 0, a13 = 0;
+  double a20 = 0, a21 = 0, a22 = 0, a23 = 0;
+  double a30 = 0, a31 = 0, a32 = 0, a33 = 0;
+  double x;
+  int d;
+
+  for (d = 0; d < len; d++) {
+    x = x0[d];
+    a00 += x * c0[d]; a01 += x * c1[d]; a02 += x * c2[d]; a03 += x * c3[d];
+    x = x1[d];
+    a10 += x * c0[d]; a11 += x * c1[d]; a12 += x * c2[d]; a13 += x * c3[d];
+    x = x2[d];
+    a20 += x * c0[d]; a21 += x * c1[d]; a22 += x * c2[d]; a23 += x * c3[d];
+    x = x3[d];
+    a30 += x * c0[d]; a31 += x * c1[d]; a32 += x * c2[d]; a33 += x * c3[d];
+  }
+
+  dots[0] += a00; dots[1] += a01; dots[2] += a02; dots[3] += a03;
+  dots += dots_stride;
+  dots[0] += a10; dots[1] += a11; dots[2] += a12; dots[3] += a13;
+  dots += dots_stride;
+  dots[0] += a20; dots[1] += a21; dots[2] += a22; dots[3] += a23;
+  dots += dots_stride;
+  dots[0] += a30; dots[1] += a31; dots[2] += a32; dots[3] += a33;
+}
+
+static void dot_edge_kernel(const double *points, const double *centroids, int rows, int cols, int len,
+                            int stride, double *dots, int dots_stride) {
+  /* Partial tiles at the border of a block */
+  const double *x;
+  const double *c;
+  double total;
+  int r;
+  int s;
+  int d;
+
+  for (r = 0; r < rows; r++) {
+    x = points + (size_t)r * stride;
+    for (s = 0; s < cols; s++) {
+      c = centroids + (size_t)s * stride;
+      total = 0.0;
+      for (d = 0; d < len; d++) {
+        total += x[d] * c[d];
+      }
+      dots[r * dots_stride + s] += total;
+    }
+  }
+}
+#endif
+
+static void block_dot_products(const double *points, int num_rows, const double *centroids, int num_cols,
+                               int dim, double *dots) {
+  /*
+  dots[r * CENTROID_BLOCK + s] = points[r] . centroids[s] for a block of at most
+  POINT_BLOCK points and CENTROID_BLOCK centroids.
+   */
+#ifdef KMEANS_USE_BLAS
+  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, num_rows, num_cols, dim,
+              1.0, points, dim, centroids, dim, 0.0, dots, CENTROID_BLOCK);
+#else
+  int d0;
+  int len;
+  int r;
+  int s;
+  int full_rows = num_rows - num_rows % MICRO_ROWS;
+  int full_cols = num_cols - num_cols % MICRO_COLS;
+
+  for (r = 0; r < num_rows; r++) {
+    memset(dots + r * CENTROID_BLOCK, 0, num_cols * sizeof(double));
+  }
+
+  for (d0 = 0; d0 < dim; d0 += DIM_BLOCK) {
+    len = dim - d0 < DIM_BLOCK ? dim - d0 : DIM_BLOCK;
+
+    for (r = 0; r < full_rows; r += MICRO_ROWS) {
+      for (s = 0; s < full_cols; s += MICRO_COLS) {
+        dot_micro_kernel(points + (size_t)r * dim + d0, centroids + (size_t)s * dim + d0, len, dim,
+                         dots + r * CENTROID_BLOCK + s, CENTROID_BLOCK);
+      }
+      if (full_cols < num_cols) {
+        dot_edge_kernel(points + (size_t)r * dim + d0, centroids + (size_t)full_cols * dim + d0,
+                        MICRO_ROWS, num_cols - full_cols, len, dim,
+                        dots + r * CENTROID_BLOCK + full_cols, CENTROID_BLOCK);
+      }
+    }
+    if (full_rows < num_rows) {
+      dot_edge_kernel(points + (size_t)full_rows * dim + d0, centroids + d0,
+                      num_rows - full_rows, num_cols, len, dim,
+                      dots + full_rows * CENTROID_BLOCK, CENTROID_BLOCK);
+    }
+  }
+#endif
+}
+
+void assign_blocked(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                    int *labels) {
+  /*
+  Label points [start, end) with their closest centroid using ||x||^2 - 2 x.c + ||c||^2.
+  The product and distance blocks are the calling thread's scratch (see thread_scratch).
+  Precondition: data->norms holds the squared norm of every point.
+   */
+  double *dots = thread_scratch(POINT_BLOCK * CENTROID_BLOCK + POINT_BLOCK);
+  double *best_dist = dots + POINT_BLOCK * CENTROID_BLOCK;
+  double dist;
+  int dim = data->dim;
+  int K = cache->K;
+  int i0;
+  int k0;
+  int rows;
+  int cols;
+  int r;
+  int s;
+
+  for (i0 = start; i0 < end; i0 += POINT_BLOCK) {
+    rows = end - i0 < POINT_BLOCK ? end - i0 : POINT_BLOCK;
+
+    for (k0 = 0; k0 < K; k0 += CENTROID_BLOCK) {
+      cols = K - k0 < CENTROID_BLOCK ? K - k0 : CENTROID_BLOCK;
+      block_dot_products(data->points + (size_t)i0 * dim, rows, cache->centroids + (size_t)k0 * dim, cols, dim, dots);
+
+      for (r = 0; r < rows; r++) {
+        for (s = 0; s < cols; s++) {
+          dist = data->norms[i0 + r] - 2.0 * dots[r * CENTROID_BLOCK + s] + cache->norms[k0 + s];
+          if ((k0 == 0 && s == 0) || dist < best_dist[r]) {
+            best_dist[r] = dist;
+            labels[i0 + r] = k0 + s;
+          }
+        }
+      }
+    }
+  }
+}
+
+void assign_sparse(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                   int *labels) {
+  /*
+  Label CSR points [start, end) with their closest centroid using ||x||^2 - 2 x.c + ||c||^2.
+  Centroids are transposed to dim x K so each non-zero adds one contiguous row of
+  products, keeping the work proportional to nnz * K instead of dim * K. The products are the
+  calling thread's scratch (see thread_scratch).
+  Precondition: data->norms holds the squared norm of every point.
+   */
+  int K = cache->K;
+  double *dots = thread_scratch(K);
+  const double *column;
+  double value;
+  double dist;
+  double best_dist;
+  int i;
+  int k;
+  long j;
+
+  for (i = start; i < end; i++) {
+    memset(dots, 0, K * sizeof(double));
+    for (j = data->indptr[i]; j < data->indptr[i + 1]; j++) {
+      value = data->values[j];
+      column = cache->transposed + (size_t)data->indices[j] * K;
+      for (k = 0; k < K; k++) {
+        dots[k] += value * column[k];
+      }
+    }
+
+    best_dist = data->norms[i] - 2.0 * dots[0] + cache->norms[0];
+    labels[i] = 0;
+    for (k = 1; k < K; k++) {
+      dist = data->norms[i] - 2.0 * dots[k] + cache->norms[k];
+      if (dist < best_dist) {
+        best_dist = dist;
+        labels[i] = k;
+      }
+    }
+  }
+}
+
+void assign_quantized(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                      int *labels) {
+  /*
+  Label quantized points [start, end) with their closest centroid, reading the byte codes directly.
+  Centroids are shifted by the per-dimension offsets once per iteration, so each coordinate of a
+  pair costs one multiply-subtract against scale[j] * code instead of a full decode.
+   */
+  const unsigned char *codes;
+  const double *centroid;
+  double diff;
+  double dist;
+  double best_dist;
+  int dim = data->dim;
+  int i;
+  int j;
+  int k;
+
+  for (i = start; i < end; i++) {
+    codes = data->codes + (size_t)i * dim;
+    best_dist = 0.0;
+    for (k = 0; k < cache->K; k++) {
+      centroid = cache->shifted + (size_t)k * dim;
+      dist = 0.0;
+      for (j = 0; j < dim; j++) {
+        diff = data->scale[j] * codes[j] - centroid[j];
+        dist += diff * diff;
+      }
+      if (k == 0 || dist < best_dist) {
+        best_dist = dist;
+        labels[i] = k;
+      }
+    }
+  }
+}
+
+void prepare_centroids(struct Dataset *data, const double *centroids, int K, struct CentroidCache *cache) {
+  /*
+  Derive what the assignment kernel of data needs from the current centroids, once per
+  iteration and before any parallel work starts.
+   */
+  int dim = data->dim;
+  int i;
+  int k;
+
+  cache->centroids = centroids;
+  cache->K = K;
+  cache->norms = NULL;
+  cache->transposed = NULL;
+  cache->shifted = NULL;
+
+  if (data->storage == STORAGE_QUANTIZED) {
+    cache->shifted = engine_malloc((size_t)K * dim * sizeof(double));
+    for (k = 0; k < K; k++) {
+      for (i = 0; i < dim; i++) {
+        cache->shifted[(size_t)k * dim + i] = centroids[(size_t)k * dim + i] - data->offset[i];
+      }
+    }
+    return;
+  }
+
+  if (data->storage == STORAGE_DENSE && dim < GEMM_MIN_DIM) {
+    return;
+  }
+
+  prepare_norms(data);
+  cache->norms = engine_malloc(K * sizeof(double));
+  compute_norms(centroids, K, dim, cache->norms);
+  if (data->spherical) {
+    /* Unit centroids: exact ones keep ties between equal dot products in index order */
+    for (k = 0; k < K; k++) {
+      cache->norms[k] = 1.0;
+    }
+  }
+
+  if (data->storage == STORAGE_CSR) {
+    cache->transposed = engine_malloc((size_t)dim * K * sizeof(double));
+    for (k = 0; k < K; k++) {
+      for (i = 0; i < dim; i++) {
+        cache->transposed[(size_t)i * K + k] = centroids[(size_t)k * dim + i];
+      }
+    }
+  }
+}
+
+void free_centroid_cache(struct CentroidCache *cache) {
+  free(cache->norms);
+  free(cache->transposed);
+  free(cache->shifted);
+  cache->norms = NULL;
+  cache->transposed = NULL;
+  cache->shifted = NULL;
+}
+
+void assign_range(const struct Dataset *data, const struct CentroidCache *cache, int start, int end, int *labels) {
+  /*
+  Dispatch the assignment of points [start, end) on the storage layout and dimension of data.
+  Spherical datasets with unit centroids are labelled by the largest dot product; the blocked
+  and sparse kernels already reduce to that, since ||x||^2 and ||c||^2 are all 1.
+   */
+  int j;
+
+  if (data->storage == STORAGE_QUANTIZED) {
+    assign_quantized(data, cache, start, end, labels);
+  }
+  else if (data->storage == STORAGE_CSR) {
+    assign_sparse(data, cache, start, end, labels);
+  }
+  else if (data->dim >= GEMM_MIN_DIM) {
+    assign_blocked(data, cache, start, end, labels);
+  }
+  else if (data->spherical) {
+    for (j = start; j < end; j++) {
+      labels[j] = data->kernels->most_similar(cache->centroids, cache->K, data->dim,
+                                              data->points + (size_t)j * data->dim);
+    }
+  }
+  else {
+    for (j = start; j < end; j++) {
+      labels[j] = closest_centroid(data->kernels, cache->centroids, cache->K, data->dim,
+                                   data->points + (size_t)j * data->dim);
+    }
+  }
+}
+
+void assign_labels(struct Dataset *data, const double *centroids, int K, int *labels) {
+  struct CentroidCache cache;
+
+  prepare_centroids(data, centroids, K, &cache);
+  assign_range(data, &cache, 0, data->num_points, labels);
+  free_centroid_cache(&cache);
+}
+
+double labelled_inertia(const struct Dataset *data, const double *centroids, const int *labels, double *dists) {
+  /*
+  Squared distance of every point to the centroid its label names, into dists if not NULL.
+  Returns the sum of those distances weighted by the point weights.
+   */
+  double *point = engine_malloc(data->dim * sizeof(double));
+  double inertia = 0.0;
+  double dist;
+  int i;
+
+  for (i = 0; i < data->num_points; i++) {
+    if (data->storage == STORAGE_DENSE) {
+      dist = data->kernels->distance(data->points + (size_t)i * data->dim,
+                                     centroids + (size_t)labels[i] * data->dim, data->dim);
+    }
+    else {
+      decode_point(data, i, point);
+      dist = data->kernels->distance(point, centroids + (size_t)labels[i] * data->dim, data->dim);
+    }
+    if (dists != NULL) {
+      dists[i] = dist;
+    }
+    inertia += point_weight(data, i) * dist;
+  }
+
+  free(point);
+  return inertia;
+}
+
+double nearest_distances(struct Dataset *data, const double *centroids, int K, double *dists) {
+  /*
+  Squared distance of every point to its closest centroid, into dists if not NULL.
+  Returns the inertia: the sum of those distances weighted by the point weights.
+   */
+  int *labels = engine_malloc((size_t)data->num_points * sizeof(int));
+  double inertia;
+
+  assign_labels(data, centroids, K, labels);
+  inertia = labelled_inertia(data, centroids, labels, dists);
+  free(labels);
+  return inertia;
+}
+
+
+/*
+PARALLEL EXECUTION
+ */
+
+struct ParallelWorker {
+  void (*run)(void *context, int task);
+  void *context;
+  int num_tasks;
+  int num_threads;
+  int thread;
+  /* Placed runs: the thread takes tasks [first, last) instead of every num_threads-th task */
+  int first;
+  int last;
+};
+
+static void *parallel_worker(void *arg) {
+  struct ParallelWorker *worker = arg;
+  int task;
+
+  if (worker->first >= 0) {
+    for (task = worker->first; task < worker->last; task++) {
+      worker->run(worker->context, task);
+    }
+    return NULL;
+  }
+  for (task = worker->thread; task < worker->num_tasks; task += worker->num_threads) {
+    worker->run(worker->context, task);
+  }
+  return NULL;
+}
+
+/*
+Persistent worker threads shared by every parallel call. They are started on first use, grown to
+the largest team asked for, and sleep on pool_wake between jobs. One job runs at a time; a call
+made while the pool is busy (from another thread of the host program) starts its own threads.
+Placed jobs pin every member they use to its CPU, and a member is unpinned again by the next
+job that gives it none, so the pool serves placed and unplaced calls alike.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *pool_threads = NULL;
+static int pool_size = 0;
+static int pool_busy = 0;
+static int pool_stop = 0;
+static int pool_pending = 0;
+static int pool_atfork_registered = 0;
+static unsigned long pool_generation = 0;
+static void *(*pool_routine)(void *arg);
+static char *pool_args;
+static size_t pool_arg_size;
+static int pool_members;
+/* 1 when argument 0 of the job runs on the caller, 0 when every argument runs on a member */
+static int pool_caller;
+/* CPU of every argument of a placed job, NULL for an unplaced one */
+static const int *pool_cpus;
+static int default_threads = 1;
+
+struct PoolMember {
+  int index;
+  unsigned long generation;
+  /* CPU the thread is pinned to, -1 while it runs anywhere */
+  int cpu;
+};
+
+static void pin_pool_member(struct PoolMember *member, int cpu, const void *anywhere) {
+  /* Pin the calling member to cpu, or give it back the affinity it started with for cpu == -1 */
+#ifdef __linux__
+  cpu_set_t set;
+
+  if (cpu == member->cpu) {
+    return;
+  }
+  if (cpu >= 0 && cpu < CPU_SETSIZE) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  else {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (const cpu_set_t *)anywhere);
+  }
+#else
+  (void)anywhere;
+#endif
+  member->cpu = cpu;
+}
+
+static void *pool_thread(void *arg) {
+  struct PoolMember member = *(struct PoolMember *)arg;
+  void *(*routine)(void *arg);
+  void *routine_arg;
+  int slot;
+  int cpu;
+#ifdef __linux__
+  cpu_set_t anywhere;
+
+  pthread_getaffinity_np(pthread_self(), sizeof(anywhere), &anywhere);
+#else
+  char anywhere;
+#endif
+
+  free(arg);
+  for (;;) {
+    pthread_mutex_lock(&pool_lock);
+    while (!pool_stop && pool_generation == member.generation) {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    if (pool_stop) {
+      pthread_mutex_unlock(&pool_lock);
+      return NULL;
+    }
+    member.generation = pool_generation;
+    if (member.index > pool_members) {
+      pthread_mutex_unlock(&pool_lock);
+      continue;
+    }
+    slot = member.index - 1 + pool_caller;
+    routine = pool_routine;
+    routine_arg = pool_args + (size_t)slot * pool_arg_size;
+    cpu = pool_cpus != NULL ? pool_cpus[slot] : -1;
+    pthread_mutex_unlock(&pool_lock);
+
+    pin_pool_member(&member, cpu, &anywhere);
+    routine(routine_arg);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_pending == 0) {
+      pthread_cond_broadcast(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+}
+
+static void pool_prepare_fork(void) {
+  pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_parent_fork(void) {
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void pool_child_fork(void) {
+  /* Only the forking thread survives in the child: forget the workers, the next call starts new ones */
+  free(pool_threads);
+  pool_threads = NULL;
+  pool_size = 0;
+  pool_busy = 0;
+  pool_pending = 0;
+  pthread_cond_init(&pool_wake, NULL);
+  pthread_cond_init(&pool_done, NULL);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void grow_pool(int size) {
+  /* Called with pool_lock held; stops early if the system refuses more threads */
+  pthread_t *threads;
+  struct PoolMember *member;
+
+  if (!pool_atfork_registered) {
+    pthread_atfork(pool_prepare_fork, pool_parent_fork, pool_child_fork);
+    pool_atfork_registered = 1;
+  }
+  threads = realloc(pool_threads, size * sizeof(pthread_t));
+  if (threads == NULL) {
+    return;
+  }
+  pool_threads = threads;
+  while (pool_size < size) {
+    member = engine_malloc(sizeof(struct PoolMember));
+    /* Members are numbered from 1, index 0 of an unplaced job is the caller */
+    member->index = pool_size + 1;
+    member->generation = pool_generation;
+    member->cpu = -1;
+    if (pthread_create(&pool_threads[pool_size], NULL, pool_thread, member) != 0) {
+      free(member);
+      return;
+    }
+    pool_size++;
+  }
+}
+
+static void stop_pool(int keep) {
+  /* Stop the pool if it has more than keep members; the next job starts a new one */
+  int t;
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_busy) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  if (pool_size <= keep) {
+    pthread_mutex_unlock(&pool_lock);
+    return;
+  }
+  /* Jobs arriving meanwhile see a busy pool and start their own threads */
+  pool_busy = 1;
+  pool_stop = 1;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+  for (t = 0; t < pool_size; t++) {
+    pthread_join(pool_threads[t], NULL);
+  }
+  pthread_mutex_lock(&pool_lock);
+  free(pool_threads);
+  pool_threads = NULL;
+  pool_size = 0;
+  pool_stop = 0;
+  pool_busy = 0;
+  pthread_cond_broadcast(&pool_done);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static int run_on_pool(int num_threads, const int *cpus, void *(*routine)(void *arg), void *args, size_t arg_size) {
+  /*
+  Run routine(args + t * arg_size) for t in 0..num_threads-1. Without cpus t = 0 runs on the
+  caller and the others on pool threads; with cpus every t runs on a member pinned to cpus[t]
+  and the caller only waits, so its own affinity is never changed. Returns -1 without running
+  anything if the pool is busy with another job.
+   */
+  int caller = cpus == NULL ? 1 : 0;
+  int needed = num_threads - caller;
+  int members;
+  int t;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pool_busy) {
+    pthread_mutex_unlock(&pool_lock);
+    return -1;
+  }
+  pool_busy = 1;
+  if (pool_size < needed) {
+    grow_pool(needed);
+  }
+  members = pool_size < needed ? pool_size : needed;
+  pool_routine = routine;
+  pool_args = args;
+  pool_arg_size = arg_size;
+  pool_members = members;
+  pool_caller = caller;
+  pool_cpus = cpus;
+  pool_pending = members;
+  pool_generation++;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  /* Arguments the pool could not provide a member for run here, after the caller's own share */
+  if (caller) {
+    routine(args);
+  }
+  for (t = members + caller; t < num_threads; t++) {
+    routine((char *)args + (size_t)t * arg_size);
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_pending > 0) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pool_busy = 0;
+  /* stop_pool may be waiting for this job */
+  pthread_cond_broadcast(&pool_done);
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+void set_num_threads(int num_threads) {
+  /* Default thread count of default_options; a larger pool is stopped and rebuilt lazily */
+  pthread_mutex_lock(&pool_lock);
+  default_threads = num_threads < 1 ? 1 : num_threads;
+  num_threads = default_threads;
+  pthread_mutex_unlock(&pool_lock);
+  stop_pool(num_threads - 1);
+}
+
+int get_num_threads(void) {
+  int num_threads;
+
+  pthread_mutex_lock(&pool_lock);
+  num_threads = default_threads;
+  pthread_mutex_unlock(&pool_lock);
+  return num_threads;
+}
+
+int work_threads(int num_threads, double work) {
+  /* Threads worth waking for a job of work point-centroid-dimension products */
+  if (work < PARALLEL_MIN_WORK || num_threads < 1) {
+    return 1;
+  }
+  return num_threads;
+}
+
+void parallel_for(int num_threads, int num_tasks, void (*run)(void *context, int task), void *context) {
+  /*
+  Run tasks 0..num_tasks-1 on num_threads threads, thread t taking tasks t, t + num_threads, ...
+  Tasks must not depend on which thread runs them.
+   */
+  pthread_t *threads;
+  struct ParallelWorker *workers;
+  int started;
+  int t;
+
+  if (num_threads > num_tasks) {
+    num_threads = num_tasks;
+  }
+  if (num_threads <= 1) {
+    for (t = 0; t < num_tasks; t++) {
+      run(context, t);
+    }
+    return;
+  }
+
+  threads = engine_malloc(num_threads * sizeof(pthread_t));
+  workers = engine_malloc(num_threads * sizeof(struct ParallelWorker));
+
+  for (t = 0; t < num_threads; t++) {
+    workers[t].run = run;
+    workers[t].context = context;
+    workers[t].num_tasks = num_tasks;
+    workers[t].num_threads = num_threads;
+    workers[t].thread = t;
+    workers[t].first = -1;
+    workers[t].last = -1;
+  }
+
+  if (run_on_pool(num_threads, NULL, parallel_worker, workers, sizeof(struct ParallelWorker)) == 0) {
+    free(threads);
+    free(workers);
+    return;
+  }
+
+  /* Thread 0 is the caller; if a thread cannot be started its tasks run here too */
+  started = 1;
+  for (t = 1; t < num_threads; t++) {
+    if (pthread_create(&threads[t], NULL, parallel_worker, &workers[t]) != 0) {
+      break;
+    }
+    started++;
+  }
+  for (t = started; t < num_threads; t++) {
+    parallel_worker(&workers[t]);
+  }
+  parallel_worker(&workers[0]);
+
+  for (t = 1; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  free(threads);
+  free(workers);
+}
+
+static int parse_cpu_list(const char *path, int *cpus, int max_cpus) {
+  /* Reads a sysfs cpulist such as "0-3,8-11" into cpus, returns how many or -1 without the file */
+  FILE *file = fopen(path, "r");
+  int count = 0;
+  int first;
+  int last;
+  int cpu;
+  int c;
+
+  if (file == NULL) {
+    return -1;
+  }
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+    c = fgetc(file);
+    if (c == '-') {
+      if (fscanf(file, "%d", &last) != 1) {
+        break;
+      }
+      c = fgetc(file);
+    }
+    for (cpu = first; cpu <= last && count < max_cpus; cpu++) {
+      cpus[count++] = cpu;
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+static int node_cpus(int node, int *cpus, int max_cpus) {
+  /* CPUs of one NUMA node, from libnuma when it is built in and usable, otherwise from sysfs */
+  char path[64];
+#ifdef KMEANS_USE_NUMA
+  struct bitmask *mask;
+  int count = 0;
+  int cpu;
+
+  if (numa_available() != -1) {
+    if (node > numa_max_node()) {
+      return -1;
+    }
+    mask = numa_allocate_cpumask();
+    if (numa_node_to_cpus(node, mask) == 0) {
+      for (cpu = 0; cpu < (int)mask->size && count < max_cpus; cpu++) {
+        if (numa_bitmask_isbitset(mask, cpu)) {
+          cpus[count++] = cpu;
+        }
+      }
+    }
+    numa_free_cpumask(mask);
+    return count;
+  }
+#endif
+  sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+  return parse_cpu_list(path, cpus, max_cpus);
+}
+
+void create_placement(struct Placement *placement, int num_threads) {
+  /*
+  Spread num_threads threads over the NUMA nodes in contiguous blocks, so consecutive threads
+  share a node, and give each thread its own CPU of that node. Without any topology information
+  all CPUs form one node; if the CPU count is unknown too, threads are left unpinned.
+   */
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  int *cpus;
+  int *counts = engine_calloc(MAX_NUMA_NODES, sizeof(int));
+  int *offsets = engine_calloc(MAX_NUMA_NODES, sizeof(int));
+  int *present = engine_malloc(MAX_NUMA_NODES * sizeof(int));
+  int total = 0;
+  int node;
+  int found;
+  int index;
+  int t;
+
+  if (num_cpus < 1) {
+    num_cpus = 1;
+  }
+  cpus = engine_malloc((size_t)num_cpus * sizeof(int));
+
+  placement->num_threads = num_threads < 1 ? 1 : num_threads;
+  placement->cpus = engine_malloc(placement->num_threads * sizeof(int));
+  placement->nodes = engine_malloc(placement->num_threads * sizeof(int));
+  placement->num_nodes = 0;
+
+  /* Node CPU lists are packed into cpus one after the other */
+  for (node = 0; node < MAX_NUMA_NODES && total < num_cpus; node++) {
+    found = node_cpus(node, cpus + total, (int)num_cpus - total);
+    if (found > 0) {
+      present[placement->num_nodes] = node;
+      offsets[placement->num_nodes] = total;
+      counts[placement->num_nodes] = found;
+      placement->num_nodes++;
+      total += found;
+    }
+  }
+
+  if (placement->num_nodes == 0) {
+    placement->num_nodes = 1;
+    present[0] = 0;
+    counts[0] = (int)num_cpus;
+    for (t = 0; t < num_cpus; t++) {
+      cpus[t] = t;
+    }
+  }
+
+  for (t = 0; t < placement->num_threads; t++) {
+    node = (int)((long)t * placement->num_nodes / placement->num_threads);
+    index = t - (int)(((long)node * placement->num_threads + placement->num_nodes - 1) / placement->num_nodes);
+    placement->nodes[t] = present[node];
+    placement->cpus[t] = cpus[offsets[node] + index % counts[node]];
+  }
+
+  free(cpus);
+  free(counts);
+  free(offsets);
+  free(present);
+}
+
+void free_placement(struct Placement *placement) {
+  free(placement->cpus);
+  free(placement->nodes);
+  placement->cpus = NULL;
+  placement->nodes = NULL;
+}
+
+static int start_pinned_thread(pthread_t *thread, int cpu, void *(*routine)(void *arg), void *arg) {
+  pthread_attr_t attr;
+  int status;
+#ifdef __linux__
+  cpu_set_t set;
+#endif
+
+  if (pthread_attr_init(&attr) != 0) {
+    return -1;
+  }
+#ifdef __linux__
+  if (cpu >= 0 && cpu < CPU_SETSIZE) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+#else
+  (void)cpu;
+#endif
+  status = pthread_create(thread, &attr, routine, arg);
+  pthread_attr_destroy(&attr);
+  return status;
+}
+
+void parallel_for_placed(const struct Placement *placement, int num_tasks, void (*run)(void *context, int task),
+                         void *context) {
+  /*
+  Run tasks 0..num_tasks-1 on the pinned threads of placement, thread t taking the contiguous
+  block [t * num_tasks / T, (t + 1) * num_tasks / T). Neighbouring tasks therefore run on the
+  same node, and a given task always runs on the same CPU. The threads are pool members pinned
+  for the job, or started here if the pool is busy; the caller's own affinity is never changed.
+   */
+  int num_threads = placement->num_threads;
+  pthread_t *threads = engine_malloc(num_threads * sizeof(pthread_t));
+  struct ParallelWorker *workers = engine_malloc(num_threads * sizeof(struct ParallelWorker));
+  char *started = engine_calloc(num_threads, 1);
+  int t;
+
+  for (t = 0; t < num_threads; t++) {
+    workers[t].run = run;
+    workers[t].context = context;
+    workers[t].num_tasks = num_tasks;
+    workers[t].num_threads = num_threads;
+    workers[t].thread = t;
+    workers[t].first = (int)((long)t * num_tasks / num_threads);
+    workers[t].last = (int)((long)(t + 1) * num_tasks / num_threads);
+  }
+
+  if (run_on_pool(num_threads, placement->cpus, parallel_worker, workers, sizeof(struct ParallelWorker)) == 0) {
+    free(threads);
+    free(workers);
+    free(started);
+    return;
+  }
+
+  for (t = 0; t < num_threads; t++) {
+    if (workers[t].first < workers[t].last) {
+      started[t] = start_pinned_thread(&threads[t], placement->cpus[t], parallel_worker, &workers[t]) == 0;
+    }
+  }
+
+  /* Blocks whose thread could not be started run on the caller */
+  for (t = 0; t < num_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+    else {
+      parallel_worker(&workers[t]);
+    }
+  }
+
+  free(threads);
+  free(workers);
+  free(started);
+}
+
+struct PlacementCopy {
+  struct Dataset *data;
+  double *points;
+  double *values;
+  int *indices;
+  unsigned char *codes;
+  int chunk;
+};
+
+static void first_touch_chunk(void *context, int task) {
+  /* Copy one chunk of rows into the new buffers, from the thread that will read them */
+  struct PlacementCopy *copy = context;
+  struct Dataset *data = copy->data;
+  int start = task * copy->chunk;
+  int end = start + copy->chunk < data->num_points ? start + copy->chunk : data->num_points;
+  size_t first = (size_t)start * data->dim;
+  size_t count = (size_t)(end - start) * data->dim;
+
+  if (data->storage == STORAGE_CSR) {
+    first = (size_t)data->indptr[start];
+    count = (size_t)(data->indptr[end] - data->indptr[start]);
+    memcpy(copy->values + first, data->values + first, count * sizeof(double));
+    memcpy(copy->indices + first, data->indices + first, count * sizeof(int));
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    memcpy(copy->codes + first, data->codes + first, count);
+  }
+  else {
+    memcpy(copy->points + first, data->points + first, count * sizeof(double));
+  }
+}
+
+int place_dataset(struct Dataset *data, const struct Placement *placement, int chunk) {
+  /*
+  Move the point buffer of data to fresh memory written chunk by chunk by the pinned thread
+  that owns the chunk in parallel_for_placed. Under Linux's first-touch policy every page then
+  lives on the node of the thread that reads it in the assignment pass. Returns -1, leaving
+  data where it was, if there is no memory for the new buffer.
+   */
+  struct PlacementCopy copy;
+  size_t size = (size_t)data->num_points * data->dim;
+
+  copy.data = data;
+  copy.chunk = chunk;
+  copy.points = NULL;
+  copy.values = NULL;
+  copy.indices = NULL;
+  copy.codes = NULL;
+
+  if (data->storage == STORAGE_CSR) {
+    size = (size_t)data->indptr[data->num_points];
+    copy.values = malloc(size * sizeof(double));
+    copy.indices = malloc(size * sizeof(int));
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    copy.codes = malloc(size);
+  }
+  else {
+    copy.points = malloc(size * sizeof(double));
+  }
+  if (size > 0 && ((data->storage == STORAGE_CSR && (copy.values == NULL || copy.indices == NULL))
+                   || (data->storage == STORAGE_QUANTIZED && copy.codes == NULL)
+                   || (data->storage == STORAGE_DENSE && copy.points == NULL))) {
+    free(copy.values);
+    free(copy.indices);
+    free(copy.codes);
+    free(copy.points);
+    return -1;
+  }
+
+  parallel_for_placed(placement, (data->num_points + chunk - 1) / chunk, first_touch_chunk, &copy);
+
+  if (data->storage == STORAGE_CSR) {
+    free(data->values);
+    free(data->indices);
+    data->values = copy.values;
+    data->indices = copy.indices;
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    free(data->codes);
+    data->codes = copy.codes;
+  }
+  else {
+    free(data->points);
+    data->points = copy.points;
+  }
+  return 0;
+}
+
+
+double monotonic_seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+
+/* Tasks [head, tail) not yet taken from one thread; the owner takes from head, thieves from tail */
+struct StealQueue {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+};
+
+struct StealPool {
+  void (*run)(void *context, int task);
+  void *context;
+  int num_threads;
+  struct StealQueue *queues;
+};
+
+struct StealWorker {
+  struct StealPool *pool;
+  int thread;
+  struct ThreadStats stats;
+};
+
+static int take_task(struct StealQueue *queue, int from_tail) {
+  int task = -1;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    task = from_tail ? --queue->tail : queue->head++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return task;
+}
+
+static void *stealing_worker(void *arg) {
+  struct StealWorker *worker = arg;
+  struct StealPool *pool = worker->pool;
+  double start;
+  int victim;
+  int task;
+  int v;
+
+  for (;;) {
+    task = take_task(&pool->queues[worker->thread], 0);
+    /* Victims are probed from the next thread on, so a placed thread first robs its own node */
+    for (v = 1; task < 0 && v < pool->num_threads; v++) {
+      victim = (worker->thread + v) % pool->num_threads;
+      task = take_task(&pool->queues[victim], 1);
+      if (task >= 0) {
+        worker->stats.steals++;
+      }
+    }
+    if (task < 0) {
+      return NULL;
+    }
+    start = monotonic_seconds();
+    pool->run(pool->context, task);
+    worker->stats.busy_seconds += monotonic_seconds() - start;
+    worker->stats.tasks++;
+  }
+}
+
+void parallel_for_stealing(int num_threads, const struct Placement *placement, int num_tasks,
+                           void (*run)(void *context, int task), void *context, struct ThreadStats *thread_stats) {
+  /*
+  Run tasks 0..num_tasks-1 on num_threads threads that start on the contiguous blocks of
+  parallel_for_placed and, once their own block is done, steal the last remaining task of
+  another thread, so a thread slowed by its points or by the machine never holds up the pass.
+  With placement the threads are pinned as in parallel_for_placed, otherwise thread 0 is the
+  caller. Tasks must not depend on which thread runs them.
+
+  thread_stats, if not NULL, holds num_threads records that receive the tasks run and stolen by
+  every thread and the time it spent running them or idle, stealing or waiting for the others.
+   */
+  struct StealPool pool;
+  struct StealWorker *workers;
+  pthread_t *threads;
+  char *started;
+  double start;
+  double wall;
+  int first = placement == NULL ? 1 : 0;
+  int t;
+
+  if (placement != NULL) {
+    num_threads = placement->num_threads;
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  pool.run = run;
+  pool.context = context;
+  pool.num_threads = num_threads;
+  pool.queues = engine_malloc(num_threads * sizeof(struct StealQueue));
+  workers = engine_calloc(num_threads, sizeof(struct StealWorker));
+  threads = engine_malloc(num_threads * sizeof(pthread_t));
+  started = engine_calloc(num_threads, 1);
+
+  for (t = 0; t < num_threads; t++) {
+    pthread_mutex_init(&pool.queues[t].lock, NULL);
+    pool.queues[t].head = (int)((long)t * num_tasks / num_threads);
+    pool.queues[t].tail = (int)((long)(t + 1) * num_tasks / num_threads);
+    workers[t].pool = &pool;
+    workers[t].thread = t;
+  }
+
+  start = monotonic_seconds();
+  if (run_on_pool(num_threads, placement != NULL ? placement->cpus : NULL, stealing_worker, workers,
+                  sizeof(struct StealWorker)) == 0) {
+    first = num_threads;
+    for (t = 0; t < num_threads; t++) {
+      started[t] = 2;
+    }
+  }
+  for (t = first; t < num_threads; t++) {
+    if (placement != NULL) {
+      started[t] = start_pinned_thread(&threads[t], placement->cpus[t], stealing_worker, &workers[t]) == 0;
+    }
+    else {
+      started[t] = pthread_create(&threads[t], NULL, stealing_worker, &workers[t]) == 0;
+    }
+  }
+  /* The caller works as thread 0 and then in place of any thread that could not be started */
+  for (t = 0; t < num_threads; t++) {
+    if (!started[t]) {
+      stealing_worker(&workers[t]);
+    }
+  }
+  for (t = 0; t < num_threads; t++) {
+    if (started[t] == 1) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  wall = monotonic_seconds() - start;
+
+  for (t = 0; t < num_threads; t++) {
+    pthread_mutex_destroy(&pool.queues[t].lock);
+    if (thread_stats != NULL) {
+      thread_stats[t].tasks += workers[t].stats.tasks;
+      thread_stats[t].steals += workers[t].stats.steals;
+      thread_stats[t].busy_seconds += workers[t].stats.busy_seconds;
+      thread_stats[t].idle_seconds += wall - workers[t].stats.busy_seconds;
+    }
+  }
+
+  free(pool.queues);
+  free(workers);
+  free(threads);
+  free(started);
+}
+
+
+/*
+CHECKPOINTS
+ */
+/* File layout: magic, K, dim, iteration, num_points, has_random, the random state, centroids, labels */
+static const char checkpoint_magic[8] = {'K', 'M', 'C', 'K', 'P', 'T', '0', '1'};
+
+int write_checkpoint(const char *path, const struct Checkpoint *checkpoint) {
+  /*
+  Write checkpoint to path in native byte order. The file is written under path.tmp and renamed
+  over path, so a crash mid-write leaves the previous checkpoint intact. Returns 0 or -1.
+   */
+  char *temporary = engine_malloc(strlen(path) + 5);
+  unsigned int word;
+  int header[5];
+  size_t size = (size_t)checkpoint->K * checkpoint->dim;
+  FILE *file;
+  int ok;
+  int i;
+
+  sprintf(temporary, "%s.tmp", path);
+  file = fopen(temporary, "wb");
+  if (file == NULL) {
+    free(temporary);
+    return -1;
+  }
+
+  header[0] = checkpoint->K;
+  header[1] = checkpoint->dim;
+  header[2] = checkpoint->iteration;
+  header[3] = checkpoint->labels != NULL ? checkpoint->num_points : 0;
+  header[4] = checkpoint->has_random;
+  ok = fwrite(checkpoint_magic, 1, sizeof(checkpoint_magic), file) == sizeof(checkpoint_magic);
+  ok = ok && fwrite(header, sizeof(int), 5, file) == 5;
+  for (i = 0; ok && checkpoint->has_random && i < MT_STATE_SIZE; i++) {
+    word = (unsigned int)checkpoint->random.mt[i];
+    ok = fwrite(&word, sizeof(word), 1, file) == 1;
+  }
+  ok = ok && (!checkpoint->has_random || fwrite(&checkpoint->random.pos, sizeof(int), 1, file) == 1);
+  ok = ok && fwrite(checkpoint->centroids, sizeof(double), size, file) == size;
+  ok = ok && fwrite(checkpoint->labels, sizeof(int), header[3], file) == (size_t)header[3];
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok || rename(temporary, path) != 0) {
+    remove(temporary);
+    free(temporary);
+    return -1;
+  }
+  free(temporary);
+  return 0;
+}
+
+struct Checkpoint *read_checkpoint(const char *path) {
+  /* Checkpoint saved by write_checkpoint, NULL if the file cannot be read or is not one */
+  struct Checkpoint *checkpoint;
+  char magic[sizeof(checkpoint_magic)];
+  unsigned int word;
+  int header[5];
+  size_t size;
+  FILE *file = fopen(path, "rb");
+  int ok;
+  int i;
+
+  if (file == NULL) {
+    return NULL;
+  }
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0
+      || fread(header, sizeof(int), 5, file) != 5 || header[0] < 1 || header[1] < 1 || header[2] < 0
+      || header[3] < 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  checkpoint = engine_malloc(sizeof(struct Checkpoint));
+  checkpoint->K = header[0];
+  checkpoint->dim = header[1];
+  checkpoint->iteration = header[2];
+  checkpoint->num_points = header[3];
+  checkpoint->has_random = header[4] != 0;
+  size = (size_t)checkpoint->K * checkpoint->dim;
+  checkpoint->centroids = engine_malloc(size * sizeof(double));
+  checkpoint->labels = checkpoint->num_points > 0 ? engine_malloc((size_t)checkpoint->num_points * sizeof(int)) : NULL;
+
+  ok = 1;
+  for (i = 0; checkpoint->has_random && ok && i < MT_STATE_SIZE; i++) {
+    ok = fread(&word, sizeof(word), 1, file) == 1;
+    checkpoint->random.mt[i] = word;
+  }
+  ok = ok && (!checkpoint->has_random || fread(&checkpoint->random.pos, sizeof(int), 1, file) == 1);
+  ok = ok && fread(checkpoint->centroids, sizeof(double), size, file) == size;
+  ok = ok && fread(checkpoint->labels, sizeof(int), checkpoint->num_points, file) == (size_t)checkpoint->num_points;
+  fclose(file);
+
+  if (!ok || (checkpoint->has_random && (checkpoint->random.pos < 0 || checkpoint->random.pos > MT_STATE_SIZE))) {
+    free_checkpoint(&checkpoint);
+    return NULL;
+  }
+  return checkpoint;
+}
+
+void free_checkpoint(struct Checkpoint **checkpoint_address) {
+  struct Checkpoint *checkpoint = *checkpoint_address;
+
+  if (checkpoint == NULL) {
+    return;
+  }
+  free(checkpoint->centroids);
+  free(checkpoint->labels);
+  free(checkpoint);
+  *checkpoint_address = NULL;
+}
+
+/* Saves snapshots of a running kmeans on a background thread, one write in flight at a time */
+struct CheckpointWriter {
+  const struct CheckpointPolicy *policy;
+  struct Checkpoint snapshot;
+  pthread_t thread;
+  int running;
+  int status;
+  double last;
+};
+
+static void *checkpoint_thread(void *arg) {
+  struct CheckpointWriter *writer = arg;
+
+  writer->status = write_checkpoint(writer->policy->path, &writer->snapshot);
+  return NULL;
+}
+
+static int init_checkpoint_writer(struct CheckpointWriter *writer, const struct CheckpointPolicy *policy, int K,
+                                  int dim, int num_points) {
+  /* Returns -1, with no snapshot to write, if there is no memory for one */
+  writer->policy = policy;
+  writer->running = 0;
+  writer->status = 0;
+  writer->last = monotonic_seconds();
+  writer->snapshot.K = K;
+  writer->snapshot.dim = dim;
+  writer->snapshot.num_points = num_points;
+  writer->snapshot.centroids = malloc((size_t)K * dim * sizeof(double));
+  writer->snapshot.labels = policy->labels ? malloc((size_t)num_points * sizeof(int)) : NULL;
+  writer->snapshot.has_random = policy->random != NULL;
+  if (policy->random != NULL) {
+    writer->snapshot.random = *policy->random;
+  }
+  if (writer->snapshot.centroids == NULL || (policy->labels && num_points > 0 && writer->snapshot.labels == NULL)) {
+    free(writer->snapshot.centroids);
+    free(writer->snapshot.labels);
+    writer->snapshot.centroids = NULL;
+    writer->snapshot.labels = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int finish_checkpoint(struct CheckpointWriter *writer) {
+  /* Wait for the write in flight. Returns -1 once any snapshot could not be saved, 0 otherwise */
+  if (writer->running) {
+    pthread_join(writer->thread, NULL);
+    writer->running = 0;
+  }
+  return writer->status != 0 ? -1 : 0;
+}
+
+static int checkpoint_due(const struct CheckpointWriter *writer, int iteration) {
+  const struct CheckpointPolicy *policy = writer->policy;
+
+  return (policy->every > 0 && iteration % policy->every == 0)
+         || (policy->seconds > 0.0 && monotonic_seconds() - writer->last >= policy->seconds);
+}
+
+static int save_checkpoint(struct CheckpointWriter *writer, const double *centroids, const int *labels,
+                           int iteration) {
+  /*
+  Snapshot the centroids and labels after iteration iterations and write them while the next
+  iterations run. The previous write is waited for first, so at most one snapshot is pending.
+  Returns -1, saving nothing, if the previous write failed.
+   */
+  if (finish_checkpoint(writer) == -1) {
+    return -1;
+  }
+  writer->snapshot.iteration = iteration;
+  memcpy(writer->snapshot.centroids, centroids, (size_t)writer->snapshot.K * writer->snapshot.dim * sizeof(double));
+  if (writer->snapshot.labels != NULL) {
+    memcpy(writer->snapshot.labels, labels, (size_t)writer->snapshot.num_points * sizeof(int));
+  }
+  writer->last = monotonic_seconds();
+  writer->running = pthread_create(&writer->thread, NULL, checkpoint_thread, writer) == 0;
+  if (!writer->running) {
+    checkpoint_thread(writer);
+  }
+  return 0;
+}
+
+static int free_checkpoint_writer(struct CheckpointWriter *writer) {
+  /* Wait for the last write, returns -1 if any snapshot could not be saved */
+  int status = finish_checkpoint(writer);
+
+  free(writer->snapshot.centroids);
+  free(writer->snapshot.labels);
+  return status;
+}
+
+
+/*
+CENTROID FUNCTIONS
+ */
+
+void update_centroid(const struct Dataset *data, int index, double *sum, int *num_points, double *weight) {
+  add_point_to_sum(data, index, sum);
+  (*num_points)++;
+  *weight += point_weight(data, index);
+}
+
+void remove_from_centroid(const struct Dataset *data, int index, double *sum, int *num_points, double *weight) {
+  subtract_point_from_sum(data, index, sum);
+  (*num_points)--;
+  *weight -= point_weight(data, index);
+}
+
+double finalize_next_centroid_pos(double *centroid, const double *sum, double weight, int dim) {
+  /*
+  Move centroid to the weighted mean of its accumulated points and return the distance
+  the centroid moved. Clusters without weight stay in place.
+   */
+  double distance;
+  double coord;
+  double shift = 0.0;
+  int i;
+
+  if (!(weight > 0.0)) {
+    return 0.0;
+  }
+
+  for (i = 0; i < dim; i++) {
+    coord = sum[i] / weight;
+    distance = coord - centroid[i];
+    shift += distance * distance;
+    centroid[i] = coord;
+  }
+
+  return sqrt(shift);
+}
+
+static double finalize_spherical_centroid(double *centroid, const double *sum, double weight, int dim,
+                                          double *previous) {
+  /*
+  finalize_next_centroid_pos followed by a projection back onto the unit sphere, returning the
+  distance between the old and new unit centroids. A mean of zero length keeps the old centroid.
+   */
+  memcpy(previous, centroid, dim * sizeof(double));
+  finalize_next_centroid_pos(centroid, sum, weight, dim);
+  if (normalize_point(centroid, dim) == 0.0) {
+    memcpy(centroid, previous, dim * sizeof(double));
+  }
+  return euclidean_distance(previous, centroid, dim);
+}
+
+int reduce_chunk_size(int num_points) {
+  /* Depends on the number of points only, so the reduction tree is the same for any thread count */
+  int chunk = REDUCE_CHUNK;
+
+  while (num_points / chunk > MAX_REDUCE_CHUNKS) {
+    chunk *= 2;
+  }
+  return chunk;
+}
+
+struct LloydPass {
+  struct Dataset *data;
+  const struct CentroidCache *cache;
+  /* Label of every point after the previous pass, -1 before the first */
+  int *labels;
+  int *next_labels;
+  double *partial_sums;
+  int *partial_counts;
+  double *partial_weights;
+  /* Clusters that gained or lost a point in a chunk on an incremental pass */
+  char *partial_touched;
+  /* Whether a chunk's partials hold anything this pass, and how many of its points changed label */
+  char *dirty;
+  int *changed;
+  int full;
+  int chunk;
+  int num_chunks;
+  int stride;
+};
+
+static int alloc_lloyd_pass(struct LloydPass *pass, int K, int dim) {
+  /* Labels and chunk partials of pass. Returns -1 if any is missing, free_lloyd_pass frees the others */
+  size_t num_points = (size_t)pass->data->num_points;
+  size_t num_chunks = (size_t)pass->num_chunks;
+
+  pass->labels = malloc(num_points * sizeof(int));
+  pass->next_labels = malloc(num_points * sizeof(int));
+  pass->partial_sums = malloc(num_chunks * K * dim * sizeof(double));
+  pass->partial_counts = malloc(num_chunks * K * sizeof(int));
+  pass->partial_weights = malloc(num_chunks * K * sizeof(double));
+  pass->partial_touched = malloc(num_chunks * K);
+  pass->dirty = malloc(num_chunks);
+  pass->changed = malloc(num_chunks * sizeof(int));
+  if ((num_points > 0 && (pass->labels == NULL || pass->next_labels == NULL))
+      || (num_chunks > 0 && (pass->partial_sums == NULL || pass->partial_counts == NULL
+                             || pass->partial_weights == NULL || pass->partial_touched == NULL
+                             || pass->dirty == NULL || pass->changed == NULL))) {
+    return -1;
+  }
+  return 0;
+}
+
+static void free_lloyd_pass(struct LloydPass *pass) {
+  free(pass->labels);
+  free(pass->next_labels);
+  free(pass->partial_sums);
+  free(pass->partial_counts);
+  free(pass->partial_weights);
+  free(pass->partial_touched);
+  free(pass->dirty);
+  free(pass->changed);
+}
+
+static void assign_and_accumulate_chunk(void *context, int task) {
+  /*
+  Label one chunk of points and record it in the chunk's own partial accumulators: every point
+  on a full pass, otherwise only the points that changed label, as -point on the old cluster
+  and +point on the new one.
+   */
+  struct LloydPass *pass = context;
+  int dim = pass->data->dim;
+  int K = pass->cache->K;
+  int start = task * pass->chunk;
+  int end = start + pass->chunk < pass->data->num_points ? start + pass->chunk : pass->data->num_points;
+  double *sums = pass->partial_sums + (size_t)task * K * dim;
+  int *counts = pass->partial_counts + (size_t)task * K;
+  double *weights = pass->partial_weights + (size_t)task * K;
+  char *touched = pass->partial_touched + (size_t)task * K;
+  int old_label;
+  int new_label;
+  int j;
+
+  pass->dirty[task] = 0;
+  pass->changed[task] = 0;
+  assign_range(pass->data, pass->cache, start, end, pass->next_labels);
+
+  for (j = start; j < end; j++) {
+    old_label = pass->labels[j];
+    new_label = pass->next_labels[j];
+    if (old_label != new_label) {
+      pass->changed[task]++;
+    }
+    if (!pass->full && old_label == new_label) {
+      continue;
+    }
+
+    if (!pass->dirty[task]) {
+      memset(sums, 0, (size_t)K * dim * sizeof(double));
+      memset(counts, 0, K * sizeof(int));
+      memset(weights, 0, K * sizeof(double));
+      memset(touched, 0, K);
+      pass->dirty[task] = 1;
+    }
+    if (!pass->full) {
+      remove_from_centroid(pass->data, j, sums + (size_t)old_label * dim, counts + old_label, weights + old_label);
+      touched[old_label] = 1;
+      touched[new_label] = 1;
+    }
+    update_centroid(pass->data, j, sums + (size_t)new_label * dim, counts + new_label, weights + new_label);
+    pass->labels[j] = new_label;
+  }
+}
+
+static void reduce_chunk_pair(void *context, int task) {
+  /* One node of the reduction tree: chunk i absorbs chunk i + stride */
+  struct LloydPass *pass = context;
+  size_t size = (size_t)pass->cache->K * pass->data->dim;
+  int first = task * 2 * pass->stride;
+  int second = first + pass->stride;
+  double *sums = pass->partial_sums + (size_t)first * size;
+  const double *other_sums = pass->partial_sums + (size_t)second * size;
+  int *counts = pass->partial_counts + (size_t)first * pass->cache->K;
+  const int *other_counts = pass->partial_counts + (size_t)second * pass->cache->K;
+  double *weights = pass->partial_weights + (size_t)first * pass->cache->K;
+  const double *other_weights = pass->partial_weights + (size_t)second * pass->cache->K;
+  char *touched = pass->partial_touched + (size_t)first * pass->cache->K;
+  const char *other_touched = pass->partial_touched + (size_t)second * pass->cache->K;
+  size_t i;
+
+  if (!pass->dirty[second]) {
+    return;
+  }
+  if (!pass->dirty[first]) {
+    memcpy(sums, other_sums, size * sizeof(double));
+    memcpy(counts, other_counts, pass->cache->K * sizeof(int));
+    memcpy(weights, other_weights, pass->cache->K * sizeof(double));
+    memcpy(touched, other_touched, pass->cache->K);
+    pass->dirty[first] = 1;
+    return;
+  }
+
+  for (i = 0; i < size; i++) {
+    sums[i] += other_sums[i];
+  }
+  for (i = 0; i < (size_t)pass->cache->K; i++) {
+    counts[i] += other_counts[i];
+    weights[i] += other_weights[i];
+    touched[i] |= other_touched[i];
+  }
+}
+
+void init_stats(struct KMeansStats *stats) {
+  stats->iterations = 0;
+  stats->capacity = 0;
+  stats->history = NULL;
+  stats->num_threads = 0;
+  stats->threads = NULL;
+}
+
+void free_stats(struct KMeansStats *stats) {
+  free(stats->history);
+  free(stats->threads);
+  init_stats(stats);
+}
+
+static void record_iteration(struct KMeansStats *stats, int active_clusters, int changed_points, double max_shift) {
+  struct IterationStats *record;
+
+  if (stats == NULL) {
+    return;
+  }
+  if (stats->iterations == stats->capacity) {
+    stats->capacity = stats->capacity == 0 ? 64 : 2 * stats->capacity;
+    stats->history = realloc(stats->history, stats->capacity * sizeof(struct IterationStats));
+    if (stats->history == NULL) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  record = stats->history + stats->iterations++;
+  record->active_clusters = active_clusters;
+  record->changed_points = changed_points;
+  record->max_shift = max_shift;
+}
+
+static void run_lloyd_tasks(int num_threads, const struct Placement *placement, int num_tasks,
+                            void (*run)(void *context, int task), void *context) {
+  if (placement != NULL) {
+    parallel_for_placed(placement, num_tasks, run, context);
+  }
+  else {
+    parallel_for(num_threads, num_tasks, run, context);
+  }
+}
+
+void default_options(struct KMeansOptions *options) {
+  options->iter = 300;
+  options->epsilon = 0.0;
+  options->num_threads = get_num_threads();
+  options->refresh_interval = REFRESH_INTERVAL;
+  options->numa = 0;
+  options->cancel = NULL;
+  options->checkpoint = NULL;
+  options->start_iteration = 0;
+  options->progress = NULL;
+  options->progress_context = NULL;
+  options->progress_every = 0;
+  options->progress_seconds = 0.0;
+  options->max_chunks = 0;
+}
+
+int kmeans(struct Dataset *data, double *centroids, int K, const struct KMeansOptions *options,
+           struct KMeansStats *stats) {
+  /*
+  Run Lloyd iterations on centroids (K x dim, updated in place) until no centroid
+  moves more than epsilon or iter iterations are done. Returns the number of iterations, or
+  KMEANS_NO_MEMORY, before any iteration, if the buffers of the run cannot be allocated.
+
+  Points are split into fixed-size chunks that are labelled and summed independently, then the
+  chunk sums are combined pairwise in a fixed tree. Neither depends on the thread count, so the
+  centroids are bit-identical for any number of threads.
+
+  Cluster sums and counts persist between iterations and only the points that changed cluster
+  are moved between them. Every refresh_interval iterations (and on the first) the sums are
+  rebuilt from scratch to bound rounding drift; refresh_interval <= 1 rebuilds them every time.
+
+  Between rebuilds a cluster no point entered or left keeps exactly the same sum, so only the
+  active clusters are recomputed and checked for convergence, and the loop stops as soon as no
+  cluster is active. options->max_chunks caps the number of chunks, and with it the memory of
+  their partial sums, at the price of a different but still fixed tree. stats, if not NULL,
+  receives one record per iteration and the work-stealing counters of every thread of the
+  assignment pass (see parallel_for_stealing).
+
+  Points with weights move their cluster mean in proportion to their weight.
+
+  If options->cancel is set, the loop stops before the next iteration and the centroids are
+  those of the last completed one.
+
+  With options->checkpoint the centroids, iteration count and optionally the labels they were
+  computed from are saved on the policy's schedule and once more when the run ends. Snapshots are
+  written on a background thread while the iterations go on. If one cannot be written the run
+  stops at the next snapshot and kmeans returns KMEANS_CHECKPOINT_FAILED, the centroids being
+  those of the last completed iteration. A run resumed from a checkpoint passes its iteration
+  as options->start_iteration and counts on from there.
+
+  options->progress, if not NULL, is called on its own schedule with the iteration, the largest
+  centroid shift, the inertia and the number of reassigned points; the inertia pass only runs
+  on those iterations. The run stops after an iteration whose report returns 0.
+
+  On a spherical dataset (see normalize_dataset) centroids are kept on the unit sphere: they are
+  normalised on entry and after every update, and points join the centroid of largest cosine.
+
+  With options->numa the point buffer is first moved next to the pinned threads that own each
+  chunk (see place_dataset) and every pass runs on those threads, chunks only leaving their
+  owner when another thread runs out of work. Each thread owns a contiguous
+  range of chunks and threads of one node are consecutive, so the lower levels of the same
+  reduction tree combine partials within a node and only the top levels cross nodes.
+   */
+  int dim = data->dim;
+  size_t size = (size_t)K * dim;
+  double *sums = calloc(size, sizeof(double));
+  int *counts = calloc(K, sizeof(int));
+  double *weights = calloc(K, sizeof(double));
+  double *previous = malloc(dim * sizeof(double));
+  struct LloydPass pass;
+  struct CentroidCache cache;
+  struct Placement placement;
+  struct Placement *placed = NULL;
+  struct CheckpointWriter writer;
+  struct ProgressReport report;
+  double last_report = monotonic_seconds();
+  /* Small problems run on the caller alone, waking threads would cost more than they save */
+  int num_threads = work_threads(options->num_threads, (double)data->num_points * K * dim);
+  double delta;
+  double max_shift;
+  int converge;
+  int num_active;
+  int num_changed;
+  /* 0, or why the run cannot go on: KMEANS_NO_MEMORY or KMEANS_CHECKPOINT_FAILED */
+  int status = 0;
+  int i;
+  int m;
+  size_t j;
+
+  pass.data = data;
+  pass.cache = &cache;
+  pass.chunk = reduce_chunk_size(data->num_points);
+  pass.num_chunks = (data->num_points + pass.chunk - 1) / pass.chunk;
+  if (options->max_chunks > 0 && pass.num_chunks > options->max_chunks) {
+    pass.chunk = (data->num_points + options->max_chunks - 1) / options->max_chunks;
+    pass.num_chunks = (data->num_points + pass.chunk - 1) / pass.chunk;
+  }
+  if (alloc_lloyd_pass(&pass, K, dim) == -1 || sums == NULL || counts == NULL || weights == NULL
+      || previous == NULL) {
+    free_lloyd_pass(&pass);
+    free(sums);
+    free(counts);
+    free(weights);
+    free(previous);
+    return KMEANS_NO_MEMORY;
+  }
+
+  for (j = 0; j < (size_t)data->num_points; j++) {
+    pass.labels[j] = -1;
+  }
+  if (data->spherical) {
+    for (m = 0; m < K; m++) {
+      normalize_point(centroids + (size_t)m * dim, dim);
+    }
+  }
+  if (options->numa) {
+    create_placement(&placement, num_threads);
+    placed = &placement;
+    if (place_dataset(data, &placement, pass.chunk) == -1) {
+      status = KMEANS_NO_MEMORY;
+    }
+  }
+  if (options->checkpoint != NULL && init_checkpoint_writer(&writer, options->checkpoint, K, dim,
+                                                            data->num_points) == -1) {
+    status = KMEANS_NO_MEMORY;
+  }
+  if (stats != NULL && stats->threads == NULL) {
+    stats->num_threads = num_threads;
+    stats->threads = engine_calloc(stats->num_threads, sizeof(struct ThreadStats));
+  }
+
+  /* Perform K-Means iter times */
+  for (i = options->start_iteration; status == 0 && i < options->iter; i++) {
+    if (options->cancel != NULL && *options->cancel) {
+      break;
+    }
+    /* The first pass of a run, resumed or not, has no labels to update incrementally */
+    pass.full = i == options->start_iteration || options->refresh_interval <= 1
+                || i % options->refresh_interval == 0;
+
+    /* Go over all points to assign the closest cluster*/
+    prepare_centroids(data, centroids, K, &cache);
+    parallel_for_stealing(num_threads, placed, pass.num_chunks, assign_and_accumulate_chunk, &pass,
+                          stats != NULL ? stats->threads : NULL);
+    for (pass.stride = 1; pass.stride < pass.num_chunks; pass.stride *= 2) {
+      run_lloyd_tasks(num_threads, placed, (pass.num_chunks + pass.stride - 1) / (2 * pass.stride),
+                      reduce_chunk_pair, &pass);
+    }
+    free_centroid_cache(&cache);
+
+    if (pass.full) {
+      memcpy(sums, pass.partial_sums, size * sizeof(double));
+      memcpy(counts, pass.partial_counts, K * sizeof(int));
+      memcpy(weights, pass.partial_weights, K * sizeof(double));
+    }
+    else if (pass.dirty[0]) {
+      for (j = 0; j < size; j++) {
+        sums[j] += pass.partial_sums[j];
+      }
+      for (m = 0; m < K; m++) {
+        counts[m] += pass.partial_counts[m];
+        weights[m] += pass.partial_weights[m];
+      }
+    }
+
+    num_changed = 0;
+    for (m = 0; m < pass.num_chunks; m++) {
+      num_changed += pass.changed[m];
+    }
+
+    converge = 1;
+    num_active = 0;
+    max_shift = 0.0;
+    /* Go over the active clusters to check for convergence */
+    for (m = 0; m < K; m++) {
+      if (!pass.full && !(pass.dirty[0] && pass.partial_touched[m])) {
+        continue;
+      }
+      num_active++;
+      /* A cluster that lost every point is empty even if rounding left some weight behind */
+      if (data->spherical) {
+        delta = finalize_spherical_centroid(centroids + (size_t)m * dim, sums + (size_t)m * dim,
+                                            counts[m] > 0 ? weights[m] : 0.0, dim, previous);
+      }
+      else {
+        delta = finalize_next_centroid_pos(centroids + (size_t)m * dim, sums + (size_t)m * dim,
+                                           counts[m] > 0 ? weights[m] : 0.0, dim);
+      }
+      if (delta > max_shift) {
+        max_shift = delta;
+      }
+      if (delta > options->epsilon) {
+        converge = 0;
+      }
+    }
+    record_iteration(stats, num_active, num_changed, max_shift);
+
+    if (converge || num_active == 0) {
+      i++;
+      break;
+    }
+    if (options->checkpoint != NULL && checkpoint_due(&writer, i + 1)
+        && save_checkpoint(&writer, centroids, pass.labels, i + 1) == -1) {
+      i++;
+      break;
+    }
+    if (options->progress != NULL
+        && ((options->progress_every > 0 && (i + 1) % options->progress_every == 0)
+            || (options->progress_seconds > 0.0 && monotonic_seconds() - last_report >= options->progress_seconds))) {
+      report.iteration = i + 1;
+      report.max_shift = max_shift;
+      report.inertia = labelled_inertia(data, centroids, pass.labels, NULL);
+      report.changed_points = num_changed;
+      last_report = monotonic_seconds();
+      if (!options->progress(options->progress_context, &report)) {
+        i++;
+        break;
+      }
+    }
+  }
+
+  if (options->checkpoint != NULL) {
+    if (status == 0 && i > options->start_iteration) {
+      save_checkpoint(&writer, centroids, pass.labels, i);
+    }
+    if (free_checkpoint_writer(&writer) == -1 && status == 0) {
+      status = KMEANS_CHECKPOINT_FAILED;
+    }
+  }
+
+  free(sums);
+  free(counts);
+  free(weights);
+  free(previous);
+  free_lloyd_pass(&pass);
+  if (placed != NULL) {
+    free_placement(placed);
+  }
+  return status == 0 ? i : status;
+}
+
+
+/*
+MEMORY PLANNING
+ */
+static int default_chunks(long num_points, int max_chunks) {
+  long chunk = reduce_chunk_size(num_points > INT_MAX ? INT_MAX : (int)num_points);
+  long num_chunks = (num_points + chunk - 1) / chunk;
+
+  if (max_chunks > 0 && num_chunks > max_chunks) {
+    num_chunks = max_chunks;
+  }
+  return (int)num_chunks;
+}
+
+static size_t chunk_bytes(int dim, int K) {
+  /* Partial sums, counts, weights and touched flags of one chunk, with its dirty flag and change count */
+  return (size_t)K * dim * sizeof(double) + (size_t)K * (sizeof(int) + sizeof(double) + 1) + 1 + sizeof(int);
+}
+
+void estimate_memory(long num_points, int dim, int K, const struct MemoryPlan *plan, struct MemoryEstimate *estimate) {
+  /*
+  What a fit with plan allocates for num_points points of dim dimensions and K clusters,
+  including the dataset itself but not the caller's copy of the input. Copies that are freed
+  along the way are counted as if they all lived to the end, so the total is an upper bound.
+   */
+  size_t n = (size_t)num_points;
+  size_t centroid_size = (size_t)K * dim * sizeof(double);
+  size_t norms = dim >= GEMM_MIN_DIM ? n * sizeof(double) : 0;
+  size_t buffer;
+
+  if (plan->storage == STORAGE_QUANTIZED) {
+    buffer = n * dim;
+    estimate->points = buffer + 2 * (size_t)dim * sizeof(double);
+  }
+  else if (plan->storage == STORAGE_CSR) {
+    buffer = (size_t)plan->nnz * (sizeof(double) + sizeof(int));
+    estimate->points = buffer + (n + 1) * sizeof(long) + n * sizeof(double);
+  }
+  else {
+    buffer = n * dim * sizeof(double);
+    estimate->points = buffer + norms;
+  }
+  if (plan->weights) {
+    estimate->points += n * sizeof(double);
+  }
+
+  /* Every row may be distinct, the hash table of collapse_duplicates is freed before they are copied */
+  estimate->copies = 0;
+  if (plan->deduplicate) {
+    estimate->copies += buffer + norms + n * (sizeof(double) + sizeof(int));
+  }
+  if (plan->numa) {
+    estimate->copies += buffer;
+  }
+
+  /* The Lloyd loop's two label arrays, the returned labels with the list holding them, and the checkpoint's copy */
+  estimate->labels = 2 * n * sizeof(int) + (plan->labels ? n * (sizeof(int) + sizeof(void *)) : 0);
+  if (plan->checkpoint && plan->checkpoint_labels) {
+    estimate->labels += n * sizeof(int);
+  }
+  estimate->reduction = (size_t)default_chunks(num_points, plan->max_chunks) * chunk_bytes(dim, K);
+  /* Centroids, cluster sums, counts and weights, and the cache's norms and transposed or shifted copy */
+  estimate->centroids = 3 * centroid_size + (size_t)K * (sizeof(int) + 2 * sizeof(double)) + dim * sizeof(double);
+  if (plan->checkpoint) {
+    estimate->centroids += centroid_size;
+  }
+  estimate->overhead = MEMORY_OVERHEAD;
+  estimate->total = estimate->points + estimate->copies + estimate->labels + estimate->reduction
+                    + estimate->centroids + estimate->overhead;
+}
+
+int plan_memory(long num_points, int dim, int K, size_t max_memory, struct MemoryPlan *plan,
+                struct MemoryEstimate *estimate) {
+  /*
+  Fit a run into max_memory bytes by giving up, in this order, exact coordinates (quantized
+  storage, an eighth of the dense size, only if plan->allow_quantize), reduction chunks (fewer,
+  larger chunks), and the returned labels. plan holds the input on entry and the first layout that fits on return,
+  estimate what it costs. Returns -1 if even the smallest layout does not fit.
+   */
+  size_t other;
+  size_t per_chunk = chunk_bytes(dim, K);
+  long chunks;
+
+  plan->max_chunks = 0;
+  estimate_memory(num_points, dim, K, plan, estimate);
+  if (estimate->total <= max_memory) {
+    return 0;
+  }
+
+  if (plan->storage == STORAGE_DENSE && plan->allow_quantize) {
+    plan->storage = STORAGE_QUANTIZED;
+    estimate_memory(num_points, dim, K, plan, estimate);
+    if (estimate->total <= max_memory) {
+      return 0;
+    }
+  }
+
+  /* As many chunks as the memory left after everything else allows, with the labels and then without */
+  for (;;) {
+    other = estimate->total - estimate->reduction;
+    if (other < max_memory && (max_memory - other) / per_chunk >= 1) {
+      chunks = (long)((max_memory - other) / per_chunk);
+      plan->max_chunks = chunks > INT_MAX ? INT_MAX : (int)chunks;
+      estimate_memory(num_points, dim, K, plan, estimate);
+      return 0;
+    }
+    if (!plan->labels) {
+      /* Report the smallest layout */
+      plan->max_chunks = 1;
+      estimate_memory(num_points, dim, K, plan, estimate);
+      return -1;
+    }
+    plan->labels = 0;
+    estimate_memory(num_points, dim, K, plan, estimate);
+  }
+}
+
+
+/*
+ONLINE UPDATES
+ */
+
+struct OnlineModel *create_online_model(const double *centroids, int K, int dim, int mini_batch, double decay) {
+  struct OnlineModel *model = engine_malloc(sizeof(struct OnlineModel));
+
+  model->centroids = engine_malloc((size_t)K * dim * sizeof(double));
+  model->counts = engine_calloc(K, sizeof(double));
+  model->kernels = select_kernels(dim);
+  model->K = K;
+  model->dim = dim;
+  model->mini_batch = mini_batch;
+  model->decay = decay;
+  model->num_batches = 0;
+  memcpy(model->centroids, centroids, (size_t)K * dim * sizeof(double));
+  return model;
+}
+
+void free_online_model(struct OnlineModel **model_address) {
+  if (model_address == NULL || *model_address == NULL) {
+    return;
+  }
+  free((*model_address)->centroids);
+  free((*model_address)->counts);
+  free(*model_address);
+  *model_address = NULL;
+}
+
+static void sequential_update(struct OnlineModel *model, const struct Dataset *batch) {
+  /*
+  MacQueen's update: every point in turn moves its closest centroid towards it by
+  weight / (weight the centroid has absorbed), so each centroid stays the running mean.
+   */
+  double *point = engine_malloc(model->dim * sizeof(double));
+  double *centroid;
+  double rate;
+  double weight;
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < batch->num_points; i++) {
+    weight = point_weight(batch, i);
+    if (!(weight > 0.0)) {
+      continue;
+    }
+    decode_point(batch, i, point);
+    k = closest_centroid(model->kernels, model->centroids, model->K, model->dim, point);
+
+    centroid = model->centroids + (size_t)k * model->dim;
+    model->counts[k] += weight;
+    rate = weight / model->counts[k];
+    for (j = 0; j < model->dim; j++) {
+      centroid[j] += rate * (point[j] - centroid[j]);
+    }
+  }
+
+  free(point);
+}
+
+static void mini_batch_update(struct OnlineModel *model, struct Dataset *batch) {
+  /*
+  The whole batch is labelled against the centroids it arrived to, then each centroid moves to
+  the weighted mean of its absorbed weight and its share of the batch.
+   */
+  int dim = model->dim;
+  int K = model->K;
+  int *labels = engine_malloc((size_t)batch->num_points * sizeof(int));
+  double *sums = engine_calloc((size_t)K * dim, sizeof(double));
+  double *weights = engine_calloc(K, sizeof(double));
+  int *counts = engine_calloc(K, sizeof(int));
+  double *centroid;
+  int i;
+  int j;
+  int k;
+
+  assign_labels(batch, model->centroids, K, labels);
+  for (i = 0; i < batch->num_points; i++) {
+    update_centroid(batch, i, sums + (size_t)labels[i] * dim, counts + labels[i], weights + labels[i]);
+  }
+
+  for (k = 0; k < K; k++) {
+    if (counts[k] == 0 || !(weights[k] > 0.0)) {
+      continue;
+    }
+    centroid = model->centroids + (size_t)k * dim;
+    model->counts[k] += weights[k];
+    for (j = 0; j < dim; j++) {
+      centroid[j] += (sums[(size_t)k * dim + j] - weights[k] * centroid[j]) / model->counts[k];
+    }
+  }
+
+  free(labels);
+  free(sums);
+  free(weights);
+  free(counts);
+}
+
+void online_update(struct OnlineModel *model, struct Dataset *batch) {
+  /*
+  Fold one batch into the model without keeping its points, in time proportional to the batch.
+  decay < 1 first scales down the weight every centroid has absorbed, so older batches count
+  for geometrically less and the centroids follow data that drifts.
+   */
+  int k;
+
+  if (model->num_batches > 0 && model->decay < 1.0) {
+    for (k = 0; k < model->K; k++) {
+      model->counts[k] *= model->decay;
+    }
+  }
+
+  if (model->mini_batch) {
+    mini_batch_update(model, batch);
+  }
+  else {
+    sequential_update(model, batch);
+  }
+  model->num_batches++;
+}
+
+
+/*
+RANDOM NUMBERS AND SEEDING
+ */
+
+void seed_random(struct RandomState *random, unsigned long seed) {
+  /* init_genrand, which numpy's legacy np.random.seed uses for integer seeds */
+  int i;
+
+  random->mt[0] = seed & 0xffffffffUL;
+  for (i = 1; i < MT_STATE_SIZE; i++) {
+    random->mt[i] = (1812433253UL * (random->mt[i - 1] ^ (random->mt[i - 1] >> 30)) + i) & 0xffffffffUL;
+  }
+  random->pos = MT_STATE_SIZE;
+}
+
+static void generate_random(struct RandomState *random) {
+  unsigned long y;
+  int i;
+
+  for (i = 0; i < MT_STATE_SIZE; i++) {
+    y = (random->mt[i] & 0x80000000UL) | (random->mt[(i + 1) % MT_STATE_SIZE] & 0x7fffffffUL);
+    random->mt[i] = random->mt[(i + 397) % MT_STATE_SIZE] ^ (y >> 1) ^ ((y & 1UL) ? 0x9908b0dfUL : 0UL);
+  }
+  random->pos = 0;
+}
+
+unsigned long random_uint32(struct RandomState *random) {
+  unsigned long y;
+
+  if (random->pos == MT_STATE_SIZE) {
+    generate_random(random);
+  }
+  y = random->mt[random->pos++];
+  y ^= (y >> 11);
+  y ^= (y << 7) & 0x9d2c5680UL;
+  y ^= (y << 15) & 0xefc60000UL;
+  y ^= (y >> 18);
+  return y & 0xffffffffUL;
+}
+
+double random_double(struct RandomState *random) {
+  /* 53 bit uniform in [0, 1), as np.random.random_sample */
+  long a = (long)(random_uint32(random) >> 5);
+  long b = (long)(random_uint32(random) >> 6);
+
+  return (a * 67108864.0 + b) / 9007199254740992.0;
+}
+
+long random_bounded(struct RandomState *random, long n) {
+  /* Uniform in [0, n) by masked rejection, as np.random.randint(0, n) for n <= 2^32 */
+  unsigned long range = (unsigned long)(n - 1);
+  unsigned long mask = range;
+  unsigned long value;
+
+  if (range == 0) {
+    return 0;
+  }
+  mask |= mask >> 1;
+  mask |= mask >> 2;
+  mask |= mask >> 4;
+  mask |= mask >> 8;
+  mask |= mask >> 16;
+
+  do {
+    value = random_uint32(random) & mask;
+  } while (value > range);
+  return (long)value;
+}
+
+long random_choice(struct RandomState *random, const double *weights, long n) {
+  /*
+  Index drawn with probability weights[i] / sum(weights), as np.random.choice(n, p=weights / sum):
+  the first i whose normalised cumulative probability exceeds one uniform draw.
+  Returns -1 if all weights are zero.
+   */
+  double total = 0.0;
+  double cumulative;
+  double last;
+  double uniform;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    total += weights[i];
+  }
+  if (!(total > 0.0)) {
+    return -1;
+  }
+
+  /* Same rounding steps as numpy: probabilities, their running sum, then division by its last entry */
+  last = 0.0;
+  for (i = 0; i < n; i++) {
+    last += weights[i] / total;
+  }
+
+  uniform = random_double(random);
+  cumulative = 0.0;
+  for (i = 0; i < n; i++) {
+    cumulative += weights[i] / total;
+    if (cumulative / last > uniform) {
+      return i;
+    }
+  }
+  return n - 1;
+}
+
+void kmeans_pp_init(const struct Dataset *data, int K, struct RandomState *random, int *chosen) {
+  /*
+  kmeans++ seeding with the semantics of kmeans_pp.py: the first centroid is uniform, each next
+  one is drawn with probability proportional to the distance of a point to its closest chosen
+  centroid. Chosen points leave the candidate list, so the draws index the remaining points in
+  their original order. chosen receives the K original point indices in selection order.
+  With point weights the first centroid is drawn proportional to weight and every next one
+  proportional to weight times distance.
+  Precondition: data is dense.
+   */
+  int *remaining = engine_malloc((size_t)data->num_points * sizeof(int));
+  double *min_dist = engine_malloc((size_t)data->num_points * sizeof(double));
+  double *probs = data->weights != NULL ? engine_malloc((size_t)data->num_points * sizeof(double)) : NULL;
+  const double *centroid;
+  double dist;
+  long pick;
+  int num_remaining = data->num_points;
+  int dim = data->dim;
+  int i;
+  int k;
+
+  for (i = 0; i < num_remaining; i++) {
+    remaining[i] = i;
+  }
+
+  if (data->weights != NULL) {
+    pick = random_choice(random, data->weights, num_remaining);
+  }
+  else {
+    pick = random_bounded(random, num_remaining);
+  }
+  for (k = 0; k < K; k++) {
+    if (pick == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    chosen[k] = remaining[pick];
+    memmove(remaining + pick, remaining + pick + 1, (num_remaining - pick - 1) * sizeof(int));
+    memmove(min_dist + pick, min_dist + pick + 1, (num_remaining - pick - 1) * sizeof(double));
+    num_remaining--;
+
+    if (k == K - 1) {
+      break;
+    }
+
+    /* The closest centroid distance only changes through the newest centroid */
+    centroid = data->points + (size_t)chosen[k] * dim;
+    for (i = 0; i < num_remaining; i++) {
+      dist = sqrt(data->kernels->distance(data->points + (size_t)remaining[i] * dim, centroid, dim));
+      if (k == 0 || dist < min_dist[i]) {
+        min_dist[i] = dist;
+      }
+    }
+
+    if (data->weights != NULL) {
+      for (i = 0; i < num_remaining; i++) {
+        probs[i] = data->weights[remaining[i]] * min_dist[i];
+      }
+      pick = random_choice(random, probs, num_remaining);
+    }
+    else {
+      pick = random_choice(random, min_dist, num_remaining);
+    }
+  }
+
+  free(remaining);
+  free(min_dist);
+  free(probs);
+}
+
+
+/*
+CORESET CONSTRUCTION
+ */
+
+struct CoresetPass {
+  const struct Dataset *data;
+  const double *center;
+  int center_index;
+  /* Squared distance of every point to its closest center so far, and that center */
+  double *min_dist;
+  int *nearest;
+  int chunk;
+};
+
+static void update_nearest_center_chunk(void *context, int task) {
+  struct CoresetPass *pass = context;
+  const struct Dataset *data = pass->data;
+  int start = task * pass->chunk;
+  int end = start + pass->chunk < data->num_points ? start + pass->chunk : data->num_points;
+  double dist;
+  int i;
+
+  for (i = start; i < end; i++) {
+    dist = data->kernels->distance(data->points + (size_t)i * data->dim, pass->center, data->dim);
+    if (pass->center_index == 0 || dist < pass->min_dist[i]) {
+      pass->min_dist[i] = dist;
+      pass->nearest[i] = pass->center_index;
+    }
+  }
+}
+
+static int sample_index(const double *cumulative, int n, double target) {
+  /* First i with cumulative[i] > target */
+  int low = 0;
+  int high = n - 1;
+  int mid;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (cumulative[mid] > target) {
+      high = mid;
+    }
+    else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+struct Dataset *build_coreset(const struct Dataset *data, int size, int num_centers, int num_threads,
+                              struct RandomState *random) {
+  /*
+  Sensitivity sampled coreset of size weighted points (Bachem, Lucic and Krause, "Practical
+  coreset constructions for machine learning", algorithm 2).
+
+  A bicriteria solution B of num_centers centers is drawn by D^2 sampling. Each point x, whose
+  closest center b has cluster B_x, gets the sensitivity bound
+    s(x) = a d(x, B)^2 / c + 2a sum_{y in B_x} d(y, B)^2 / (|B_x| c) + 4N / |B_x|
+  with a = 16 (log num_centers + 2) and c the mean of d(y, B)^2. size points are drawn with
+  replacement with probability q(x) = s(x) / sum(s) and weighted 1 / (size q(x)), so the
+  weighted cost of any K centers estimates the cost on the full data without bias.
+  Precondition: data is dense and unweighted.
+   */
+  struct Dataset *coreset = create_dataset(size, data->dim);
+  struct CoresetPass pass;
+  double *cluster_cost = engine_calloc(num_centers, sizeof(double));
+  int *cluster_size = engine_calloc(num_centers, sizeof(int));
+  double *cumulative = engine_malloc((size_t)data->num_points * sizeof(double));
+  double alpha = 16.0 * (log((double)num_centers) + 2.0);
+  double mean_cost = 0.0;
+  double sensitivity;
+  double total;
+  long pick;
+  int num_chunks;
+  int n = data->num_points;
+  int c;
+  int i;
+
+  pass.data = data;
+  pass.min_dist = engine_malloc((size_t)n * sizeof(double));
+  pass.nearest = engine_malloc((size_t)n * sizeof(int));
+  pass.chunk = reduce_chunk_size(n);
+  num_chunks = (n + pass.chunk - 1) / pass.chunk;
+
+  /* Bicriteria solution: the first center uniform, each next one proportional to d(x, B)^2 */
+  pick = random_bounded(random, n);
+  for (c = 0; c < num_centers; c++) {
+    pass.center = data->points + (size_t)pick * data->dim;
+    pass.center_index = c;
+    parallel_for(num_threads, num_chunks, update_nearest_center_chunk, &pass);
+    if (c + 1 == num_centers) {
+      break;
+    }
+
+    pick = random_choice(random, pass.min_dist, n);
+    if (pick == -1) {
+      /* Every point already sits on a center */
+      num_centers = c + 1;
+      break;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    cluster_cost[pass.nearest[i]] += pass.min_dist[i];
+    cluster_size[pass.nearest[i]]++;
+    mean_cost += pass.min_dist[i];
+  }
+  mean_cost /= n;
+
+  total = 0.0;
+  for (i = 0; i < n; i++) {
+    c = pass.nearest[i];
+    sensitivity = 4.0 * n / cluster_size[c];
+    if (mean_cost > 0.0) {
+      sensitivity += alpha * pass.min_dist[i] / mean_cost
+                     + 2.0 * alpha * cluster_cost[c] / (cluster_size[c] * mean_cost);
+    }
+    /* min_dist[i] is not needed any more once its cluster totals are known */
+    pass.min_dist[i] = sensitivity;
+    total += sensitivity;
+    cumulative[i] = total;
+  }
+
+  coreset->weights = engine_malloc((size_t)size * sizeof(double));
+  for (i = 0; i < size; i++) {
+    pick = sample_index(cumulative, n, random_double(random) * total);
+    memcpy(coreset->points + (size_t)i * data->dim, data->points + (size_t)pick * data->dim,
+           data->dim * sizeof(double));
+    coreset->weights[i] = total / (size * pass.min_dist[pick]);
+  }
+
+  free(cluster_cost);
+  free(cluster_size);
+  free(cumulative);
+  free(pass.min_dist);
+  free(pass.nearest);
+  return coreset;
+}
+
+
+/*
+DUPLICATE COLLAPSING
+ */
+
+static unsigned long hash_row(const double *row, int dim) {
+  /* FNV-1a over the bytes of the row, with -0.0 folded into 0.0 so equal rows hash equally */
+  unsigned long hash = 2166136261UL;
+  const unsigned char *bytes;
+  double value;
+  size_t b;
+  int j;
+
+  for (j = 0; j < dim; j++) {
+    value = row[j] + 0.0;
+    bytes = (const unsigned char *)&value;
+    for (b = 0; b < sizeof(double); b++) {
+      hash = ((hash ^ bytes[b]) * 16777619UL) & 0xffffffffUL;
+    }
+  }
+  return hash;
+}
+
+static int rows_equal(const double *row, const double *other, int dim) {
+  int j;
+
+  for (j = 0; j < dim; j++) {
+    if (row[j] != other[j]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct Dataset *collapse_duplicates(const struct Dataset *data, int *inverse) {
+  /*
+  Dense dataset of the distinct rows of data in order of first appearance, each weighing the
+  total weight of its copies, so Lloyd on it gives the same clusters as on data while every
+  repeated row is labelled and summed once per iteration. inverse[i] receives the distinct
+  row of point i, which maps labels of the distinct rows back to the original points.
+  Rows are found through an open addressing hash table of twice the number of points, holding
+  the index of the first copy of every distinct row. Returns NULL if memory runs out.
+  Precondition: data is dense.
+   */
+  int dim = data->dim;
+  size_t capacity = 2;
+  size_t slot;
+  int *table;
+  int num_unique = 0;
+  struct Dataset *unique;
+  const double *row;
+  int i;
+
+  while (capacity < 2 * (size_t)data->num_points) {
+    capacity *= 2;
+  }
+  table = malloc(capacity * sizeof(int));
+  if (table == NULL) {
+    return NULL;
+  }
+  for (slot = 0; slot < capacity; slot++) {
+    table[slot] = -1;
+  }
+
+  for (i = 0; i < data->num_points; i++) {
+    row = data->points + (size_t)i * dim;
+    slot = hash_row(row, dim) & (capacity - 1);
+    while (table[slot] != -1 && !rows_equal(data->points + (size_t)table[slot] * dim, row, dim)) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    if (table[slot] == -1) {
+      table[slot] = i;
+      inverse[i] = num_unique++;
+    }
+    else {
+      inverse[i] = inverse[table[slot]];
+    }
+  }
+  free(table);
+
+  /* Distinct rows are numbered in order of first appearance, so a first copy is where the next number appears */
+  unique = try_create_dataset(num_unique, dim);
+  if (unique == NULL) {
+    return NULL;
+  }
+  unique->weights = calloc(num_unique, sizeof(double));
+  if (unique->weights == NULL) {
+    free_dataset(&unique);
+    return NULL;
+  }
+  unique->spherical = data->spherical;
+  num_unique = 0;
+  for (i = 0; i < data->num_points; i++) {
+    if (inverse[i] == num_unique) {
+      memcpy(unique->points + (size_t)num_unique * dim, data->points + (size_t)i * dim, dim * sizeof(double));
+      num_unique++;
+    }
+    unique->weights[inverse[i]] += point_weight(data, i);
+  }
+  return unique;
+}
+
+
+/*
+MODEL SELECTION
+ */
+
+static void add_d2_center(struct Dataset *data, double *centroids, int K, double *dists,
+                          struct RandomState *random) {
+  /*
+  Append centroid K, a point drawn with probability proportional to its weight times dists,
+  its squared distance to the closest of the first K centroids. K == 0 draws uniformly.
+  dists is updated to include the new centroid.
+   */
+  double *point = engine_malloc(data->dim * sizeof(double));
+  double *centroid = centroids + (size_t)K * data->dim;
+  double *probs;
+  double dist;
+  long pick = -1;
+  int i;
+
+  if (K > 0) {
+    probs = dists;
+    if (data->weights != NULL) {
+      probs = engine_malloc((size_t)data->num_points * sizeof(double));
+      for (i = 0; i < data->num_points; i++) {
+        probs[i] = data->weights[i] * dists[i];
+      }
+    }
+    pick = random_choice(random, probs, data->num_points);
+    if (probs != dists) {
+      free(probs);
+    }
+  }
+  if (pick == -1) {
+    /* First centroid, or every point already sits on a centroid */
+    pick = random_bounded(random, data->num_points);
+  }
+  decode_point(data, (int)pick, centroid);
+
+  for (i = 0; i < data->num_points; i++) {
+    decode_point(data, i, point);
+    dist = data->kernels->distance(point, centroid, data->dim);
+    if (K == 0 || dist < dists[i]) {
+      dists[i] = dist;
+    }
+  }
+
+  free(point);
+}
+
+static int find_elbow(const double *inertias, int num_k) {
+  /*
+  Kneedle on the inertia curve: with K and inertia both scaled to [0, 1], the elbow is the
+  point furthest below the chord from the first to the last point. Returns its index.
+  Inertia falls roughly geometrically until the true K, so its logarithm is used when every
+  value is positive; on the raw curve the first drop hides every later one.
+   */
+  double *curve = engine_malloc(num_k * sizeof(double));
+  int use_log = 1;
+  double span;
+  double gap;
+  double best_gap = 0.0;
+  int elbow = 0;
+  int i;
+
+  for (i = 0; i < num_k; i++) {
+    if (!(inertias[i] > 0.0)) {
+      use_log = 0;
+    }
+  }
+  for (i = 0; i < num_k; i++) {
+    curve[i] = use_log ? log(inertias[i]) : inertias[i];
+  }
+
+  span = curve[0] - curve[num_k - 1];
+  for (i = 1; i < num_k - 1 && span > 0.0; i++) {
+    gap = (1.0 - (double)i / (num_k - 1)) - (curve[i] - curve[num_k - 1]) / span;
+    if (gap > best_gap) {
+      best_gap = gap;
+      elbow = i;
+    }
+  }
+
+  free(curve);
+  return elbow;
+}
+
+int select_k(struct Dataset *data, int k_min, int k_max, const struct KMeansOptions *options,
+             struct RandomState *random, double *inertias, double *elbow_centroids) {
+  /*
+  Fit every K in [k_min, k_max] and return the elbow of the inertia curve.
+  k_min is seeded with kmeans++ (D^2 sampling); every next K is warm started from the converged
+  centroids of K - 1 plus one more D^2 sampled point, so the sweep costs about as much as the
+  Lloyd iterations that the last few centroids need. inertias receives k_max - k_min + 1
+  values and elbow_centroids the elbow K x dim centroids. If a fit fails the sweep stops and
+  what kmeans returned for it (KMEANS_NO_MEMORY, KMEANS_CHECKPOINT_FAILED) is returned instead.
+   */
+  int dim = data->dim;
+  double *centroids = engine_malloc((size_t)k_max * dim * sizeof(double));
+  double *dists = engine_malloc((size_t)data->num_points * sizeof(double));
+  /* Converged centroids of every K, packed one after the other */
+  double *history = engine_malloc((size_t)k_max * (k_max + 1) / 2 * dim * sizeof(double));
+  int elbow = 0;
+  int status;
+  int K;
+
+  for (K = 0; K < k_min; K++) {
+    add_d2_center(data, centroids, K, dists, random);
+  }
+
+  for (K = k_min; K <= k_max; K++) {
+    if (K > k_min) {
+      add_d2_center(data, centroids, K - 1, dists, random);
+    }
+    status = kmeans(data, centroids, K, options, NULL);
+    if (status < 0) {
+      elbow = status;
+      break;
+    }
+    inertias[K - k_min] = nearest_distances(data, centroids, K, dists);
+    memcpy(history + (size_t)K * (K - 1) / 2 * dim, centroids, (size_t)K * dim * sizeof(double));
+  }
+
+  if (elbow == 0) {
+    elbow = k_min + find_elbow(inertias, k_max - k_min + 1);
+    memcpy(elbow_centroids, history + (size_t)elbow * (elbow - 1) / 2 * dim,
+           (size_t)elbow * dim * sizeof(double));
+  }
+
+  free(centroids);
+  free(dists);
+  free(history);
+  return elbow;
+}
+
+
+/*
+BISECTING K-MEANS
+ */
+
+struct BisectingNode {
+  /* The node's points are order[start..end) */
+  int start;
+  int end;
+  double sse;
+  unsigned long seed;
+  int divisible;
+  /* Its two 2-means centroids once computed, NULL before */
+  double *split;
+};
+
+struct BisectPass {
+  const struct Dataset *data;
+  const int *order;
+  struct BisectingNode *nodes;
+  const int *batch;
+  const struct KMeansOptions *options;
+  /* Threads of every 2-means run */
+  int num_threads;
+};
+
+struct TreeAssignPass {
+  const struct BisectingTree *tree;
+  const struct Dataset *data;
+  int *labels;
+  int chunk;
+};
+
+struct BisectingTree *create_bisecting_tree(int num_nodes, int dim) {
+  /* Tree of a root and num_nodes - 1 nodes still to be linked, every node a leaf without a centroid */
+  struct BisectingTree *tree = engine_malloc(sizeof(struct BisectingTree));
+  int i;
+
+  tree->centers = engine_malloc((size_t)num_nodes * dim * sizeof(double));
+  tree->first_child = engine_malloc(num_nodes * sizeof(int));
+  tree->leaf = engine_malloc(num_nodes * sizeof(int));
+  for (i = 0; i < num_nodes; i++) {
+    tree->first_child[i] = -1;
+    tree->leaf[i] = -1;
+  }
+  tree->kernels = select_kernels(dim);
+  tree->spherical = 0;
+  tree->num_nodes = num_nodes;
+  tree->dim = dim;
+  return tree;
+}
+
+void free_bisecting_tree(struct BisectingTree **tree_address) {
+  struct BisectingTree *tree;
+
+  if (tree_address == NULL || *tree_address == NULL) {
+    return;
+  }
+  tree = *tree_address;
+
+  free(tree->centers);
+  free(tree->first_child);
+  free(tree->leaf);
+  free(tree);
+  *tree_address = NULL;
+}
+
+static int closer_child(const struct BisectingTree *tree, int child, const double *point) {
+  /* 0 or 1: which of the children child and child + 1 point is assigned to */
+  const double *centers = tree->centers + (size_t)child * tree->dim;
+
+  if (tree->spherical) {
+    return tree->kernels->most_similar(centers, 2, tree->dim, point);
+  }
+  return tree->kernels->closest(centers, 2, tree->dim, point);
+}
+
+int tree_closest(const struct BisectingTree *tree, const double *point) {
+  /* Leaf reached by descending to the closer child at every node, in O(depth) distances */
+  int node = 0;
+
+  while (tree->first_child[node] != -1) {
+    node = tree->first_child[node] + closer_child(tree, tree->first_child[node], point);
+  }
+  return tree->leaf[node];
+}
+
+static void tree_assign_chunk(void *context, int task) {
+  struct TreeAssignPass *pass = context;
+  const struct Dataset *data = pass->data;
+  double *point = engine_malloc(data->dim * sizeof(double));
+  int start = task * pass->chunk;
+  int end = start + pass->chunk < data->num_points ? start + pass->chunk : data->num_points;
+  int i;
+
+  for (i = start; i < end; i++) {
+    if (data->storage == STORAGE_DENSE) {
+      pass->labels[i] = tree_closest(pass->tree, data->points + (size_t)i * data->dim);
+    }
+    else {
+      decode_point(data, i, point);
+      pass->labels[i] = tree_closest(pass->tree, point);
+    }
+  }
+
+  free(point);
+}
+
+void tree_assign(const struct BisectingTree *tree, const struct Dataset *data, int num_threads, int *labels) {
+  struct TreeAssignPass pass;
+  double depth = log((double)tree->num_nodes + 1.0) / log(2.0);
+
+  pass.tree = tree;
+  pass.data = data;
+  pass.labels = labels;
+  pass.chunk = REDUCE_CHUNK;
+  num_threads = work_threads(num_threads, 2.0 * depth * data->num_points * data->dim);
+  parallel_for(num_threads, (data->num_points + pass.chunk - 1) / pass.chunk, tree_assign_chunk, &pass);
+}
+
+static struct Dataset *gather_points(const struct Dataset *data, const int *indices, int n) {
+  /* Copy of the points indices[0..n) of data, in the same storage and with their weights */
+  struct Dataset *subset;
+  long nnz = 0;
+  long row;
+  long len;
+  int dim = data->dim;
+  int i;
+
+  if (data->storage == STORAGE_CSR) {
+    for (i = 0; i < n; i++) {
+      nnz += data->indptr[indices[i] + 1] - data->indptr[indices[i]];
+    }
+    subset = create_csr_dataset(n, dim, nnz);
+    subset->indptr[0] = 0;
+    for (i = 0; i < n; i++) {
+      row = data->indptr[indices[i]];
+      len = data->indptr[indices[i] + 1] - row;
+      memcpy(subset->values + subset->indptr[i], data->values + row, (size_t)len * sizeof(double));
+      memcpy(subset->indices + subset->indptr[i], data->indices + row, (size_t)len * sizeof(int));
+      subset->indptr[i + 1] = subset->indptr[i] + len;
+    }
+  }
+  else if (data->storage == STORAGE_QUANTIZED) {
+    /* Same codes, so the same scale and offset */
+    subset = create_quantized_dataset(n, dim, data->offset, data->offset);
+    memcpy(subset->scale, data->scale, dim * sizeof(double));
+    for (i = 0; i < n; i++) {
+      memcpy(subset->codes + (size_t)i * dim, data->codes + (size_t)indices[i] * dim, dim);
+    }
+  }
+  else {
+    subset = create_dataset(n, dim);
+    for (i = 0; i < n; i++) {
+      memcpy(subset->points + (size_t)i * dim, data->points + (size_t)indices[i] * dim, dim * sizeof(double));
+    }
+  }
+
+  if (data->weights != NULL) {
+    subset->weights = engine_malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+      subset->weights[i] = data->weights[indices[i]];
+    }
+  }
+  subset->spherical = data->spherical;
+  return subset;
+}
+
+static void split_node(void *context, int task) {
+  /* 2-means of the points of one node, seeded by D^2 sampling from the node's own seed */
+  struct BisectPass *pass = context;
+  struct BisectingNode *node = pass->nodes + pass->batch[task];
+  int n = node->end - node->start;
+  struct Dataset *subset = gather_points(pass->data, pass->order + node->start, n);
+  struct KMeansOptions options = *pass->options;
+  struct RandomState random;
+  double *dists = engine_malloc((size_t)n * sizeof(double));
+  double *split = engine_malloc(2 * (size_t)subset->dim * sizeof(double));
+
+  seed_random(&random, node->seed);
+  add_d2_center(subset, split, 0, dists, &random);
+  add_d2_center(subset, split, 1, dists, &random);
+
+  options.num_threads = pass->num_threads;
+  options.numa = 0;
+  options.checkpoint = NULL;
+  options.start_iteration = 0;
+  options.progress = NULL;
+  if (kmeans(subset, split, 2, &options, NULL) == KMEANS_NO_MEMORY) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  node->split = split;
+
+  free(dists);
+  free_dataset(&subset);
+}
+
+static int accept_split(struct BisectingTree *tree, struct BisectingNode *nodes, const struct Dataset *data,
+                        int *order, int parent) {
+  /*
+  Turn the computed split of leaf parent into its two children: its points are partitioned,
+  keeping their order, by the closer of the two centroids, the same rule tree_closest follows.
+  Returns 0 and marks the leaf indivisible if one side would be empty.
+   */
+  struct BisectingNode *node = nodes + parent;
+  int child = tree->num_nodes;
+  int n = node->end - node->start;
+  int *sides = engine_malloc((size_t)n * sizeof(int));
+  int *moved = engine_malloc((size_t)n * sizeof(int));
+  double *point = engine_malloc(data->dim * sizeof(double));
+  const double *row;
+  double sse[2] = {0.0, 0.0};
+  int counts[2] = {0, 0};
+  int next[2];
+  int side;
+  int i;
+
+  memcpy(tree->centers + (size_t)child * data->dim, node->split, 2 * (size_t)data->dim * sizeof(double));
+  for (i = 0; i < n; i++) {
+    row = point;
+    if (data->storage == STORAGE_DENSE) {
+      row = data->points + (size_t)order[node->start + i] * data->dim;
+    }
+    else {
+      decode_point(data, order[node->start + i], point);
+    }
+    side = closer_child(tree, child, row);
+    sides[i] = side;
+    counts[side]++;
+    sse[side] += point_weight(data, order[node->start + i])
+                 * data->kernels->distance(row, tree->centers + (size_t)(child + side) * data->dim, data->dim);
+  }
+
+  free(node->split);
+  node->split = NULL;
+  if (counts[0] == 0 || counts[1] == 0) {
+    node->divisible = 0;
+    free(sides);
+    free(moved);
+    free(point);
+    return 0;
+  }
+
+  next[0] = 0;
+  next[1] = counts[0];
+  for (i = 0; i < n; i++) {
+    moved[next[sides[i]]++] = order[node->start + i];
+  }
+  memcpy(order + node->start, moved, (size_t)n * sizeof(int));
+
+  for (side = 0; side < 2; side++) {
+    nodes[child + side].start = side == 0 ? node->start : node->start + counts[0];
+    nodes[child + side].end = nodes[child + side].start + counts[side];
+    nodes[child + side].sse = sse[side];
+    nodes[child + side].seed = (node->seed * 69069UL + 1UL + side) & 0xffffffffUL;
+    nodes[child + side].divisible = counts[side] >= 2 && sse[side] > 0.0;
+    nodes[child + side].split = NULL;
+  }
+  tree->first_child[parent] = child;
+  tree->num_nodes += 2;
+
+  free(sides);
+  free(moved);
+  free(point);
+  return 1;
+}
+
+static int pick_batch(const struct BisectingTree *tree, const struct BisectingNode *nodes, int size, int *batch) {
+  /* Up to size divisible leaves without a split, largest SSE first, ties to the lowest node */
+  int num_batch = 0;
+  int node;
+  int b;
+
+  for (node = 0; node < tree->num_nodes; node++) {
+    if (tree->first_child[node] != -1 || !nodes[node].divisible || nodes[node].split != NULL) {
+      continue;
+    }
+    for (b = num_batch; b > 0 && nodes[batch[b - 1]].sse < nodes[node].sse; b--) {
+      if (b < size) {
+        batch[b] = batch[b - 1];
+      }
+    }
+    if (b < size) {
+      batch[b] = node;
+      if (num_batch < size) {
+        num_batch++;
+      }
+    }
+  }
+  return num_batch;
+}
+
+struct BisectingTree *bisecting_kmeans(struct Dataset *data, int K, const struct KMeansOptions *options,
+                                       struct RandomState *random, double *centroids, int *labels) {
+  /*
+  Bisecting k-means: starting from one cluster of every point, the leaf with the largest SSE is
+  split in two by a 2-means run on its points until there are K leaves. centroids receives the
+  K leaf centroids and labels, if not NULL, the leaf of every point. Returns the tree of splits,
+  which assigns a point in O(log K) distances on balanced trees, or NULL if the points cannot be
+  split into K clusters or the run was cancelled.
+
+  A split depends only on the node's points and on a seed derived from its parent's, so splits
+  can be computed before they are needed. Whenever the leaf to split next has none yet, the
+  num_threads largest leaves without one are split at once, each on its own share of the threads.
+  The tree is the same for any number of threads.
+   */
+  struct BisectingTree *tree = create_bisecting_tree(2 * K - 1, data->dim);
+  struct BisectingNode *nodes = engine_calloc(2 * (size_t)K - 1, sizeof(struct BisectingNode));
+  int *order = engine_malloc((size_t)data->num_points * sizeof(int));
+  int *batch = engine_malloc((options->num_threads > 1 ? options->num_threads : 1) * sizeof(int));
+  int *stack = engine_malloc((2 * (size_t)K - 1) * sizeof(int));
+  double *point = engine_malloc(data->dim * sizeof(double));
+  struct BisectPass pass;
+  double weight = 0.0;
+  double dist;
+  int num_leaves = 1;
+  int num_batch;
+  int best;
+  int node;
+  int top;
+  int i;
+
+  /* The root: every point, around their weighted mean */
+  tree->spherical = data->spherical;
+  tree->num_nodes = 1;
+  memset(tree->centers, 0, data->dim * sizeof(double));
+  for (i = 0; i < data->num_points; i++) {
+    order[i] = i;
+    add_point_to_sum(data, i, tree->centers);
+    weight += point_weight(data, i);
+  }
+  point_division(tree->centers, weight, data->dim);
+  if (data->spherical) {
+    normalize_point(tree->centers, data->dim);
+  }
+  nodes[0].end = data->num_points;
+  for (i = 0; i < data->num_points; i++) {
+    decode_point(data, i, point);
+    dist = data->kernels->distance(point, tree->centers, data->dim);
+    nodes[0].sse += point_weight(data, i) * dist;
+  }
+  nodes[0].seed = random_uint32(random);
+  nodes[0].divisible = data->num_points >= 2 && nodes[0].sse > 0.0;
+
+  pass.data = data;
+  pass.order = order;
+  pass.nodes = nodes;
+  pass.batch = batch;
+  pass.options = options;
+
+  while (num_leaves < K && (options->cancel == NULL || !*options->cancel)) {
+    best = -1;
+    for (node = 0; node < tree->num_nodes; node++) {
+      if (tree->first_child[node] == -1 && nodes[node].divisible
+          && (best == -1 || nodes[node].sse > nodes[best].sse)) {
+        best = node;
+      }
+    }
+    if (best == -1) {
+      break;
+    }
+
+    if (nodes[best].split == NULL) {
+      num_batch = pick_batch(tree, nodes, options->num_threads > 1 ? options->num_threads : 1, batch);
+      pass.num_threads = options->num_threads / num_batch > 1 ? options->num_threads / num_batch : 1;
+      parallel_for(options->num_threads, num_batch, split_node, &pass);
+    }
+    num_leaves += accept_split(tree, nodes, data, order, best);
+  }
+
+  for (node = 0; node < tree->num_nodes; node++) {
+    free(nodes[node].split);
+  }
+  if (num_leaves < K) {
+    free_bisecting_tree(&tree);
+  }
+  else {
+    /* Leaves are numbered left to right, so sibling clusters get neighbouring indices */
+    num_leaves = 0;
+    top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      node = stack[--top];
+      if (tree->first_child[node] != -1) {
+        stack[top++] = tree->first_child[node] + 1;
+        stack[top++] = tree->first_child[node];
+        continue;
+      }
+      tree->leaf[node] = num_leaves;
+      memcpy(centroids + (size_t)num_leaves * data->dim, tree->centers + (size_t)node * data->dim,
+             data->dim * sizeof(double));
+      for (i = nodes[node].start; i < nodes[node].end && labels != NULL; i++) {
+        labels[order[i]] = num_leaves;
+      }
+      num_leaves++;
+    }
+  }
+
+  free(nodes);
+  free(order);
+  free(batch);
+  free(stack);
+  free(point);
+  return tree;
+}
+
+
+/*
+SHARDED FIT
+ */
+
+/*
+Lloyd's algorithm over worker processes that each hold a shard of the points, on a stream socket
+named "unix:PATH" or "tcp:HOST:PORT". Messages are raw ints and doubles in the host's byte order:
+  worker hello:      int {SHARD_PROTOCOL, shard, num_shards, dim, num_points}; a worker without
+                     points sends dim 0 and num_points -1 and is sent its shard
+  coordinator shard: int {num_points, dim, has_weights}, then num_points x dim points and, with
+                     has_weights, num_points weights
+  coordinator step:  int {K, iteration}, then K x dim centroids; K == 0 ends the run
+  worker reply:      K x dim weighted sums, then the weight and the number of points of every cluster
+ */
+
+struct ShardPass {
+  const struct Dataset *data;
+  const struct CentroidCache *cache;
+  int *labels;
+  int chunk;
+};
+
+static int open_socket(const char *address, int listening, int backlog) {
+  /* Bound and listening, or connected, socket for address; -1 if it cannot be opened */
+  struct sockaddr_un unix_address;
+  struct addrinfo hints;
+  struct addrinfo *found;
+  struct addrinfo *info;
+  const char *host;
+  const char *port;
+  char host_name[256];
+  int reuse = 1;
+  int fd = -1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    if (strlen(address + 5) >= sizeof(unix_address.sun_path)) {
+      return -1;
+    }
+    memset(&unix_address, 0, sizeof(unix_address));
+    unix_address.sun_family = AF_UNIX;
+    strcpy(unix_address.sun_path, address + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+    if (listening) {
+      /* A socket file left behind by an earlier run would make bind fail */
+      unlink(unix_address.sun_path);
+      if (bind(fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) == 0 && listen(fd, backlog) == 0) {
+        return fd;
+      }
+    }
+    else if (connect(fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) == 0) {
+      return fd;
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (strncmp(address, "tcp:", 4) != 0) {
+    return -1;
+  }
+  host = address + 4;
+  port = strrchr(host, ':');
+  if (port == NULL || (size_t)(port - host) >= sizeof(host_name)) {
+    return -1;
+  }
+  memcpy(host_name, host, port - host);
+  host_name[port - host] = '\0';
+  port++;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  if (getaddrinfo(host_name[0] != '\0' ? host_name : NULL, port, &hints, &found) != 0) {
+    return -1;
+  }
+  for (info = found; info != NULL; info = info->ai_next) {
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (listening) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (bind(fd, info->ai_addr, info->ai_addrlen) == 0 && listen(fd, backlog) == 0) {
+        break;
+      }
+    }
+    else if (connect(fd, info->ai_addr, info->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+static int send_all(int fd, const void *buffer, size_t size) {
+  const char *bytes = buffer;
+  ssize_t sent;
+  int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+  /* A worker or coordinator that went away is an error, not a SIGPIPE */
+  flags = MSG_NOSIGNAL;
+#endif
+  while (size > 0) {
+    sent = send(fd, bytes, size, flags);
+    if (sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    bytes += sent;
+    size -= (size_t)sent;
+  }
+  return 0;
+}
+
+static int recv_all(int fd, void *buffer, size_t size) {
+  /* -1 on error or if the peer closes the connection first */
+  char *bytes = buffer;
+  ssize_t received;
+
+  while (size > 0) {
+    received = recv(fd, bytes, size, 0);
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    bytes += received;
+    size -= (size_t)received;
+  }
+  return 0;
+}
+
+static int send_shard(int fd, const struct Dataset *data, int shard, int num_shards) {
+  /* Rows [shard * N / num_shards, (shard + 1) * N / num_shards) of dense data, -1 if the worker went away */
+  long start = (long)shard * data->num_points / num_shards;
+  long end = (long)(shard + 1) * data->num_points / num_shards;
+  int header[3];
+
+  header[0] = (int)(end - start);
+  header[1] = data->dim;
+  header[2] = data->weights != NULL;
+  if (send_all(fd, header, sizeof(header)) == -1
+      || send_all(fd, data->points + (size_t)start * data->dim, (size_t)(end - start) * data->dim * sizeof(double))
+         == -1
+      || (data->weights != NULL
+          && send_all(fd, data->weights + start, (size_t)(end - start) * sizeof(double)) == -1)) {
+    return -1;
+  }
+  return 0;
+}
+
+static struct Dataset *receive_shard(int fd) {
+  /* Shard sent by send_shard, NULL if the coordinator went away or sent no valid shard */
+  struct Dataset *data;
+  int header[3];
+
+  if (recv_all(fd, header, sizeof(header)) == -1 || header[0] < 0 || header[1] < 1) {
+    return NULL;
+  }
+  data = create_dataset(header[0], header[1]);
+  if (header[2]) {
+    data->weights = engine_malloc((size_t)header[0] * sizeof(double));
+  }
+  if (recv_all(fd, data->points, (size_t)header[0] * header[1] * sizeof(double)) == -1
+      || (header[2] && recv_all(fd, data->weights, (size_t)header[0] * sizeof(double)) == -1)) {
+    free_dataset(&data);
+  }
+  return data;
+}
+
+static void shard_assign_chunk(void *context, int task) {
+  struct ShardPass *pass = context;
+  int start = task * pass->chunk;
+  int end = start + pass->chunk < pass->data->num_points ? start + pass->chunk : pass->data->num_points;
+
+  assign_range(pass->data, pass->cache, start, end, pass->labels);
+}
+
+int serve_shard(const char *address, int shard, int num_shards, struct Dataset *data, int num_threads) {
+  /*
+  Worker side of a sharded fit: connect to the coordinator at address, retrying for up to
+  SHARD_CONNECT_SECONDS while it starts, then answer every Lloyd step with the per-cluster
+  sums, weights and counts of data. With data NULL the shard is received from the coordinator
+  instead, so the worker never holds more than its own rows. Returns the number of steps
+  served, -1 on failure.
+   */
+  struct CentroidCache cache;
+  struct ShardPass pass;
+  struct timespec pause;
+  struct Dataset *received = NULL;
+  double deadline = monotonic_seconds() + SHARD_CONNECT_SECONDS;
+  double *centroids = NULL;
+  double *reply = NULL;
+  int *labels = NULL;
+  int hello[5];
+  int step[2];
+  int capacity = 0;
+  int served = 0;
+  int dim;
+  int threads;
+  int fd;
+  int K;
+  int i;
+
+  pause.tv_sec = 0;
+  pause.tv_nsec = 10000000L;
+  while ((fd = open_socket(address, 0, 0)) == -1 && monotonic_seconds() < deadline) {
+    nanosleep(&pause, NULL);
+  }
+  hello[0] = SHARD_PROTOCOL;
+  hello[1] = shard;
+  hello[2] = num_shards;
+  hello[3] = data != NULL ? data->dim : 0;
+  hello[4] = data != NULL ? data->num_points : -1;
+  if (fd == -1 || send_all(fd, hello, sizeof(hello)) == -1) {
+    served = -1;
+  }
+  else if (data == NULL) {
+    received = receive_shard(fd);
+    served = received != NULL ? 0 : -1;
+    data = received;
+  }
+  if (served == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  dim = data->dim;
+  labels = engine_malloc((size_t)data->num_points * sizeof(int));
+  pass.data = data;
+  pass.cache = &cache;
+  pass.labels = labels;
+  pass.chunk = reduce_chunk_size(data->num_points);
+  while (served != -1) {
+    /* A coordinator that goes away without ending the run is a failure */
+    if (recv_all(fd, step, sizeof(step)) == -1) {
+      served = -1;
+      break;
+    }
+    if (step[0] <= 0) {
+      break;
+    }
+    K = step[0];
+    if (K > capacity) {
+      free(centroids);
+      free(reply);
+      centroids = engine_malloc((size_t)K * dim * sizeof(double));
+      reply = engine_malloc((size_t)K * (dim + 2) * sizeof(double));
+      capacity = K;
+    }
+    if (recv_all(fd, centroids, (size_t)K * dim * sizeof(double)) == -1) {
+      served = -1;
+      break;
+    }
+
+    prepare_centroids(data, centroids, K, &cache);
+    threads = work_threads(num_threads, (double)data->num_points * K * dim);
+    parallel_for(threads, (data->num_points + pass.chunk - 1) / pass.chunk, shard_assign_chunk, &pass);
+    free_centroid_cache(&cache);
+
+    memset(reply, 0, (size_t)K * (dim + 2) * sizeof(double));
+    for (i = 0; i < data->num_points; i++) {
+      add_point_to_sum(data, i, reply + (size_t)labels[i] * dim);
+      reply[(size_t)K * dim + labels[i]] += point_weight(data, i);
+      reply[(size_t)K * (dim + 1) + labels[i]] += 1.0;
+    }
+    if (send_all(fd, reply, (size_t)K * (dim + 2) * sizeof(double)) == -1) {
+      served = -1;
+      break;
+    }
+    served++;
+  }
+
+  close(fd);
+  free(centroids);
+  free(reply);
+  free(labels);
+  free_dataset(&received);
+  return served;
+}
+
+int coordinate_shards(const char *address, int num_workers, struct Dataset **data_address, double *centroids, int K,
+                      int dim, const struct KMeansOptions *options) {
+  /*
+  Coordinator side of a sharded fit: listen on address for num_workers workers, shards 0 to
+  num_workers - 1 of one dataset, then run Lloyd's algorithm from centroids, stopping under the
+  same rule as kmeans. Every step broadcasts the centroids and merges the workers' sums in shard
+  order, so the result does not depend on which worker answers first. Returns the number of
+  iterations, or -1 if the socket cannot be opened, the workers do not all connect within
+  SHARD_CONNECT_SECONDS, or a worker fails or does not match.
+
+  If data_address points to a dense dataset, every worker that holds no points is sent its
+  contiguous shard of it as it connects, and the dataset is freed once all workers are in, so
+  the coordinator holds the points only until the loop starts.
+   */
+  const struct Dataset *data = data_address != NULL ? *data_address : NULL;
+  int *fds = engine_malloc(num_workers * sizeof(int));
+  double *reply = engine_malloc((size_t)K * (dim + 2) * sizeof(double));
+  double *sums = engine_malloc((size_t)K * dim * sizeof(double));
+  double *weights = engine_malloc(K * sizeof(double));
+  double *counts = engine_malloc(K * sizeof(double));
+  double deadline = monotonic_seconds() + SHARD_CONNECT_SECONDS;
+  double remaining;
+  struct pollfd waiting;
+  double delta;
+  int hello[5];
+  int step[2];
+  int listener;
+  int converge;
+  int failed = 0;
+  int fd;
+  int w;
+  int i = 0;
+  int m;
+
+  for (w = 0; w < num_workers; w++) {
+    fds[w] = -1;
+  }
+  listener = open_socket(address, 1, num_workers);
+  if (listener == -1) {
+    failed = 1;
+  }
+
+  /* Workers are kept by shard index, whatever order they connect in */
+  waiting.fd = listener;
+  waiting.events = POLLIN;
+  for (w = 0; w < num_workers && !failed; w++) {
+    fd = -1;
+    do {
+      errno = 0;
+      remaining = deadline - monotonic_seconds();
+      if (remaining > 0.0 && poll(&waiting, 1, (int)(remaining * 1000.0) + 1) > 0) {
+        fd = accept(listener, NULL, NULL);
+      }
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1 || recv_all(fd, hello, sizeof(hello)) == -1 || hello[0] != SHARD_PROTOCOL || hello[1] < 0
+        || hello[1] >= num_workers || hello[2] != num_workers || fds[hello[1]] != -1
+        || (hello[4] == -1 ? data == NULL || data->dim != dim : hello[3] != dim)
+        || (hello[4] == -1 && send_shard(fd, data, hello[1], num_workers) == -1)) {
+      if (fd != -1) {
+        close(fd);
+      }
+      failed = 1;
+      break;
+    }
+    fds[hello[1]] = fd;
+  }
+  free_dataset(data_address);
+  if (listener != -1) {
+    close(listener);
+    if (strncmp(address, "unix:", 5) == 0) {
+      unlink(address + 5);
+    }
+  }
+
+  step[0] = K;
+  for (i = options->start_iteration; i < options->iter && !failed; i++) {
+    if (options->cancel != NULL && *options->cancel) {
+      break;
+    }
+
+    step[1] = i;
+    for (w = 0; w < num_workers && !failed; w++) {
+      failed = send_all(fds[w], step, sizeof(step)) == -1
+               || send_all(fds[w], centroids, (size_t)K * dim * sizeof(double)) == -1;
+    }
+
+    memset(sums, 0, (size_t)K * dim * sizeof(double));
+    memset(weights, 0, K * sizeof(double));
+    memset(counts, 0, K * sizeof(double));
+    for (w = 0; w < num_workers && !failed; w++) {
+      if (recv_all(fds[w], reply, (size_t)K * (dim + 2) * sizeof(double)) == -1) {
+        failed = 1;
+        break;
+      }
+      for (m = 0; m < K; m++) {
+        point_addition(sums + (size_t)m * dim, reply + (size_t)m * dim, dim);
+        weights[m] += reply[(size_t)K * dim + m];
+        counts[m] += reply[(size_t)K * (dim + 1) + m];
+      }
+    }
+    if (failed) {
+      break;
+    }
+
+    converge = 1;
+    for (m = 0; m < K; m++) {
+      delta = finalize_next_centroid_pos(centroids + (size_t)m * dim, sums + (size_t)m * dim,
+                                         counts[m] > 0.0 ? weights[m] : 0.0, dim);
+      if (delta > options->epsilon) {
+        converge = 0;
+      }
+    }
+    if (converge) {
+      i++;
+      break;
+    }
+  }
+
+  /* K == 0 tells the workers the run is over */
+  step[0] = 0;
+  step[1] = i;
+  for (w = 0; w < num_workers; w++) {
+    if (fds[w] != -1) {
+      send_all(fds[w], step, sizeof(step));
+      close(fds[w]);
+    }
+  }
+
+  free(fds);
+  free(reply);
+  free(sums);
+  free(weights);
+  free(counts);
+  return failed ? -1 : i;
+}
+
+
+/*
+CLUSTER QUALITY
+ */
+
+struct SilhouettePass {
+  const struct Dataset *data;
+  const int *labels;
+  const int *sample;
+  /* Total weight of every cluster */
+  const double *cluster_weights;
+  double *scores;
+  int num_sample;
+  int K;
+};
+
+static void silhouette_chunk(void *context, int task) {
+  /*
+  Silhouette of SILHOUETTE_CHUNK sampled points against every point: a is the mean distance
+  to the rest of the own cluster, b the smallest mean distance to another cluster, and the
+  score (b - a) / max(a, b), 0 for a point alone in its cluster.
+   */
+  struct SilhouettePass *pass = context;
+  const struct Dataset *data = pass->data;
+  double *totals = engine_malloc(pass->K * sizeof(double));
+  double *point = engine_malloc(data->dim * sizeof(double));
+  double *other = engine_malloc(data->dim * sizeof(double));
+  int start = task * SILHOUETTE_CHUNK;
+  int end = start + SILHOUETTE_CHUNK < pass->num_sample ? start + SILHOUETTE_CHUNK : pass->num_sample;
+  const double *x;
+  const double *y;
+  double own_weight;
+  double a;
+  double b;
+  double mean;
+  int own;
+  int s;
+  int i;
+  int j;
+  int k;
+
+  for (s = start; s < end; s++) {
+    i = pass->sample[s];
+    own = pass->labels[i];
+    memset(totals, 0, pass->K * sizeof(double));
+    if (data->storage == STORAGE_DENSE) {
+      x = data->points + (size_t)i * data->dim;
+    }
+    else {
+      decode_point(data, i, point);
+      x = point;
+    }
+
+    for (j = 0; j < data->num_points; j++) {
+      if (data->storage == STORAGE_DENSE) {
+        y = data->points + (size_t)j * data->dim;
+      }
+      else {
+        decode_point(data, j, other);
+        y = other;
+      }
+      totals[pass->labels[j]] += point_weight(data, j) * sqrt(data->kernels->distance(x, y, data->dim));
+    }
+
+    own_weight = pass->cluster_weights[own] - point_weight(data, i);
+    if (!(own_weight > 0.0)) {
+      pass->scores[s] = 0.0;
+      continue;
+    }
+    a = totals[own] / own_weight;
+    b = -1.0;
+    for (k = 0; k < pass->K; k++) {
+      if (k == own || !(pass->cluster_weights[k] > 0.0)) {
+        continue;
+      }
+      mean = totals[k] / pass->cluster_weights[k];
+      if (b < 0.0 || mean < b) {
+        b = mean;
+      }
+    }
+    if (b < 0.0 || (a == 0.0 && b == 0.0)) {
+      pass->scores[s] = 0.0;
+    }
+    else {
+      pass->scores[s] = (b - a) / (a > b ? a : b);
+    }
+  }
+
+  free(totals);
+  free(point);
+  free(other);
+}
+
+double silhouette_score(const struct Dataset *data, const int *labels, int K, int sample_size, int num_threads,
+                        struct RandomState *random, double *half_width) {
+  /*
+  Mean silhouette of labels, weighted by the point weights. Up to sample_size points it is
+  exact. Above it, sample_size points drawn uniformly without replacement are scored against
+  every point, and half_width receives the half width of a 95% confidence interval of the
+  estimate (0 when exact). Each sampled point costs one pass over the data, so the work is
+  O(sample_size * N) instead of O(N^2), split over num_threads threads.
+   */
+  struct SilhouettePass pass;
+  double *cluster_weights = engine_calloc(K, sizeof(double));
+  int *sample;
+  double weight;
+  double total_weight = 0.0;
+  double total = 0.0;
+  double variance = 0.0;
+  double mean;
+  int exact = sample_size <= 0 || sample_size >= data->num_points;
+  int num_sample = exact ? data->num_points : sample_size;
+  int swap;
+  int i;
+  int j;
+
+  for (i = 0; i < data->num_points; i++) {
+    cluster_weights[labels[i]] += point_weight(data, i);
+  }
+
+  /* A partial Fisher-Yates shuffle draws the sample without replacement */
+  sample = engine_malloc((size_t)data->num_points * sizeof(int));
+  for (i = 0; i < data->num_points; i++) {
+    sample[i] = i;
+  }
+  for (i = 0; i < num_sample && !exact; i++) {
+    j = i + (int)random_bounded(random, data->num_points - i);
+    swap = sample[i];
+    sample[i] = sample[j];
+    sample[j] = swap;
+  }
+
+  pass.data = data;
+  pass.labels = labels;
+  pass.sample = sample;
+  pass.cluster_weights = cluster_weights;
+  pass.scores = engine_malloc((size_t)num_sample * sizeof(double));
+  pass.num_sample = num_sample;
+  pass.K = K;
+  parallel_for(num_threads, (num_sample + SILHOUETTE_CHUNK - 1) / SILHOUETTE_CHUNK, silhouette_chunk, &pass);
+
+  /* Summed in sample order, so the score does not depend on the thread count */
+  for (i = 0; i < num_sample; i++) {
+    weight = point_weight(data, sample[i]);
+    total += weight * pass.scores[i];
+    total_weight += weight;
+  }
+  mean = total_weight > 0.0 ? total / total_weight : 0.0;
+
+  if (!exact && total_weight > 0.0) {
+    /* Linearised standard error of the weighted mean */
+    for (i = 0; i < num_sample; i++) {
+      weight = point_weight(data, sample[i]);
+      variance += weight * weight * (pass.scores[i] - mean) * (pass.scores[i] - mean);
+    }
+    *half_width = 1.96 * sqrt(variance) / total_weight;
+  }
+  else {
+    *half_width = 0.0;
+  }
+
+  free(cluster_weights);
+  free(sample);
+  free(pass.scores);
+  return mean;
+}
+
+
+/*
+PARSE INPUT
+ */
+
+struct KeyedRows {
+  double *keys;
+  double *values;
+  int *order;
+  int num_rows;
+  int num_cols;
+};
+
+struct KeyIndex {
+  double key;
+  int row;
+};
+
+static int compare_keys(const void *a, const void *b) {
+  /* Equal keys keep file order */
+  const struct KeyIndex *first = a;
+  const struct KeyIndex *second = b;
+
+  if (first->key < second->key) {
+    return -1;
+  }
+  if (first->key > second->key) {
+    return 1;
+  }
+  return first->row - second->row;
+}
+
+static char *read_line(FILE *file, char **line, size_t *capacity) {
+  /* fgets into a buffer that grows to fit lines of any length */
+  size_t len = 0;
+
+  if (*line == NULL) {
+    *capacity = 1024;
+    *line = engine_malloc(*capacity);
+  }
+
+  while (fgets(*line + len, (int)(*capacity - len), file) != NULL) {
+    len += strlen(*line + len);
+    if (len > 0 && (*line)[len - 1] == '\n') {
+      return *line;
+    }
+    *capacity *= 2;
+    *line = realloc(*line, *capacity);
+    if (*line == NULL) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return len > 0 ? *line : NULL;
+}
+
+static void free_keyed_rows(struct KeyedRows *rows) {
+  free(rows->keys);
+  free(rows->values);
+  free(rows->order);
+}
+
+static int parse_line(const char *line, double **row, size_t *capacity) {
+  /* Parses comma separated numbers into a growing row buffer, returns how many were read */
+  const char *ptr = line;
+  char *end;
+  double value;
+  int count = 0;
+
+  while (1) {
+    value = strtod(ptr, &end);
+    if (end == ptr) {
+      break;
+    }
+    if ((size_t)count == *capacity) {
+      *capacity *= 2;
+      *row = realloc(*row, *capacity * sizeof(double));
+      if (*row == NULL) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    (*row)[count++] = value;
+    ptr = end;
+    if (*ptr != ',') {
+      break;
+    }
+    ptr++;
+  }
+  return count;
+}
+
+static int parse_keyed_file(const char *path, struct KeyedRows *rows) {
+  /*
+  Reads a comma separated file whose first column is the join key into rows,
+  with rows->order sorted by key. Returns -1 if the file cannot be read or is ragged.
+   */
+  FILE *file = fopen(path, "r");
+  char *line = NULL;
+  size_t line_capacity = 0;
+  size_t row_capacity = 64;
+  size_t rows_capacity = 1024;
+  struct KeyIndex *sorted;
+  double *row;
+  int count;
+  int i;
+
+  if (file == NULL) {
+    return -1;
+  }
+
+  row = engine_malloc(row_capacity * sizeof(double));
+  rows->num_rows = 0;
+  rows->num_cols = 0;
+  rows->keys = engine_malloc(rows_capacity * sizeof(double));
+  rows->values = NULL;
+  rows->order = NULL;
+
+  while (read_line(file, &line, &line_capacity) != NULL) {
+    count = parse_line(line, &row, &row_capacity);
+    if (count == 0) {
+      continue;
+    }
+
+    if (rows->values == NULL) {
+      rows->num_cols = count - 1;
+      rows->values = engine_malloc(rows_capacity * (rows->num_cols + 1) * sizeof(double));
+    }
+    if (count - 1 != rows->num_cols) {
+      fclose(file);
+      free(line);
+      free(row);
+      free_keyed_rows(rows);
+      return -1;
+    }
+
+    if ((size_t)rows->num_rows == rows_capacity) {
+      rows_capacity *= 2;
+      rows->keys = realloc(rows->keys, rows_capacity * sizeof(double));
+      rows->values = realloc(rows->values, rows_capacity * (rows->num_cols + 1) * sizeof(double));
+      if (rows->keys == NULL || rows->values == NULL) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    rows->keys[rows->num_rows] = row[0];
+    memcpy(rows->values + (size_t)rows->num_rows * rows->num_cols, row + 1, rows->num_cols * sizeof(double));
+    rows->num_rows++;
+  }
+
+  fclose(file);
+  free(line);
+  free(row);
+
+  sorted = engine_malloc(((size_t)rows->num_rows + 1) * sizeof(struct KeyIndex));
+  for (i = 0; i < rows->num_rows; i++) {
+    sorted[i].key = rows->keys[i];
+    sorted[i].row = i;
+  }
+  qsort(sorted, rows->num_rows, sizeof(struct KeyIndex), compare_keys);
+
+  rows->order = engine_malloc(((size_t)rows->num_rows + 1) * sizeof(int));
+  for (i = 0; i < rows->num_rows; i++) {
+    rows->order[i] = sorted[i].row;
+  }
+  free(sorted);
+  return 0;
+}
+
+struct Dataset *read_joined_files(const char *path1, const char *path2, double **keys) {
+  /*
+  Inner join of two comma separated files on their first column, sorted by key, with the
+  key column dropped: each output point is the row of path1 followed by the row of path2.
+  Both files are sorted by key and merge-joined straight into the point buffer.
+  keys, if not NULL, receives the key of every output point.
+  Returns NULL if either file cannot be read.
+   */
+  struct KeyedRows first;
+  struct KeyedRows second;
+  struct Dataset *data;
+  int num_joined = 0;
+  int pass;
+  int i;
+  int j;
+  int run_end;
+  int k;
+  int dim;
+  double *point;
+
+  if (parse_keyed_file(path1, &first) == -1) {
+    return NULL;
+  }
+  if (parse_keyed_file(path2, &second) == -1) {
+    free_keyed_rows(&first);
+    return NULL;
+  }
+
+  dim = first.num_cols + second.num_cols;
+  data = NULL;
+
+  /* The first pass counts the joined rows, the second writes them */
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      data = create_dataset(num_joined, dim);
+      if (keys != NULL) {
+        *keys = engine_malloc(((size_t)num_joined + 1) * sizeof(double));
+      }
+    }
+    num_joined = 0;
+    i = 0;
+    j = 0;
+    while (i < first.num_rows && j < second.num_rows) {
+      if (first.keys[first.order[i]] < second.keys[second.order[j]]) {
+        i++;
+      }
+      else if (first.keys[first.order[i]] > second.keys[second.order[j]]) {
+        j++;
+      }
+      else {
+        run_end = j;
+        while (run_end < second.num_rows && second.keys[second.order[run_end]] == first.keys[first.order[i]]) {
+          run_end++;
+        }
+        for (k = j; k < run_end; k++) {
+          if (pass == 1) {
+            point = data->points + (size_t)num_joined * dim;
+            memcpy(point, first.values + (size_t)first.order[i] * first.num_cols, first.num_cols * sizeof(double));
+            memcpy(point + first.num_cols, second.values + (size_t)second.order[k] * second.num_cols,
+                   second.num_cols * sizeof(double));
+            if (keys != NULL) {
+              (*keys)[num_joined] = first.keys[first.order[i]];
+            }
+          }
+          num_joined++;
+        }
+        i++;
+        if (i < first.num_rows && first.keys[first.order[i]] == first.keys[first.order[i - 1]]) {
+          /* Duplicate key in the first file joins the same run of the second file again */
+          continue;
+        }
+        j = run_end;
+      }
+    }
+  }
+
+  free_keyed_rows(&first);
+  free_keyed_rows(&second);
+  return data;
+}
+
+double *read_weights_file(const char *path, const double *keys, int num_points) {
+  /*
+  Reads a comma separated file of key,weight rows and returns the weight of every key in keys.
+  Returns NULL if the file cannot be read, a key has no weight or a weight is negative.
+   */
+  struct KeyedRows rows;
+  double *weights;
+  double weight;
+  int low;
+  int high;
+  int mid;
+  int i;
+
+  if (parse_keyed_file(path, &rows) == -1) {
+    return NULL;
+  }
+  if (rows.num_cols != 1) {
+    free_keyed_rows(&rows);
+    return NULL;
+  }
+
+  weights = engine_malloc(((size_t)num_points + 1) * sizeof(double));
+  for (i = 0; i < num_points; i++) {
+    /* First row of the sorted order whose key is not below keys[i] */
+    low = 0;
+    high = rows.num_rows;
+    while (low < high) {
+      mid = low + (high - low) / 2;
+      if (rows.keys[rows.order[mid]] < keys[i]) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+
+    weight = low < rows.num_rows && rows.keys[rows.order[low]] == keys[i] ? rows.values[rows.order[low]] : -1.0;
+    if (!(weight >= 0.0)) {
+      free(weights);
+      free_keyed_rows(&rows);
+      return NULL;
+    }
+    weights[i] = weight;
+  }
+
+  free_keyed_rows(&rows);
+  return weights;
+}
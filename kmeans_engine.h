@@ -0,0 +1,447 @@
+#ifndef KMEANS_ENGINE_H
+#define KMEANS_ENGINE_H
+
+#include <stddef.h>
+
+/*
+Dimensions from which the assignment step switches from per-pair distances to
+the blocked ||x||^2 - 2 x.c + ||c||^2 kernel.
+ */
+#define GEMM_MIN_DIM 64
+
+/* Cache blocking of the blocked kernel: points x centroids x dimensions */
+#define POINT_BLOCK 64
+#define CENTROID_BLOCK 64
+#define DIM_BLOCK 256
+
+/* Points per chunk of the deterministic parallel reduction, grown so there are at most MAX_REDUCE_CHUNKS */
+#define REDUCE_CHUNK 4096
+#define MAX_REDUCE_CHUNKS 256
+
+/* Iterations between full rebuilds of the incrementally updated cluster sums */
+#define REFRESH_INTERVAL 16
+
+/* Point-centroid-dimension products below which a Lloyd pass stays on the calling thread */
+#define PARALLEL_MIN_WORK 262144.0
+
+/* NUMA nodes probed when placing threads */
+#define MAX_NUMA_NODES 64
+
+/* Register tile of the dot-product micro kernel */
+#define MICRO_ROWS 4
+#define MICRO_COLS 4
+
+/* Point storage layouts of a Dataset */
+#define STORAGE_DENSE 0
+#define STORAGE_CSR 1
+#define STORAGE_QUANTIZED 2
+
+/* Number of levels of a quantized coordinate code */
+#define QUANTIZE_LEVELS 255
+
+/* Centers of the D^2 sampled bicriteria solution that coreset sensitivities are measured against */
+#define CORESET_CENTERS 16
+
+/* Points above which the silhouette is estimated from a sample, and sampled points per parallel task */
+#define SILHOUETTE_SAMPLE 10000
+#define SILHOUETTE_CHUNK 32
+
+/* Mersenne Twister state, seeded like numpy's legacy np.random.seed */
+#define MT_STATE_SIZE 624
+
+/* Iterations between checkpoints when a checkpoint path is given without a schedule */
+#define CHECKPOINT_EVERY 10
+
+/* What kmeans returns for a run it could not finish */
+#define KMEANS_CHECKPOINT_FAILED -1
+#define KMEANS_NO_MEMORY -2
+
+/* Bytes a run counts for thread stacks and allocator slack on top of its buffers */
+#define MEMORY_OVERHEAD 1048576
+
+/* Seconds shard workers keep trying to reach their coordinator, and it waits for all of them */
+#define SHARD_CONNECT_SECONDS 30.0
+
+/* First word of a shard worker's hello, changed whenever the messages change */
+#define SHARD_PROTOCOL 2
+
+struct RandomState {
+  unsigned long mt[MT_STATE_SIZE];
+  int pos;
+};
+
+/*
+Distance and accumulation kernels for one point dimension. Fully unrolled versions exist for
+the dimensions listed in kmeans_engine.c, the generic loops cover every other dimension.
+ */
+struct PointKernels {
+  int dim;
+  double (*distance)(const double *point, const double *other, int dim);
+  int (*closest)(const double *centroids, int K, int dim, const double *point);
+  /* Largest dot product, the closest centroid when points and centroids have unit length */
+  int (*most_similar)(const double *centroids, int K, int dim, const double *point);
+  void (*addition)(double *point, const double *other, int dim);
+};
+
+struct Dataset {
+  int storage;
+  /* Kernels selected for dim when the dataset is created */
+  const struct PointKernels *kernels;
+  /* STORAGE_DENSE: num_points x dim, row major */
+  double *points;
+  /* STORAGE_CSR: row i holds values[indptr[i]..indptr[i+1]) at columns indices[...] */
+  double *values;
+  int *indices;
+  long *indptr;
+  /* STORAGE_QUANTIZED: coordinate j of row i is offset[j] + scale[j] * codes[i * dim + j] */
+  unsigned char *codes;
+  double *scale;
+  double *offset;
+  /* Squared norm of every point, computed on first use */
+  double *norms;
+  /* Weight of every point, NULL when every point weighs 1 */
+  double *weights;
+  /* Rows scaled to unit length by normalize_dataset, centroids are then kept unit length too */
+  int spherical;
+  int num_points;
+  int dim;
+};
+
+/* Centroid data derived once per iteration for the assignment kernel of a dataset */
+struct CentroidCache {
+  const double *centroids;
+  double *norms;
+  double *transposed;
+  double *shifted;
+  int K;
+};
+
+/* When and where kmeans saves its progress */
+struct CheckpointPolicy {
+  const char *path;
+  /* Iterations between checkpoints, 0 to save by time only */
+  int every;
+  /* Seconds between checkpoints, 0 to save by iteration only */
+  double seconds;
+  /* Also save the labels the centroids were computed from */
+  int labels;
+  /* Random state saved alongside, NULL for none */
+  const struct RandomState *random;
+};
+
+/* Progress of a kmeans run, handed to KMeansOptions.progress */
+struct ProgressReport {
+  /* Iterations done so far */
+  int iteration;
+  double max_shift;
+  /* Weighted squared distance of the points to the updated centroids of their clusters */
+  double inertia;
+  int changed_points;
+};
+
+struct KMeansOptions {
+  int iter;
+  double epsilon;
+  int num_threads;
+  int refresh_interval;
+  /* Pin threads and place each thread's share of the points on its NUMA node */
+  int numa;
+  /* Checked before every iteration, the run stops once another thread sets it; NULL never stops */
+  const volatile int *cancel;
+  /* Save progress under this policy, NULL for no checkpoints */
+  const struct CheckpointPolicy *checkpoint;
+  /* Iterations already done by the run being resumed */
+  int start_iteration;
+  /* Called every progress_every iterations or progress_seconds seconds, returning 0 stops the run */
+  int (*progress)(void *context, const struct ProgressReport *report);
+  void *progress_context;
+  int progress_every;
+  double progress_seconds;
+  /* Upper bound on the reduction chunks and their partial sums, 0 for the default */
+  int max_chunks;
+};
+
+/* Layout a run is planned with under a memory cap */
+struct MemoryPlan {
+  /* In: storage of the input. Out: storage to use */
+  int storage;
+  /* Whether a dense input may be stored quantized instead, which is lossy and so only on request */
+  int allow_quantize;
+  /* In: whether labels are wanted. Out: whether they fit */
+  int labels;
+  /* Whether the points carry weights */
+  int weights;
+  /* Whether repeated rows are collapsed first (see collapse_duplicates) */
+  int deduplicate;
+  /* Whether the points are moved next to their threads (see place_dataset) */
+  int numa;
+  /* Whether checkpoints are saved, and whether they hold the labels */
+  int checkpoint;
+  int checkpoint_labels;
+  /* Out: KMeansOptions.max_chunks to run with */
+  int max_chunks;
+  /* Non-zeros of a CSR input */
+  long nnz;
+};
+
+/* Bytes a kmeans run allocates, by what they hold */
+struct MemoryEstimate {
+  /* Point storage, weights and point norms */
+  size_t points;
+  /* Copies made on the way: the distinct rows and inverse of deduplicate, the buffer placement moves to */
+  size_t copies;
+  /* Labels of the Lloyd loop, the returned labels and the checkpoint's copy */
+  size_t labels;
+  /* Partial sums of the reduction chunks */
+  size_t reduction;
+  /* Centroids, cluster sums, the centroid cache and the checkpoint snapshot */
+  size_t centroids;
+  /* Thread stacks and allocator slack, MEMORY_OVERHEAD */
+  size_t overhead;
+  size_t total;
+};
+
+/* Contents of a checkpoint file */
+struct Checkpoint {
+  int K;
+  int dim;
+  int iteration;
+  double *centroids;
+  /* Labels of num_points points, NULL when they were not saved */
+  int *labels;
+  int num_points;
+  struct RandomState random;
+  int has_random;
+};
+
+/* Threads pinned to CPUs, consecutive threads sharing a NUMA node */
+struct Placement {
+  int num_threads;
+  int num_nodes;
+  int *cpus;
+  int *nodes;
+};
+
+/* Centroids updated batch by batch as points stream in */
+struct OnlineModel {
+  double *centroids;
+  /* Weight every centroid has absorbed so far, decayed once per batch */
+  double *counts;
+  const struct PointKernels *kernels;
+  int K;
+  int dim;
+  /* 0: MacQueen update after every point, otherwise one update per batch */
+  int mini_batch;
+  double decay;
+  int num_batches;
+};
+
+struct IterationStats {
+  /* Clusters whose membership changed, the only ones recomputed */
+  int active_clusters;
+  int changed_points;
+  double max_shift;
+};
+
+/* Work of one thread over every assignment pass */
+struct ThreadStats {
+  long tasks;
+  /* Tasks taken from another thread's queue */
+  long steals;
+  double busy_seconds;
+  /* Time the thread was out of tasks while the pass still ran */
+  double idle_seconds;
+};
+
+/* Splits of a bisecting k-means run, node 0 holds every point */
+struct BisectingTree {
+  /* Centroid of the points of every node, num_nodes x dim */
+  double *centers;
+  /* Children of node i are first_child[i] and first_child[i] + 1, -1 at leaves */
+  int *first_child;
+  /* Index of every leaf among the flat centroids, -1 at inner nodes */
+  int *leaf;
+  const struct PointKernels *kernels;
+  /* Descend by the largest dot product instead of the smallest distance */
+  int spherical;
+  int num_nodes;
+  int dim;
+};
+
+struct KMeansStats {
+  int iterations;
+  int capacity;
+  struct IterationStats *history;
+  int num_threads;
+  struct ThreadStats *threads;
+};
+
+
+/*
+MEMORY MANAGEMENT
+ */
+void *engine_malloc(size_t size);
+void *engine_calloc(size_t count, size_t size);
+struct Dataset *create_dataset(int num_points, int dim);
+struct Dataset *try_create_dataset(int num_points, int dim);
+struct Dataset *create_csr_dataset(int num_points, int dim, long nnz);
+struct Dataset *create_quantized_dataset(int num_points, int dim, const double *mins, const double *maxs);
+void free_dataset(struct Dataset **data_address);
+
+
+/*
+POINT FUNCTIONS
+ */
+double squared_distance(const double *point, const double *other, int dim);
+double euclidean_distance(const double *point, const double *other, int dim);
+void point_addition(double *point, const double *other, int dim);
+void point_division(double *point, double divisor, int dim);
+void compute_norms(const double *points, int num_points, int dim, double *norms);
+const struct PointKernels *select_kernels(int dim);
+double normalize_point(double *point, int dim);
+void normalize_dataset(struct Dataset *data);
+void prepare_norms(struct Dataset *data);
+double point_weight(const struct Dataset *data, int index);
+void add_point_to_sum(const struct Dataset *data, int index, double *sum);
+void subtract_point_from_sum(const struct Dataset *data, int index, double *sum);
+void decode_point(const struct Dataset *data, int index, double *point);
+void quantize_point(struct Dataset *data, int index, const double *point);
+
+
+/*
+ASSIGNMENT FUNCTIONS
+ */
+int closest_centroid(const struct PointKernels *kernels, const double *centroids, int K, int dim,
+                     const double *point);
+void assign_blocked(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                    int *labels);
+void assign_sparse(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                   int *labels);
+void assign_quantized(const struct Dataset *data, const struct CentroidCache *cache, int start, int end,
+                      int *labels);
+void prepare_centroids(struct Dataset *data, const double *centroids, int K, struct CentroidCache *cache);
+void free_centroid_cache(struct CentroidCache *cache);
+void assign_range(const struct Dataset *data, const struct CentroidCache *cache, int start, int end, int *labels);
+void assign_labels(struct Dataset *data, const double *centroids, int K, int *labels);
+double labelled_inertia(const struct Dataset *data, const double *centroids, const int *labels, double *dists);
+double nearest_distances(struct Dataset *data, const double *centroids, int K, double *dists);
+
+
+/*
+PARALLEL EXECUTION
+ */
+void set_num_threads(int num_threads);
+int get_num_threads(void);
+int work_threads(int num_threads, double work);
+void parallel_for(int num_threads, int num_tasks, void (*run)(void *context, int task), void *context);
+void create_placement(struct Placement *placement, int num_threads);
+void free_placement(struct Placement *placement);
+void parallel_for_placed(const struct Placement *placement, int num_tasks, void (*run)(void *context, int task),
+                         void *context);
+int place_dataset(struct Dataset *data, const struct Placement *placement, int chunk);
+double monotonic_seconds(void);
+void parallel_for_stealing(int num_threads, const struct Placement *placement, int num_tasks,
+                           void (*run)(void *context, int task), void *context, struct ThreadStats *thread_stats);
+
+/*
+CHECKPOINTS
+ */
+int write_checkpoint(const char *path, const struct Checkpoint *checkpoint);
+struct Checkpoint *read_checkpoint(const char *path);
+void free_checkpoint(struct Checkpoint **checkpoint_address);
+
+
+/*
+CENTROID FUNCTIONS
+ */
+void update_centroid(const struct Dataset *data, int index, double *sum, int *num_points, double *weight);
+void remove_from_centroid(const struct Dataset *data, int index, double *sum, int *num_points, double *weight);
+double finalize_next_centroid_pos(double *centroid, const double *sum, double weight, int dim);
+int reduce_chunk_size(int num_points);
+void default_options(struct KMeansOptions *options);
+void init_stats(struct KMeansStats *stats);
+void free_stats(struct KMeansStats *stats);
+int kmeans(struct Dataset *data, double *centroids, int K, const struct KMeansOptions *options,
+           struct KMeansStats *stats);
+
+
+/*
+MEMORY PLANNING
+ */
+void estimate_memory(long num_points, int dim, int K, const struct MemoryPlan *plan, struct MemoryEstimate *estimate);
+int plan_memory(long num_points, int dim, int K, size_t max_memory, struct MemoryPlan *plan,
+                struct MemoryEstimate *estimate);
+
+
+/*
+ONLINE UPDATES
+ */
+struct OnlineModel *create_online_model(const double *centroids, int K, int dim, int mini_batch, double decay);
+void free_online_model(struct OnlineModel **model_address);
+void online_update(struct OnlineModel *model, struct Dataset *batch);
+
+
+/*
+RANDOM NUMBERS AND SEEDING
+ */
+void seed_random(struct RandomState *random, unsigned long seed);
+unsigned long random_uint32(struct RandomState *random);
+double random_double(struct RandomState *random);
+long random_bounded(struct RandomState *random, long n);
+long random_choice(struct RandomState *random, const double *weights, long n);
+void kmeans_pp_init(const struct Dataset *data, int K, struct RandomState *random, int *chosen);
+
+
+/*
+CORESET CONSTRUCTION
+ */
+struct Dataset *build_coreset(const struct Dataset *data, int size, int num_centers, int num_threads,
+                              struct RandomState *random);
+
+
+/*
+DUPLICATE COLLAPSING
+ */
+struct Dataset *collapse_duplicates(const struct Dataset *data, int *inverse);
+
+
+/*
+MODEL SELECTION
+ */
+int select_k(struct Dataset *data, int k_min, int k_max, const struct KMeansOptions *options,
+             struct RandomState *random, double *inertias, double *elbow_centroids);
+
+
+/*
+BISECTING K-MEANS
+ */
+struct BisectingTree *create_bisecting_tree(int num_nodes, int dim);
+void free_bisecting_tree(struct BisectingTree **tree_address);
+int tree_closest(const struct BisectingTree *tree, const double *point);
+void tree_assign(const struct BisectingTree *tree, const struct Dataset *data, int num_threads, int *labels);
+struct BisectingTree *bisecting_kmeans(struct Dataset *data, int K, const struct KMeansOptions *options,
+                                       struct RandomState *random, double *centroids, int *labels);
+
+
+/*
+SHARDED FIT
+ */
+int serve_shard(const char *address, int shard, int num_shards, struct Dataset *data, int num_threads);
+int coordinate_shards(const char *address, int num_workers, struct Dataset **data_address, double *centroids, int K,
+                      int dim, const struct KMeansOptions *options);
+
+
+/*
+CLUSTER QUALITY
+ */
+double silhouette_score(const struct Dataset *data, const int *labels, int K, int sample_size, int num_threads,
+                        struct RandomState *random, double *half_width);
+
+
+/*
+PARSE INPUT
+ */
+struct Dataset *read_joined_files(const char *path1, const char *path2, double **keys);
+double *read_weights_file(const char *path, const double *keys, int num_points);
+
+#endif
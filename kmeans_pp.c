@@ -0,0 +1,436 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "kmeans_engine.h"
+
+#define DEFAULT_ITER 300
+#define SEED 1234
+
+/*
+Native counterpart of kmeans_pp.py:
+  kmeans_pp [--weights weights_file] [--deduplicate] [--threads N] [--numa]
+            [--checkpoint path] [--checkpoint-every N] [--checkpoint-seconds T] [--checkpoint-labels]
+            [--resume path]
+            [--max-memory BYTES] [--workers N [--coordinate address]]
+            K [iter] epsilon file_name_1 file_name_2
+  kmeans_pp --worker address --shard I/N [--threads N]
+Joins both files on their first column, seeds K centroids with the same random draws as
+kmeans_pp.py, runs Lloyd's algorithm and prints the final centroids.
+weights_file holds key,weight rows giving the weight of the point with that key.
+--deduplicate runs Lloyd's algorithm on the distinct points weighted by their number of copies.
+--threads runs the assignment pass on N threads, --numa pins them and places their points on their node.
+--checkpoint saves the centroids and the random state every N iterations or T seconds (every 10
+iterations if neither is given) and at the end, with --checkpoint-labels the labels of the points
+as well; --resume continues the run saved in path.
+--max-memory keeps the run, from the points read to the final centroids, under BYTES by reducing
+in fewer chunks when needed, and fails if that does not fit. The points stay exact: the CLI
+holds them as read for the whole run, so a quantized copy could only add to them.
+--workers runs Lloyd's algorithm on N worker processes forked on this machine, each holding a
+contiguous shard of the points, over a private Unix socket. With --coordinate the N workers are
+started separately instead, each with --worker address --shard I/N; address is unix:PATH or
+tcp:HOST:PORT. Either way this process reads and seeds the points and sends every worker its
+shard, so a worker never holds more than its own rows. --numa and --checkpoint belong to the
+single process loop and are rejected with --workers.
+ */
+
+int parse_int(const char *arg, int *out) {
+  char *end;
+  long value = strtol(arg, &end, 10);
+
+  if (end == arg || *end != '\0') {
+    return -1;
+  }
+  *out = (int)value;
+  return 0;
+}
+
+int parse_double(const char *arg, double *out) {
+  char *end;
+  double value = strtod(arg, &end);
+
+  if (end == arg || *end != '\0') {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+int parse_shard(const char *arg, int *shard, int *num_shards) {
+  /* I/N with 0 <= I < N */
+  char *slash = strchr(arg, '/');
+  char index[32];
+
+  if (slash == NULL || slash == arg || (size_t)(slash - arg) >= sizeof(index)) {
+    return -1;
+  }
+  memcpy(index, arg, slash - arg);
+  index[slash - arg] = '\0';
+  if (parse_int(index, shard) == -1 || parse_int(slash + 1, num_shards) == -1) {
+    return -1;
+  }
+  return *num_shards >= 1 && *shard >= 0 && *shard < *num_shards ? 0 : -1;
+}
+
+int fit_on_workers(struct Dataset **data_address, double *centroids, int K, const struct KMeansOptions *options,
+                   int num_workers, const char *address) {
+  /*
+  Fork num_workers workers and run the coordinator here, which sends every worker its shard of
+  the points and frees them. A worker drops the points it inherits without touching them and
+  serves the shard it is sent. Returns -1 if the fit or any worker failed.
+   */
+  pid_t *pids = engine_malloc(num_workers * sizeof(pid_t));
+  int dim = (*data_address)->dim;
+  int status;
+  int result = 0;
+  int w;
+
+  fflush(stdout);
+  for (w = 0; w < num_workers; w++) {
+    pids[w] = fork();
+    if (pids[w] == 0) {
+      free_dataset(data_address);
+      status = serve_shard(address, w, num_workers, NULL, options->num_threads);
+      _exit(status == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (pids[w] == -1) {
+      result = -1;
+      num_workers = w;
+      break;
+    }
+  }
+  if (result == 0 && coordinate_shards(address, num_workers, data_address, centroids, K, dim, options) == -1) {
+    result = -1;
+  }
+  free_dataset(data_address);
+  for (w = 0; w < num_workers; w++) {
+    if (result == -1) {
+      kill(pids[w], SIGTERM);
+    }
+    if (waitpid(pids[w], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      result = -1;
+    }
+  }
+
+  free(pids);
+  return result;
+}
+
+void print_centroids(const double *centroids, int K, int dim) {
+  int i;
+  int j;
+
+  for (i = 0; i < K; i++) {
+    for (j = 0; j < dim; j++) {
+      printf(j == dim - 1 ? "%.4f\n" : "%.4f,", centroids[(size_t)i * dim + j]);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int K;
+  struct KMeansOptions options;
+  const char *file_name_1;
+  const char *file_name_2;
+  const char *weights_file = NULL;
+  const char *resume_file = NULL;
+  struct CheckpointPolicy checkpoint;
+  struct Checkpoint *resumed;
+  struct MemoryPlan plan;
+  struct MemoryEstimate estimate;
+  double max_memory = 0.0;
+  const char *coordinate_address = NULL;
+  const char *worker_address = NULL;
+  char socket_path[64];
+  int num_workers = 0;
+  int shard = -1;
+  int num_shards = 0;
+  const char *args[6];
+  struct Dataset *data;
+  struct Dataset *ordered;
+  struct Dataset *unique;
+  int *inverse;
+  int deduplicate = 0;
+  struct RandomState random;
+  double *centroids;
+  double *keys;
+  double *chosen_weights;
+  size_t seeding;
+  int *chosen;
+  char *is_chosen;
+  int num_ordered;
+  int num_args = 0;
+  int i;
+  int k;
+  int dim;
+
+  default_options(&options);
+  options.iter = DEFAULT_ITER;
+  checkpoint.path = NULL;
+  checkpoint.every = 0;
+  checkpoint.seconds = 0.0;
+  checkpoint.labels = 0;
+  checkpoint.random = &random;
+
+  /* Options may appear anywhere, the remaining arguments are positional */
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--weights") == 0 && i + 1 < argc && weights_file == NULL) {
+      weights_file = argv[++i];
+    }
+    else if (strcmp(argv[i], "--deduplicate") == 0) {
+      deduplicate = 1;
+    }
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      if (parse_int(argv[++i], &options.num_threads) == -1 || options.num_threads < 1) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--numa") == 0) {
+      options.numa = 1;
+    }
+    else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpoint.path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      if (parse_int(argv[++i], &checkpoint.every) == -1 || checkpoint.every < 1) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--checkpoint-seconds") == 0 && i + 1 < argc) {
+      if (parse_double(argv[++i], &checkpoint.seconds) == -1 || !(checkpoint.seconds > 0.0)) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--checkpoint-labels") == 0) {
+      checkpoint.labels = 1;
+    }
+    else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      resume_file = argv[++i];
+    }
+    else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+      if (parse_double(argv[++i], &max_memory) == -1 || !(max_memory > 0.0)) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      if (parse_int(argv[++i], &num_workers) == -1 || num_workers < 1) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "--coordinate") == 0 && i + 1 < argc) {
+      coordinate_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+      worker_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      if (parse_shard(argv[++i], &shard, &num_shards) == -1) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (num_args < 6) {
+      args[num_args++] = argv[i];
+    }
+    else {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* A worker is sent its points by the coordinator and takes no other arguments */
+  if (worker_address != NULL) {
+    if (shard == -1 || num_args != 0 || num_workers > 0 || weights_file != NULL || deduplicate || options.numa
+        || checkpoint.path != NULL || resume_file != NULL || max_memory > 0.0) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    if (serve_shard(worker_address, shard, num_shards, NULL, options.num_threads) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+  }
+
+  if (num_args == 4) {
+    if (parse_int(args[0], &K) == -1 || parse_double(args[1], &options.epsilon) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    file_name_1 = args[2];
+    file_name_2 = args[3];
+  }
+  else if (num_args == 5) {
+    if (parse_int(args[0], &K) == -1 || parse_int(args[1], &options.iter) == -1
+        || parse_double(args[2], &options.epsilon) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    file_name_1 = args[3];
+    file_name_2 = args[4];
+  }
+  else {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Checkpoints and NUMA placement belong to the single process loop */
+  if (shard != -1 || (coordinate_address != NULL && num_workers == 0)
+      || (num_workers > 0 && (checkpoint.path != NULL || options.numa))) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.iter >= 1000 || options.iter <= 1) {
+    printf("Invalid maximum iteration!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  data = read_joined_files(file_name_1, file_name_2, &keys);
+  if (data == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (weights_file != NULL) {
+    data->weights = read_weights_file(weights_file, keys, data->num_points);
+    if (data->weights == NULL) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(keys);
+
+  if (K <= 1 || K >= data->num_points) {
+    printf("Invalid number of clusters!\n");
+    free_dataset(&data);
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+  The cap is checked once the files are read, their number of points is not known before. The
+  points read are the ones the run uses, so they stay exact, and the seeding buffers come out
+  of the cap before the run is planned.
+   */
+  if (max_memory > 0.0) {
+    seeding = (size_t)data->num_points * (sizeof(int) + (data->weights != NULL ? 2 : 1) * sizeof(double) + 1);
+    plan.storage = STORAGE_DENSE;
+    plan.allow_quantize = 0;
+    plan.labels = 0;
+    plan.weights = data->weights != NULL;
+    plan.deduplicate = deduplicate;
+    plan.numa = options.numa;
+    plan.checkpoint = checkpoint.path != NULL;
+    plan.checkpoint_labels = checkpoint.labels;
+    plan.nnz = 0;
+    if (seeding >= max_memory
+        || plan_memory(data->num_points, data->dim, K, (size_t)max_memory - seeding, &plan, &estimate) == -1) {
+      printf("An Error has Occurred\n");
+      free_dataset(&data);
+      exit(EXIT_FAILURE);
+    }
+    options.max_chunks = plan.max_chunks;
+  }
+
+  dim = data->dim;
+  chosen = engine_malloc(K * sizeof(int));
+  seed_random(&random, SEED);
+  kmeans_pp_init(data, K, &random, chosen);
+
+  /*
+  Same point order as kmeans_pp.py hands to fit: unchosen points, then the centroids. Rows only
+  move towards the front, so the points are reordered in place.
+   */
+  is_chosen = engine_calloc(data->num_points, 1);
+  centroids = engine_malloc((size_t)K * dim * sizeof(double));
+  chosen_weights = engine_malloc(K * sizeof(double));
+  for (k = 0; k < K; k++) {
+    is_chosen[chosen[k]] = 1;
+    memcpy(centroids + (size_t)k * dim, data->points + (size_t)chosen[k] * dim, dim * sizeof(double));
+    chosen_weights[k] = data->weights != NULL ? data->weights[chosen[k]] : 1.0;
+  }
+
+  num_ordered = 0;
+  for (i = 0; i < data->num_points; i++) {
+    if (!is_chosen[i]) {
+      if (data->weights != NULL) {
+        data->weights[num_ordered] = data->weights[i];
+      }
+      memmove(data->points + (size_t)num_ordered++ * dim, data->points + (size_t)i * dim, dim * sizeof(double));
+    }
+  }
+  memcpy(data->points + (size_t)num_ordered * dim, centroids, (size_t)K * dim * sizeof(double));
+  for (k = 0; k < K && data->weights != NULL; k++) {
+    data->weights[num_ordered + k] = chosen_weights[k];
+  }
+  free(chosen_weights);
+  ordered = data;
+
+  if (deduplicate) {
+    inverse = engine_malloc((size_t)ordered->num_points * sizeof(int));
+    unique = collapse_duplicates(ordered, inverse);
+    if (unique == NULL) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    free(inverse);
+    free_dataset(&ordered);
+    ordered = unique;
+  }
+
+  /* Seeding still runs on resume, it fixes the point order the saved run used */
+  if (resume_file != NULL) {
+    resumed = read_checkpoint(resume_file);
+    if (resumed == NULL || resumed->K != K || resumed->dim != dim) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(centroids, resumed->centroids, (size_t)K * dim * sizeof(double));
+    options.start_iteration = resumed->iteration;
+    if (resumed->has_random) {
+      random = resumed->random;
+    }
+    free_checkpoint(&resumed);
+  }
+  if (checkpoint.path != NULL) {
+    if (checkpoint.every == 0 && checkpoint.seconds == 0.0) {
+      checkpoint.every = CHECKPOINT_EVERY;
+    }
+    options.checkpoint = &checkpoint;
+  }
+
+  if (num_workers > 0 && coordinate_address != NULL) {
+    if (coordinate_shards(coordinate_address, num_workers, &ordered, centroids, K, dim, &options) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (num_workers > 0) {
+    sprintf(socket_path, "unix:/tmp/kmeans_pp.%ld.sock", (long)getpid());
+    if (fit_on_workers(&ordered, centroids, K, &options, num_workers, socket_path) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (kmeans(ordered, centroids, K, &options, NULL) < 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  print_centroids(centroids, K, dim);
+
+  free(chosen);
+  free(is_chosen);
+  free(centroids);
+  free_dataset(&ordered);
+  exit(EXIT_SUCCESS);
+}
@@ -1,13 +1,15 @@
 import argparse
+import multiprocessing
 import os
+import shutil
+import tempfile
 import numpy as np
-import pandas as pd
 import math
 import mykmeanssp 
-from typing import List, Union
+from typing import List, Optional, Tuple, Union
 
 
-def kmeansplusplus(K: int, dataframe: pd.DataFrame) -> List[List[float]]:
+def kmeansplusplus(K: int, points: np.ndarray, weights: Optional[np.ndarray] = None) -> Tuple[List[List[float]], np.ndarray, Optional[np.ndarray]]:
     """
     Method described in HW2 to initialize the first K centroids
 
@@ -15,22 +17,32 @@ def kmeansplusplus(K: int, dataframe: pd.DataFrame) -> List[List[float]]:
     ----------
     K : int
         Number of centroids to be initialized
-    dataframe : pd.DataFrame
-        Dataframe of all points that we are given (two files were given and were inner joined and sorted (essentially just in each row of the first point coordinates the last
-        n-1 points in the second input file in the corresponding row(they have same keys on the first column)))
+    points : np.ndarray
+        Array of all points that we are given (two files were given and were inner joined and sorted (essentially just in each row of the first point coordinates the last
+        n-1 points in the second input file in the corresponding row(they have same keys on the first column))).
+        Chosen centroids are removed from the array, so the remaining points are returned alongside them.
+    weights : np.ndarray, optional
+        Weight of every point. The first centroid is then drawn proportionally to weight and every
+        next one proportionally to weight times distance.
 
     Returns
     -------
-    List[List[float]]
-        _description_
+    Tuple[List[List[float]], np.ndarray, Optional[np.ndarray]]
+        The K initial centroids, the points that were not chosen and their weights (None without weights)
     """
     np.random.seed(1234)
     centroids = []
-    rows = dataframe.shape[0]
-    initial_centroid_index = np.random.choice(list(range(rows)))
-    initial_centroid = dataframe.iloc[initial_centroid_index].values.tolist()
+    chosen_weights = []
+    rows = points.shape[0]
+    if weights is None:
+        initial_centroid_index = np.random.choice(list(range(rows)))
+    else:
+        initial_centroid_index = np.random.choice(list(range(rows)), p=calc_probabilities(weights, sequential_sum(weights)))
+        chosen_weights.append(weights[initial_centroid_index])
+        weights = np.delete(weights, initial_centroid_index)
+    initial_centroid = points[initial_centroid_index].tolist()
     centroids.append(initial_centroid)
-    dataframe.drop(dataframe.index[initial_centroid_index], axis=0, inplace=True)
+    points = np.delete(points, initial_centroid_index, axis=0)
     
     while len(centroids) < K:
         total_dist = 0
@@ -38,18 +50,25 @@ def kmeansplusplus(K: int, dataframe: pd.DataFrame) -> List[List[float]]:
         # Each time we remove a row so we need to update the number of rows.
         rows = rows - 1
 
-        for i, row in enumerate(dataframe.values):
+        for i, row in enumerate(points):
             closest_centroid_distance = closest_cluster_distance(centroids, row)
+            if weights is not None:
+                closest_centroid_distance *= weights[i]
             distances.append(closest_centroid_distance)
             total_dist += closest_centroid_distance
         
         probabilities = calc_probabilities(distances, total_dist)
         centroid_index = np.random.choice(list(range(rows)), p=probabilities) 
-        centroid = dataframe.iloc[centroid_index].values.tolist()
+        centroid = points[centroid_index].tolist()
         centroids.append(centroid)  
-        dataframe.drop(dataframe.index[centroid_index], axis=0, inplace=True)
+        points = np.delete(points, centroid_index, axis=0)
+        if weights is not None:
+            chosen_weights.append(weights[centroid_index])
+            weights = np.delete(weights, centroid_index)
 
-    return centroids
+    if weights is not None:
+        weights = np.concatenate([weights, chosen_weights])
+    return centroids, points, weights
 
         
 
@@ -74,24 +93,84 @@ def calc_probabilities(distances_list, total_distances):
         probabilities.append(distances_list[i]/total_distances)
     return probabilities
 
-def read_files(filepath1: str, filepath2: str) -> pd.DataFrame:
+def sequential_sum(values) -> float:
+    """
+    Left to right sum, the order the C module adds weights in.
+    """
+    total = 0
+    for value in values:
+        total += value
+    return total
+
+def read_files(filepath1: str, filepath2: str, weights_path: Optional[str] = None) -> Tuple[np.ndarray, Optional[np.ndarray]]:
     """
 
     Parameters
     ----------
-    distances_list : _type_
-        _description_
-    total_distances : _type_
-        _description_
-        
+    filepath1 : str
+        First input file, the first column of each row is its key
+    filepath2 : str
+        Second input file, keyed the same way
+    weights_path : str, optional
+        File of key,weight rows giving the weight of every joined point
+
+    Returns
+    ----------
+    Tuple[np.ndarray, Optional[np.ndarray]]
+        Inner join of both files on the key, sorted by key, without the key column,
+        and the weight of every joined point (None without a weights file).
+        The join is done by the C module straight into a contiguous buffer.
     """
-    df_file1: pd.DataFrame = pd.read_csv(filepath1, header=None)
-    df_file2: pd.DataFrame = pd.read_csv(filepath2, header=None)
-    inner_join_df: pd.DataFrame = pd.merge(df_file1, df_file2, how='inner', left_on=0, right_on=0)
-    inner_join_df.sort_values(by=0, inplace=True)    
-    inner_join_df.drop([0], axis=1, inplace=True)
-    return inner_join_df
+    if weights_path is None:
+        return np.asarray(mykmeanssp.read_files(filepath1, filepath2)), None
+    points, weights = mykmeanssp.read_files(filepath1, filepath2, weights_path)
+    return np.asarray(points), np.asarray(weights)
     
+def serve_shard(address: str, shard: int, num_workers: int, num_threads: int) -> None:
+    """
+    Worker process of fit_on_workers: serves the coordinator the contiguous shard of rows
+    [shard * N / num_workers, (shard + 1) * N / num_workers) of the points, which the
+    coordinator sends it once it connects.
+    """
+    mykmeanssp.serve_shard(address, shard, num_workers, num_threads=num_threads)
+
+def fit_on_workers(points: np.ndarray, centroids: List[List[float]], iterations: int, epsilon: float,
+                   weights: Optional[np.ndarray], num_workers: int, num_threads: int, deduplicate: bool,
+                   resume: Optional[str], max_memory: int) -> List[List[float]]:
+    """
+
+    Parameters
+    ----------
+    num_workers : int
+        Number of local worker processes, each holding one shard of the points
+
+    Returns
+    ----------
+    List[List[float]]
+        Centroids of Lloyd's algorithm run by this process as coordinator over the workers,
+        which it reaches through a Unix socket in a private temporary directory. The workers
+        are spawned fresh rather than forked, so they hold only the shard they are sent.
+    """
+    directory = tempfile.mkdtemp()
+    address = 'unix:' + os.path.join(directory, 'coordinator.sock')
+    context = multiprocessing.get_context('spawn')
+    workers = [context.Process(target=serve_shard, args=(address, shard, num_workers, num_threads))
+               for shard in range(num_workers)]
+    for worker in workers:
+        worker.start()
+    try:
+        return mykmeanssp.coordinate(address, num_workers, centroids, iterations, epsilon, points=points,
+                                     weights=weights, deduplicate=deduplicate, resume=resume,
+                                     max_memory=max_memory)
+    except BaseException:
+        for worker in workers:
+            worker.terminate()
+        raise
+    finally:
+        for worker in workers:
+            worker.join()
+        shutil.rmtree(directory, ignore_errors=True)
+
 def parse() -> argparse.Namespace:
     """
 
@@ -109,7 +188,18 @@ def parse() -> argparse.Namespace:
     parser.add_argument('epsilon', type=str)
     parser.add_argument('file_name_1', type=str)
     parser.add_argument('file_name_2', type=str)
-    return parser.parse_args()
+    parser.add_argument('--weights', type=str, default=None)
+    parser.add_argument('--deduplicate', action='store_true')
+    parser.add_argument('--threads', type=int, default=1)
+    parser.add_argument('--numa', action='store_true')
+    parser.add_argument('--checkpoint', type=str, default=None)
+    parser.add_argument('--checkpoint-every', type=int, default=0)
+    parser.add_argument('--checkpoint-seconds', type=float, default=0.0)
+    parser.add_argument('--checkpoint-labels', action='store_true')
+    parser.add_argument('--resume', type=str, default=None)
+    parser.add_argument('--max-memory', type=int, default=0)
+    parser.add_argument('--workers', type=int, default=0)
+    return parser.parse_intermixed_args()
 
 def euclidean_distance(point, other) -> float:
     """
@@ -165,24 +255,43 @@ def main():
     except ValueError:
         print("An Error has Occurred")
     
+    # Checkpoints and NUMA placement belong to the single process loop
+    if args.workers > 0 and (args.checkpoint is not None or args.numa):
+        print("An Error has Occurred")
+        return
+
     if iterations >= 1000 or iterations <= 1 or type(iterations) != int:
 
         print("Invalid maximum iteration!")
         return
 
-    points_dataframe = read_files(filepath1, filepath2)
-    num_points = points_dataframe.shape[0]
+    weights_path = None if args.weights is None else os.path.join(os.getcwd(), args.weights)
+    points, weights = read_files(filepath1, filepath2, weights_path)
+    num_points = points.shape[0]
     
     if K <= 1 or K >= num_points or type(K) != int:
         print("Invalid number of clusters!")
         return
 
-    centroids = kmeansplusplus(K, points_dataframe)
+    centroids, points, weights = kmeansplusplus(K, points, weights)
 
-    points = points_dataframe.astype(float).values.tolist()
-    points.extend(centroids)
+    points = np.vstack([points, centroids])
 
-    final_centroids = mykmeanssp.fit(points, centroids, K, iterations, epsilon)
+    try:
+        if args.workers > 0:
+            final_centroids = fit_on_workers(points, centroids, iterations, epsilon, weights, args.workers,
+                                             args.threads, args.deduplicate, args.resume, args.max_memory)
+        else:
+            final_centroids = mykmeanssp.fit(points, centroids, K, iterations, epsilon, weights=weights,
+                                             deduplicate=args.deduplicate, num_threads=args.threads, numa=args.numa,
+                                             checkpoint=args.checkpoint, checkpoint_every=args.checkpoint_every,
+                                             checkpoint_seconds=args.checkpoint_seconds,
+                                             checkpoint_labels=args.checkpoint_labels,
+                                             random_state=np.random.get_state(), resume=args.resume,
+                                             max_memory=args.max_memory)
+    except (MemoryError, OSError):
+        print("An Error has Occurred")
+        return
     
     for row in final_centroids:
         print(','.join(['%.4f' % num for num in row]))
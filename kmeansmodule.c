@@ -3,723 +3,2348 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
-struct PointCoords {
-  double val;
-  struct PointCoords* next;
-};
+#include "kmeans_engine.h"
 
-struct Point {
-  struct PointCoords* head;
-  struct PointCoords* last;
-  struct Point* next;
-};
 
-struct PointsList {
-  struct Point* head;
-  struct Point* last;
- };
+/*
+CONVERSION BETWEEN PYTHON LISTS AND CONTIGUOUS BUFFERS
+ */
+
+void matrix_shape(PyObject *matrix_py_ptr, int *num_rows, int *num_cols) {
+  /* Assumes valid Python List Object is passed to function, meaning error checks for type should be external */
+  PyObject *py_row;
+
+  if (PyList_Size(matrix_py_ptr) == 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  py_row = PyList_GetItem(matrix_py_ptr, 0);
+  if (!PyList_Check(py_row)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  *num_rows = (int)PyList_Size(matrix_py_ptr);
+  *num_cols = (int)PyList_Size(py_row);
+}
+
+void unpack_row(PyObject *matrix_py_ptr, int row, int num_cols, double *out) {
+  PyObject *py_row;
+  PyObject *py_coord;
+  int j;
+
+  py_row = PyList_GetItem(matrix_py_ptr, row);
+  if (!PyList_Check(py_row) || PyList_Size(py_row) != num_cols) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  for (j = 0; j < num_cols; j++) {
+    py_coord = PyList_GetItem(py_row, j);
+    if (Py_IS_TYPE(py_coord, &PyFloat_Type) == 0) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    out[j] = PyFloat_AsDouble(py_coord);
+  }
+}
+
+double* unpack_matrix(PyObject *matrix_py_ptr, int *num_rows, int *num_cols) {
+  double *matrix;
+  int i;
+
+  matrix_shape(matrix_py_ptr, num_rows, num_cols);
+  matrix = engine_malloc((size_t)*num_rows * *num_cols * sizeof(double));
+
+  for (i = 0; i < *num_rows; i++) {
+    unpack_row(matrix_py_ptr, i, *num_cols, matrix + (size_t)i * *num_cols);
+  }
+  return matrix;
+}
 
-struct Centroid {
-  struct Point* centroid;
-  struct Point* centroid_next_pos;
-  struct Centroid* next;
+struct Dataset* unpack_points_list(PyObject *points_list_py_ptr) {
+  struct Dataset *data;
   int num_points;
-};
+  int dim;
+  int i;
 
-struct CentroidsList{
-  struct Centroid* head;
-};
+  matrix_shape(points_list_py_ptr, &num_points, &dim);
+  data = create_dataset(num_points, dim);
 
-struct Lists {
-  struct PointsList **points_list_address;
-  struct CentroidsList **centroids_list_address;
-};
+  for (i = 0; i < num_points; i++) {
+    unpack_row(points_list_py_ptr, i, dim, data->points + (size_t)i * dim);
+  }
+  return data;
+}
 
-struct Lists *lists = NULL;
+struct Dataset* unpack_quantized(PyObject *points_list_py_ptr) {
+  /*
+  Quantizes a list of lists to one byte per coordinate without materialising the dense matrix:
+  a first pass finds the per-dimension range, a second pass encodes row by row.
+   */
+  struct Dataset *data;
+  double *row;
+  double *mins;
+  double *maxs;
+  int num_points;
+  int dim;
+  int i;
+  int j;
 
-/*
-MEMORY MANAGEMENT, FREEING ALL INITIALIZED MEMORY
- */
+  matrix_shape(points_list_py_ptr, &num_points, &dim);
+  row = engine_malloc(dim * sizeof(double));
+  mins = engine_malloc(dim * sizeof(double));
+  maxs = engine_malloc(dim * sizeof(double));
+
+  for (i = 0; i < num_points; i++) {
+    unpack_row(points_list_py_ptr, i, dim, row);
+    for (j = 0; j < dim; j++) {
+      if (i == 0 || row[j] < mins[j]) {
+        mins[j] = row[j];
+      }
+      if (i == 0 || row[j] > maxs[j]) {
+        maxs[j] = row[j];
+      }
+    }
+  }
 
+  data = create_quantized_dataset(num_points, dim, mins, maxs);
+  for (i = 0; i < num_points; i++) {
+    unpack_row(points_list_py_ptr, i, dim, row);
+    quantize_point(data, i, row);
+  }
 
-void free_point(struct Point** ptr) {
-  struct PointCoords *prev;
-  struct PointCoords *curr;
+  free(row);
+  free(mins);
+  free(maxs);
+  return data;
+}
 
-  if (*ptr == NULL) {
-    return;
+struct Dataset* unpack_dense_buffer(PyObject *buffer_py_ptr, int quantize) {
+  /*
+  Copies a C contiguous 2D buffer of doubles (e.g. the result of read_files or a numpy array),
+  or with quantize encodes it straight from the buffer at one byte per coordinate.
+   */
+  Py_buffer view;
+  struct Dataset *data;
+  const double *row;
+  double *mins;
+  double *maxs;
+  int num_points;
+  int dim;
+  int i;
+  int j;
+
+  if (PyObject_GetBuffer(buffer_py_ptr, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == -1) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (view.ndim != 2 || view.format == NULL || strcmp(view.format + strlen(view.format) - 1, "d") != 0
+      || view.shape[0] == 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
 
-  prev = (*ptr)->head;
+  num_points = (int)view.shape[0];
+  dim = (int)view.shape[1];
+  if (!quantize) {
+    data = create_dataset(num_points, dim);
+    memcpy(data->points, view.buf, view.len);
+    PyBuffer_Release(&view);
+    return data;
+  }
 
-  while(prev != NULL) {
-    curr = prev->next;
-    free(prev);
-    prev = curr;
+  mins = engine_malloc(dim * sizeof(double));
+  maxs = engine_malloc(dim * sizeof(double));
+  for (i = 0; i < num_points; i++) {
+    row = (const double *)view.buf + (size_t)i * dim;
+    for (j = 0; j < dim; j++) {
+      if (i == 0 || row[j] < mins[j]) {
+        mins[j] = row[j];
+      }
+      if (i == 0 || row[j] > maxs[j]) {
+        maxs[j] = row[j];
+      }
+    }
+  }
+  data = create_quantized_dataset(num_points, dim, mins, maxs);
+  for (i = 0; i < num_points; i++) {
+    quantize_point(data, i, (const double *)view.buf + (size_t)i * dim);
   }
 
-  free(*ptr);
-  *ptr = NULL;
+  free(mins);
+  free(maxs);
+  PyBuffer_Release(&view);
+  return data;
 }
 
-void free_pointslist(struct PointsList** list) {
-  struct Point *prev;
-  struct Point* curr;
+PyObject* dataset_to_memoryview(const struct Dataset *data) {
+  /* 2D memoryview of doubles over a bytearray, usable as-is by numpy.asarray and fit */
+  PyObject *bytes_py;
+  PyObject *flat_py;
+  PyObject *view_py;
+  Py_ssize_t size = (Py_ssize_t)data->num_points * data->dim * sizeof(double);
 
-  if (list == NULL) {
-    return;
+  bytes_py = PyByteArray_FromStringAndSize(NULL, size);
+  if (bytes_py == NULL) {
+    return NULL;
   }
+  memcpy(PyByteArray_AS_STRING(bytes_py), data->points, size);
+
+  flat_py = PyMemoryView_FromObject(bytes_py);
+  Py_DECREF(bytes_py);
+  if (flat_py == NULL) {
+    return NULL;
+  }
+  view_py = PyObject_CallMethod(flat_py, "cast", "s(ii)", "d", data->num_points, data->dim);
+  Py_DECREF(flat_py);
+  return view_py;
+}
+
+long* unpack_index_buffer(PyObject *buffer_py_ptr, Py_ssize_t *length) {
+  /* Copies a buffer of 32 or 64 bit integers (e.g. numpy int32/int64, array('i'/'l')) */
+  Py_buffer view;
+  Py_ssize_t count;
+  Py_ssize_t i;
+  long *out;
 
-  prev = (*list)->head;
+  if (PyObject_GetBuffer(buffer_py_ptr, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == -1) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (view.format == NULL || strchr("ilq", view.format[strlen(view.format) - 1]) == NULL
+      || (view.itemsize != 4 && view.itemsize != 8)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-  while(prev != NULL) {
-    curr = prev->next;
-    free_point(&prev);
-    prev = curr;
+  count = view.len / view.itemsize;
+  out = engine_malloc(count * sizeof(long));
+  for (i = 0; i < count; i++) {
+    out[i] = view.itemsize == 4 ? (long)((int *)view.buf)[i] : (long)((long long *)view.buf)[i];
   }
-  free(*list);
-  *list = NULL;
+
+  PyBuffer_Release(&view);
+  *length = count;
+  return out;
 }
 
-void free_centroid(struct Centroid **centroid_ptr_address) {
-  struct Centroid *centroid_ptr;
+struct Dataset* unpack_csr(PyObject *data_py_ptr, PyObject *indices_py_ptr, PyObject *indptr_py_ptr, int dim) {
+  /*
+  Builds a CSR dataset from the data / indices / indptr buffers of a compressed sparse row matrix.
+  Only the non-zeros are copied, so memory scales with nnz rather than N * dim.
+   */
+  Py_buffer view;
+  Py_ssize_t nnz;
+  Py_ssize_t num_indices;
+  Py_ssize_t num_indptr;
+  Py_ssize_t i;
+  long *indices;
+  long *indptr;
+  struct Dataset *data;
 
-  if (centroid_ptr_address == NULL) {
-    return;
+  if (PyObject_GetBuffer(data_py_ptr, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == -1) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
-  centroid_ptr = *centroid_ptr_address;
-  if (centroid_ptr == NULL) {
-    return;
+  if (view.format == NULL || strcmp(view.format + strlen(view.format) - 1, "d") != 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
+  nnz = view.len / view.itemsize;
 
+  indices = unpack_index_buffer(indices_py_ptr, &num_indices);
+  indptr = unpack_index_buffer(indptr_py_ptr, &num_indptr);
 
-  if (centroid_ptr->centroid != NULL) {
-    free_point(&(centroid_ptr->centroid));
+  if (num_indices != nnz || num_indptr < 2 || indptr[0] != 0 || indptr[num_indptr - 1] != nnz || dim <= 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
 
-  if (centroid_ptr->centroid_next_pos != NULL) {
-    free_point(&(centroid_ptr->centroid_next_pos));
+  data = create_csr_dataset((int)(num_indptr - 1), dim, (long)nnz);
+  memcpy(data->values, view.buf, nnz * sizeof(double));
+  PyBuffer_Release(&view);
+
+  for (i = 0; i < nnz; i++) {
+    if (indices[i] < 0 || indices[i] >= dim) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    data->indices[i] = (int)indices[i];
   }
-  free(*centroid_ptr_address);
-  centroid_ptr = NULL;
-  *centroid_ptr_address = NULL;
+  for (i = 0; i < num_indptr; i++) {
+    if (i > 0 && indptr[i] < indptr[i - 1]) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    data->indptr[i] = indptr[i];
+  }
+
+  free(indices);
+  free(indptr);
+  return data;
 }
 
-void free_centroidslist(struct CentroidsList **centroid_list_ptr_address) {
-  struct Centroid *prev;
-  struct Centroid* curr;
-  struct CentroidsList *centroid_list_ptr;
-  if (centroid_list_ptr_address == NULL) {
+struct Dataset* unpack_dataset(PyObject *points_py_ptr, int quantize) {
+  /*
+  Points are either a list of lists of floats, a 2D buffer of doubles, a (data, indices, indptr, dim) tuple,
+  or a CSR matrix object exposing data, indices, indptr and shape (e.g. scipy.sparse.csr_matrix).
+  quantize stores dense points with one byte per coordinate.
+   */
+  PyObject *values;
+  PyObject *indices;
+  PyObject *indptr;
+  PyObject *shape;
+  struct Dataset *data;
+  int rows;
+  int dim;
+
+  if (PyList_Check(points_py_ptr)) {
+    return quantize ? unpack_quantized(points_py_ptr) : unpack_points_list(points_py_ptr);
+  }
+
+  if (PyObject_CheckBuffer(points_py_ptr)) {
+    return unpack_dense_buffer(points_py_ptr, quantize);
+  }
+
+  if (PyTuple_Check(points_py_ptr)) {
+    if (!PyArg_ParseTuple(points_py_ptr, "OOOi", &values, &indices, &indptr, &dim)) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    return unpack_csr(values, indices, indptr, dim);
+  }
+
+  values = PyObject_GetAttrString(points_py_ptr, "data");
+  indices = PyObject_GetAttrString(points_py_ptr, "indices");
+  indptr = PyObject_GetAttrString(points_py_ptr, "indptr");
+  shape = PyObject_GetAttrString(points_py_ptr, "shape");
+
+  if (values == NULL || indices == NULL || indptr == NULL || shape == NULL
+      || !PyArg_ParseTuple(shape, "ii", &rows, &dim)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  data = unpack_csr(values, indices, indptr, dim);
+
+  Py_DECREF(values);
+  Py_DECREF(indices);
+  Py_DECREF(indptr);
+  Py_DECREF(shape);
+  return data;
+}
+
+static Py_ssize_t buffer_length(PyObject *buffer_py_ptr) {
+  /* Number of items of a buffer, without copying it */
+  Py_buffer view;
+  Py_ssize_t length;
+
+  if (PyObject_GetBuffer(buffer_py_ptr, &view, PyBUF_C_CONTIGUOUS) == -1) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  length = view.len / view.itemsize;
+  PyBuffer_Release(&view);
+  return length;
+}
+
+void dataset_shape(PyObject *points_py_ptr, long *num_points, int *dim, struct MemoryPlan *plan) {
+  /* Size and storage of the dataset unpack_dataset would build from points, read without building it */
+  PyObject *values;
+  PyObject *indices;
+  PyObject *indptr;
+  PyObject *shape;
+  Py_buffer view;
+  int rows;
+  int cols;
+
+  plan->storage = STORAGE_DENSE;
+  plan->nnz = 0;
+  if (PyList_Check(points_py_ptr)) {
+    matrix_shape(points_py_ptr, &rows, &cols);
+    *num_points = rows;
+    *dim = cols;
+    return;
+  }
+
+  if (PyObject_CheckBuffer(points_py_ptr)) {
+    if (PyObject_GetBuffer(points_py_ptr, &view, PyBUF_ND) == -1 || view.ndim != 2) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    *num_points = (long)view.shape[0];
+    *dim = (int)view.shape[1];
+    PyBuffer_Release(&view);
     return;
   }
 
-  centroid_list_ptr = *centroid_list_ptr_address;
-  if (centroid_list_ptr == NULL) {
+  plan->storage = STORAGE_CSR;
+  if (PyTuple_Check(points_py_ptr)) {
+    if (!PyArg_ParseTuple(points_py_ptr, "OOOi", &values, &indices, &indptr, dim)) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    plan->nnz = (long)buffer_length(values);
+    *num_points = (long)buffer_length(indptr) - 1;
     return;
   }
 
+  values = PyObject_GetAttrString(points_py_ptr, "data");
+  shape = PyObject_GetAttrString(points_py_ptr, "shape");
+  if (values == NULL || shape == NULL || !PyArg_ParseTuple(shape, "ii", &rows, dim)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  plan->nnz = (long)buffer_length(values);
+  *num_points = rows;
+  Py_DECREF(values);
+  Py_DECREF(shape);
+}
+
+double* unpack_weights(PyObject *weights_py_ptr, int num_points) {
+  /* One non-negative weight per point, as a list of floats or a 1D buffer of doubles */
+  Py_buffer view;
+  double *weights = engine_malloc((size_t)num_points * sizeof(double));
+  int i;
+
+  if (PyList_Check(weights_py_ptr)) {
+    if (PyList_Size(weights_py_ptr) != num_points) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_points; i++) {
+      weights[i] = PyFloat_AsDouble(PyList_GetItem(weights_py_ptr, i));
+      if (PyErr_Occurred()) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  else {
+    if (PyObject_GetBuffer(weights_py_ptr, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    if (view.format == NULL || strcmp(view.format + strlen(view.format) - 1, "d") != 0
+        || view.len != (Py_ssize_t)num_points * (Py_ssize_t)sizeof(double)) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(weights, view.buf, view.len);
+    PyBuffer_Release(&view);
+  }
+
+  for (i = 0; i < num_points; i++) {
+    if (!(weights[i] >= 0.0)) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return weights;
+}
+
+int* unpack_labels(PyObject *labels_py_ptr, int num_points, int *K) {
+  /* One non-negative cluster index per point, as a list of ints or a buffer of integers; K is the largest + 1 */
+  long *buffer;
+  Py_ssize_t length;
+  int *labels = engine_malloc((size_t)num_points * sizeof(int));
+  long label;
+  int i;
+
+  buffer = NULL;
+  if (PyList_Check(labels_py_ptr)) {
+    if (PyList_Size(labels_py_ptr) != num_points) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  else {
+    buffer = unpack_index_buffer(labels_py_ptr, &length);
+    if (length != num_points) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  *K = 0;
+  for (i = 0; i < num_points; i++) {
+    label = buffer != NULL ? buffer[i] : PyLong_AsLong(PyList_GetItem(labels_py_ptr, i));
+    if (label < 0 || label > 0x7fffffffL - 1 || PyErr_Occurred()) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    labels[i] = (int)label;
+    if (labels[i] + 1 > *K) {
+      *K = labels[i] + 1;
+    }
+  }
+
+  free(buffer);
+  return labels;
+}
+
+PyObject* convert_labels_pyobject(const int *labels, int num_points) {
+  PyObject *labels_py = PyList_New(num_points);
+  PyObject *label_py;
+  int i;
+
+  if (labels_py == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < num_points; i++) {
+    label_py = PyLong_FromLong(labels[i]);
+    if (label_py == NULL) {
+      Py_DECREF(labels_py);
+      return NULL;
+    }
+    PyList_SET_ITEM(labels_py, i, label_py);
+  }
+  return labels_py;
+}
+
+PyObject* convert_weights_pyobject(const double *weights, int num_points) {
+  PyObject *weights_py = PyList_New(num_points);
+  PyObject *weight_py;
+  int i;
+
+  if (weights_py == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < num_points; i++) {
+    weight_py = PyFloat_FromDouble(weights[i]);
+    if (weight_py == NULL) {
+      Py_DECREF(weights_py);
+      return NULL;
+    }
+    PyList_SET_ITEM(weights_py, i, weight_py);
+  }
+  return weights_py;
+}
+
+PyObject* convert_centroids_pyobject(const double *centroids, int K, int dim) {
+  int i;
+  int j;
+  PyObject* centroids_list_py_ptr = PyList_New(K);
+  PyObject* temp_list_py;
+  PyObject* temp_coord_py;
+
+  if (centroids_list_py_ptr == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < K; i++) {
+    temp_list_py = PyList_New(dim);
+
+    if (temp_list_py == NULL) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (j = 0; j < dim; j++) {
+      temp_coord_py = PyFloat_FromDouble(centroids[(size_t)i * dim + j]);
+      if (temp_coord_py == NULL) {
+        printf("An Error has Occurred\n");
+        exit(EXIT_FAILURE);
+      }
+      PyList_SET_ITEM(temp_list_py, j, temp_coord_py);
+    }
+    PyList_SET_ITEM(centroids_list_py_ptr, i, temp_list_py);
+  }
+
+  return centroids_list_py_ptr;
+}
+
+
+static int unpack_tree_links(PyObject *links_py_ptr, int num_nodes, int *links) {
+  /* A list of num_nodes ints, each -1 or above */
+  long link;
+  int i;
+
+  if (links_py_ptr == NULL || !PyList_Check(links_py_ptr) || PyList_Size(links_py_ptr) != num_nodes) {
+    return -1;
+  }
+  for (i = 0; i < num_nodes; i++) {
+    link = PyLong_AsLong(PyList_GetItem(links_py_ptr, i));
+    if (link < -1 || link > 0x7fffffffL - 1 || PyErr_Occurred()) {
+      return -1;
+    }
+    links[i] = (int)link;
+  }
+  return 0;
+}
+
+struct BisectingTree* unpack_tree(PyObject *tree_py_ptr, int K, int dim) {
+  /*
+  Tree returned by bisect, {"centers": [...], "first_child": [...], "leaf": [...]}. Children must
+  come after their parent, so every descent ends, and every leaf must name one of the K centroids.
+   */
+  struct BisectingTree *tree;
+  PyObject *centers_py;
+  double *centers;
+  int num_nodes;
+  int centers_dim;
+  int i;
+
+  centers_py = PyDict_Check(tree_py_ptr) ? PyDict_GetItemString(tree_py_ptr, "centers") : NULL;
+  if (centers_py == NULL || !PyList_Check(centers_py)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  centers = unpack_matrix(centers_py, &num_nodes, &centers_dim);
+  tree = create_bisecting_tree(num_nodes, dim);
+  free(tree->centers);
+  tree->centers = centers;
+
+  if (centers_dim != dim
+      || unpack_tree_links(PyDict_GetItemString(tree_py_ptr, "first_child"), num_nodes, tree->first_child) == -1
+      || unpack_tree_links(PyDict_GetItemString(tree_py_ptr, "leaf"), num_nodes, tree->leaf) == -1) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < num_nodes; i++) {
+    if (tree->first_child[i] == -1 ? tree->leaf[i] < 0 || tree->leaf[i] >= K
+                                   : tree->first_child[i] <= i || tree->first_child[i] + 1 >= num_nodes) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return tree;
+}
+
+PyObject* convert_tree_pyobject(const struct BisectingTree *tree) {
+  PyObject *first_child_py = convert_labels_pyobject(tree->first_child, tree->num_nodes);
+  PyObject *leaf_py = convert_labels_pyobject(tree->leaf, tree->num_nodes);
 
-  prev = centroid_list_ptr->head;
-  while(prev != NULL) {
-    curr = prev->next;
-    free_centroid(&prev);
-    prev = curr;
+  if (first_child_py == NULL || leaf_py == NULL) {
+    Py_XDECREF(first_child_py);
+    Py_XDECREF(leaf_py);
+    return NULL;
   }
-  free(*centroid_list_ptr_address);
-  centroid_list_ptr = NULL;
-  *centroid_list_ptr_address = NULL;
+  return Py_BuildValue("{s:N,s:N,s:N}", "centers", convert_centroids_pyobject(tree->centers, tree->num_nodes,
+                       tree->dim), "first_child", first_child_py, "leaf", leaf_py);
+}
+
+
+PyObject* convert_stats_pyobject(const struct KMeansStats *stats) {
+  /*
+  {"iterations": n, "active_clusters": [...], "changed_points": [...], "max_shift": [...]} per iteration,
+  and under "threads" one {"tasks", "steals", "busy_seconds", "idle_seconds"} dict per assignment thread
+   */
+  PyObject *active_py = PyList_New(stats->iterations);
+  PyObject *changed_py = PyList_New(stats->iterations);
+  PyObject *shift_py = PyList_New(stats->iterations);
+  PyObject *threads_py = PyList_New(stats->num_threads);
+  PyObject *thread_py;
+  const struct ThreadStats *thread;
+  int i;
+
+  if (active_py == NULL || changed_py == NULL || shift_py == NULL || threads_py == NULL) {
+    Py_XDECREF(active_py);
+    Py_XDECREF(changed_py);
+    Py_XDECREF(shift_py);
+    Py_XDECREF(threads_py);
+    return NULL;
+  }
+
+  for (i = 0; i < stats->iterations; i++) {
+    PyList_SET_ITEM(active_py, i, PyLong_FromLong(stats->history[i].active_clusters));
+    PyList_SET_ITEM(changed_py, i, PyLong_FromLong(stats->history[i].changed_points));
+    PyList_SET_ITEM(shift_py, i, PyFloat_FromDouble(stats->history[i].max_shift));
+  }
+  for (i = 0; i < stats->num_threads; i++) {
+    thread = stats->threads + i;
+    thread_py = Py_BuildValue("{s:l,s:l,s:d,s:d}", "tasks", thread->tasks, "steals", thread->steals,
+                              "busy_seconds", thread->busy_seconds, "idle_seconds", thread->idle_seconds);
+    if (thread_py == NULL) {
+      Py_DECREF(active_py);
+      Py_DECREF(changed_py);
+      Py_DECREF(shift_py);
+      Py_DECREF(threads_py);
+      return NULL;
+    }
+    PyList_SET_ITEM(threads_py, i, thread_py);
+  }
+
+  return Py_BuildValue("{s:i,s:N,s:N,s:N,s:N}", "iterations", stats->iterations, "active_clusters", active_py,
+                       "changed_points", changed_py, "max_shift", shift_py, "threads", threads_py);
 }
 
-void free_all_memory() {
-  if (lists == NULL) {
+
+static int unpack_random_state(PyObject *state, struct RandomState *random) {
+  /* ('MT19937', keys, pos, ...) as returned by np.random.get_state(), -1 if state is not one */
+  PyObject *keys;
+  PyObject *key;
+  PyObject *pos;
+  int i;
+
+  if (!PySequence_Check(state) || PySequence_Size(state) < 3) {
+    return -1;
+  }
+  keys = PySequence_GetItem(state, 1);
+  pos = PySequence_GetItem(state, 2);
+  if (keys == NULL || pos == NULL || !PySequence_Check(keys) || PySequence_Size(keys) != MT_STATE_SIZE) {
+    Py_XDECREF(keys);
+    Py_XDECREF(pos);
+    return -1;
+  }
+  for (i = 0; i < MT_STATE_SIZE; i++) {
+    key = PySequence_GetItem(keys, i);
+    random->mt[i] = key == NULL ? 0 : PyLong_AsUnsignedLongMask(key) & 0xffffffffUL;
+    Py_XDECREF(key);
+  }
+  random->pos = (int)PyLong_AsLong(pos);
+  Py_DECREF(keys);
+  Py_DECREF(pos);
+  if (PyErr_Occurred() || random->pos < 0 || random->pos > MT_STATE_SIZE) {
+    return -1;
+  }
+  return 0;
+}
+
+PyObject* convert_random_pyobject(const struct RandomState *random) {
+  /* The inverse of unpack_random_state, a tuple np.random.set_state accepts */
+  PyObject *keys = PyList_New(MT_STATE_SIZE);
+  int i;
+
+  if (keys == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < MT_STATE_SIZE; i++) {
+    PyList_SET_ITEM(keys, i, PyLong_FromUnsignedLong(random->mt[i]));
+  }
+  return Py_BuildValue("(sNiid)", "MT19937", keys, random->pos, 0, 0.0);
+}
+
+/* Names of the STORAGE_ values, as fit and estimate_memory report them */
+static const char *storage_names[] = {"dense", "csr", "quantized"};
+
+/* Everything fit needs once its arguments are unpacked, so the run itself can leave the GIL */
+struct FitJob {
+  struct Dataset *data;
+  struct Dataset *unique;
+  int *inverse;
+  /* Shape and storage of the points, still known once they are freed */
+  int num_points;
+  int dim;
+  int storage;
+  double *centroids;
+  int *labels;
+  int K;
+  int return_labels;
+  /* Labels were asked for but do not fit under max_memory, None is returned in their place */
+  int drop_labels;
+  int return_stats;
+  struct KMeansOptions options;
+  struct KMeansStats stats;
+  struct CheckpointPolicy checkpoint;
+  struct RandomState random;
+  /* Owned copy of the checkpoint path, the arguments may be gone before an async run starts */
+  char *checkpoint_path;
+  /* Work left to the run: planning under max_memory, normalizing and collapsing repeated rows */
+  Py_ssize_t max_memory;
+  struct MemoryPlan plan;
+  int spherical;
+  int deduplicate;
+  /* Bytes the smallest layout needs when it is over max_memory, fit raises MemoryError */
+  size_t needed;
+  /* Memory ran out and the run stopped, fit raises MemoryError */
+  int no_memory;
+  /* A checkpoint could not be written and the run stopped, fit raises OSError */
+  int checkpoint_failed;
+  /* Python progress callback, and the exception it raised to stop the run */
+  PyObject *progress;
+  PyObject *error_type;
+  PyObject *error_value;
+  PyObject *error_traceback;
+};
+
+static int fit_progress(void *context, const struct ProgressReport *report) {
+  /*
+  Call the progress callback of a running fit as progress(iteration, max_shift, inertia, reassigned).
+  The GIL is taken for the call alone. Returning False stops the run, so does raising, and the
+  exception is then raised by fit.
+   */
+  struct FitJob *job = context;
+  PyGILState_STATE gil = PyGILState_Ensure();
+  PyObject *result;
+  int keep_going;
+
+  result = PyObject_CallFunction(job->progress, "iddi", report->iteration, report->max_shift, report->inertia,
+                                 report->changed_points);
+  keep_going = result != NULL && result != Py_False;
+  if (result == NULL) {
+    PyErr_Fetch(&job->error_type, &job->error_value, &job->error_traceback);
+  }
+  Py_XDECREF(result);
+  PyGILState_Release(gil);
+  return keep_going;
+}
+
+static void prepare_fit_job(PyObject *args, PyObject *kwargs, struct FitJob *job) {
+  /*
+  Parse the arguments of fit and fit_async into job and copy the points out of their Python
+  objects, the only part of a fit that needs the GIL. Everything else, including the plan
+  under max_memory, is left to run_fit_job. The copy is made in the storage the run will use:
+  quantized only when allow_quantize opts in to the loss of precision and the exact points
+  would not fit the cap.
+   */
+  static char *kwlist[] = {"points", "centroids", "K", "iter", "epsilon", "quantize", "num_threads",
+                           "refresh_interval", "return_stats", "weights", "spherical", "deduplicate",
+                           "return_labels", "numa", "checkpoint", "checkpoint_every", "checkpoint_seconds",
+                           "random_state", "resume", "progress", "progress_every", "progress_seconds",
+                           "max_memory", "allow_quantize", "checkpoint_labels", NULL};
+  PyObject* points;
+  PyObject* initial_centroids;
+  PyObject* weights = Py_None;
+  PyObject* random_state = Py_None;
+  PyObject* progress = Py_None;
+  const char *checkpoint_path = NULL;
+  const char *resume_path = NULL;
+  struct Checkpoint *resumed;
+  struct MemoryEstimate estimate;
+  long num_points;
+  int dim;
+  int num_centroids;
+  int centroid_dim;
+  int quantize = 0;
+  int allow_quantize = 0;
+
+  job->checkpoint.every = 0;
+  job->checkpoint.seconds = 0.0;
+  job->checkpoint.labels = 0;
+  job->checkpoint.random = NULL;
+  job->checkpoint_path = NULL;
+  job->max_memory = 0;
+  job->spherical = 0;
+  job->deduplicate = 0;
+  job->needed = 0;
+  job->no_memory = 0;
+  job->checkpoint_failed = 0;
+  job->progress = NULL;
+  job->error_type = NULL;
+  job->error_value = NULL;
+  job->error_traceback = NULL;
+  job->return_labels = 0;
+  job->drop_labels = 0;
+  job->return_stats = 0;
+  job->inverse = NULL;
+  job->labels = NULL;
+  default_options(&job->options);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOiid|piipOppppzidOzOidnpp", kwlist, &points, &initial_centroids,
+                                   &job->K, &job->options.iter, &job->options.epsilon, &quantize, &job->options.num_threads,
+                                   &job->options.refresh_interval, &job->return_stats, &weights, &job->spherical,
+                                   &job->deduplicate, &job->return_labels, &job->options.numa, &checkpoint_path,
+                                   &job->checkpoint.every, &job->checkpoint.seconds,
+                                   &random_state, &resume_path, &progress, &job->options.progress_every,
+                                   &job->options.progress_seconds, &job->max_memory, &allow_quantize,
+                                   &job->checkpoint.labels)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!PyList_Check(initial_centroids) || (job->spherical && quantize) || job->max_memory < 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Under a memory cap only the storage of the copy is settled here, from the input's shape */
+  if (job->max_memory > 0) {
+    dataset_shape(points, &num_points, &dim, &job->plan);
+    if (quantize && job->plan.storage == STORAGE_DENSE) {
+      job->plan.storage = STORAGE_QUANTIZED;
+    }
+    job->plan.allow_quantize = 0;
+    job->plan.labels = job->return_labels;
+    job->plan.weights = weights != Py_None;
+    job->plan.deduplicate = job->deduplicate;
+    job->plan.numa = job->options.numa;
+    job->plan.checkpoint = checkpoint_path != NULL;
+    job->plan.checkpoint_labels = job->checkpoint.labels;
+    job->plan.max_chunks = 0;
+    if (allow_quantize && !job->spherical && !job->deduplicate && job->plan.storage == STORAGE_DENSE) {
+      estimate_memory(num_points, dim, job->K, &job->plan, &estimate);
+      if (estimate.total > (size_t)job->max_memory) {
+        job->plan.storage = STORAGE_QUANTIZED;
+      }
+    }
+    quantize = job->plan.storage == STORAGE_QUANTIZED;
+  }
+
+  job->data = unpack_dataset(points, quantize);
+  if (weights != Py_None) {
+    job->data->weights = unpack_weights(weights, job->data->num_points);
+  }
+  job->centroids = unpack_matrix(initial_centroids, &num_centroids, &centroid_dim);
+
+  if (num_centroids != job->K || centroid_dim != job->data->dim
+      || (job->deduplicate && job->data->storage != STORAGE_DENSE)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  job->num_points = job->data->num_points;
+  job->dim = job->data->dim;
+  job->storage = job->data->storage;
+
+  if (progress != Py_None) {
+    if (!PyCallable_Check(progress)) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    Py_INCREF(progress);
+    job->progress = progress;
+    job->options.progress = fit_progress;
+    job->options.progress_context = job;
+    if (job->options.progress_every <= 0 && job->options.progress_seconds <= 0.0) {
+      job->options.progress_every = 1;
+    }
+  }
+
+  if (random_state != Py_None) {
+    if (unpack_random_state(random_state, &job->random) == -1) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    job->checkpoint.random = &job->random;
+  }
+
+  /* A resumed run starts from the saved centroids and counts on from the saved iteration */
+  if (resume_path != NULL) {
+    resumed = read_checkpoint(resume_path);
+    if (resumed == NULL || resumed->K != job->K || resumed->dim != job->data->dim) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(job->centroids, resumed->centroids, (size_t)job->K * job->data->dim * sizeof(double));
+    job->options.start_iteration = resumed->iteration;
+    /* The saved random state continues the run, it takes the place of random_state */
+    if (resumed->has_random) {
+      job->random = resumed->random;
+      job->checkpoint.random = &job->random;
+    }
+    free_checkpoint(&resumed);
+  }
+
+  if (checkpoint_path != NULL) {
+    job->checkpoint_path = engine_malloc(strlen(checkpoint_path) + 1);
+    strcpy(job->checkpoint_path, checkpoint_path);
+    job->checkpoint.path = job->checkpoint_path;
+    if (job->checkpoint.every <= 0 && job->checkpoint.seconds <= 0.0) {
+      job->checkpoint.every = CHECKPOINT_EVERY;
+    }
+    job->options.checkpoint = &job->checkpoint;
+  }
+
+  job->unique = job->data;
+  init_stats(&job->stats);
+}
+
+static void run_fit_job(struct FitJob *job) {
+  /*
+  The plan under max_memory, Lloyd's algorithm and the labels of a prepared job. Touches no
+  Python object: failures are left in job->needed, job->no_memory and job->checkpoint_failed
+  for fit_job_result to raise.
+   */
+  struct MemoryEstimate estimate;
+  struct Dataset *unique;
+  int iterations;
+  int i;
+
+  if (job->max_memory > 0) {
+    if (plan_memory(job->num_points, job->dim, job->K, (size_t)job->max_memory, &job->plan, &estimate) == -1) {
+      job->needed = estimate.total;
+      return;
+    }
+    job->drop_labels = job->return_labels && !job->plan.labels;
+    job->options.max_chunks = job->plan.max_chunks;
+  }
+  if (job->spherical) {
+    normalize_dataset(job->data);
+  }
+
+  /* Repeated rows are clustered once, weighted by their number of copies */
+  if (job->deduplicate) {
+    job->inverse = malloc((size_t)job->num_points * sizeof(int));
+    unique = job->inverse != NULL ? collapse_duplicates(job->data, job->inverse) : NULL;
+    if (unique == NULL) {
+      job->no_memory = 1;
+      return;
+    }
+    job->unique = unique;
+  }
+
+  iterations = kmeans(job->unique, job->centroids, job->K, &job->options, &job->stats);
+  job->checkpoint_failed = iterations == KMEANS_CHECKPOINT_FAILED;
+  job->no_memory = iterations == KMEANS_NO_MEMORY;
+  /* A cancelled run's result is thrown away, labelling its points would only delay that */
+  if (iterations < 0 || (job->options.cancel != NULL && *job->options.cancel)) {
     return;
   }
 
-  if (lists->points_list_address != NULL && *(lists->points_list_address) != NULL) {
-    free_pointslist(lists->points_list_address);
+  if (job->return_labels && !job->drop_labels) {
+    /* inverse[i] <= i, so expanding from the last point down never reads an overwritten label */
+    job->labels = malloc((size_t)job->num_points * sizeof(int));
+    if (job->labels == NULL) {
+      job->no_memory = 1;
+      return;
+    }
+    assign_labels(job->unique, job->centroids, job->K, job->labels);
+    for (i = job->data->num_points - 1; i >= 0 && job->inverse != NULL; i--) {
+      job->labels[i] = job->labels[job->inverse[i]];
+    }
   }
-  if (lists->centroids_list_address != NULL ) {
-    free_centroidslist(lists->centroids_list_address);
+}
+
+static PyObject* fit_job_result(const struct FitJob *job) {
+  /*
+  The centroids, or a tuple of the centroids followed by the labels and the stats when
+  return_labels and return_stats ask for them.
+   */
+  PyObject* final_centroids;
+  PyObject* labels_py = NULL;
+  PyObject* stats_py = NULL;
+  PyObject* storage_py;
+
+  if (job->error_type != NULL) {
+    Py_INCREF(job->error_type);
+    Py_XINCREF(job->error_value);
+    Py_XINCREF(job->error_traceback);
+    PyErr_Restore(job->error_type, job->error_value, job->error_traceback);
+    return NULL;
+  }
+  if (job->needed > 0) {
+    PyErr_Format(PyExc_MemoryError, "fit needs at least %zu bytes, max_memory is %zd", job->needed,
+                 job->max_memory);
+    return NULL;
+  }
+  if (job->no_memory) {
+    return PyErr_NoMemory();
+  }
+  if (job->checkpoint_failed) {
+    PyErr_Format(PyExc_OSError, "could not write a checkpoint to %s", job->checkpoint_path);
+    return NULL;
+  }
+  final_centroids = convert_centroids_pyobject(job->centroids, job->K, job->dim);
+  if (job->drop_labels) {
+    labels_py = Py_None;
+    Py_INCREF(labels_py);
+  }
+  else if (job->return_labels) {
+    labels_py = convert_labels_pyobject(job->labels, job->num_points);
   }
-  free(lists);
-  lists = NULL;
+  if (job->return_stats) {
+    /* The storage the points ended up in, quantized when max_memory allowed and needed it */
+    stats_py = convert_stats_pyobject(&job->stats);
+    storage_py = stats_py != NULL ? PyUnicode_FromString(storage_names[job->storage]) : NULL;
+    if (storage_py == NULL || PyDict_SetItemString(stats_py, "storage", storage_py) == -1) {
+      Py_CLEAR(stats_py);
+    }
+    Py_XDECREF(storage_py);
+  }
+
+  if (final_centroids == NULL || (job->return_labels && labels_py == NULL)
+      || (job->return_stats && stats_py == NULL)) {
+    Py_XDECREF(final_centroids);
+    Py_XDECREF(labels_py);
+    Py_XDECREF(stats_py);
+    return NULL;
+  }
+  if (job->return_labels && job->return_stats) {
+    return Py_BuildValue("(NNN)", final_centroids, labels_py, stats_py);
+  }
+  if (job->return_labels || job->return_stats) {
+    return Py_BuildValue("(NN)", final_centroids, job->return_labels ? labels_py : stats_py);
+  }
+  return final_centroids;
 }
 
+static void free_fit_inputs(struct FitJob *job) {
+  /* The points and everything derived from them, which a finished run no longer needs */
+  free(job->inverse);
+  job->inverse = NULL;
+  if (job->unique != job->data) {
+    free_dataset(&job->unique);
+  }
+  job->unique = NULL;
+  free_dataset(&job->data);
+}
 
-/*
-UTILITY FUNCTIONS FOR PRINTING AND DIAGNOSTIC
- */
+static void free_fit_job(struct FitJob *job) {
+  Py_XDECREF(job->progress);
+  Py_XDECREF(job->error_type);
+  Py_XDECREF(job->error_value);
+  Py_XDECREF(job->error_traceback);
+  free(job->checkpoint_path);
+  free(job->centroids);
+  free(job->labels);
+  free_stats(&job->stats);
+  job->checkpoint_path = NULL;
+  job->centroids = NULL;
+  job->labels = NULL;
+  free_fit_inputs(job);
+}
+
+static PyObject* k_means_plus_plus_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in Points, Initial Centroids, K, Iter, Epsilon and keyword options.
+  Returns the centroids, or a tuple of the centroids followed by the labels and the stats when
+  return_labels and return_stats ask for them.
+   */
+  struct FitJob job;
+  PyObject* result;
+
+  prepare_fit_job(args, kwargs, &job);
+  Py_BEGIN_ALLOW_THREADS
+  run_fit_job(&job);
+  Py_END_ALLOW_THREADS
+  result = fit_job_result(&job);
+  free_fit_job(&job);
+  return result;
+}
+
+static PyObject* predict_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in Points, Centroids and returns the index of the closest centroid of every point.
+  Given the tree bisect returned with the centroids, every point descends it to a leaf instead,
+  in O(log K) distances rather than K, which may not be the closest centroid.
+   */
+  static char *kwlist[] = {"points", "centroids", "quantize", "spherical", "tree", "num_threads", NULL};
+  PyObject* points;
+  PyObject* centroids_py;
+  PyObject* labels_py;
+  PyObject* tree_py = Py_None;
+  struct BisectingTree* tree;
+  struct Dataset* data;
+  double* centroids;
+  int* labels;
+  int K;
+  int centroid_dim;
+  int quantize = 0;
+  int spherical = 0;
+  int num_threads = get_num_threads();
+  int i;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ppOi", kwlist, &points, &centroids_py, &quantize, &spherical,
+                                   &tree_py, &num_threads)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!PyList_Check(centroids_py) || (spherical && quantize)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-void print_point(struct Point* ptr) {
-  struct PointCoords* ptr_coords = ptr->head;
+  data = unpack_dataset(points, quantize);
+  centroids = unpack_matrix(centroids_py, &K, &centroid_dim);
 
-  while(ptr_coords != NULL) {
-    if(ptr_coords == ptr->last) {
-      printf("%.4f", ptr_coords->val);
-    } else {
-      printf("%.4f,", ptr_coords->val);
+  if (centroid_dim != data->dim) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (spherical) {
+    normalize_dataset(data);
+    for (i = 0; i < K; i++) {
+      normalize_point(centroids + (size_t)i * data->dim, data->dim);
     }
-    ptr_coords = ptr_coords->next;
   }
-  printf("\n");
+
+  labels = engine_malloc((size_t)data->num_points * sizeof(int));
+  if (tree_py != Py_None) {
+    tree = unpack_tree(tree_py, K, data->dim);
+    tree->spherical = spherical;
+    Py_BEGIN_ALLOW_THREADS
+    tree_assign(tree, data, num_threads, labels);
+    Py_END_ALLOW_THREADS
+    free_bisecting_tree(&tree);
+  }
+  else {
+    assign_labels(data, centroids, K, labels);
+  }
+
+  labels_py = convert_labels_pyobject(labels, data->num_points);
+  if (labels_py == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+
+  free(labels);
+  free(centroids);
+  free_dataset(&data);
+  return labels_py;
 }
 
-void print_points(const struct PointsList* list) {
-  struct Point* ptr = list->head;
+static PyObject* coreset_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in dense Points, a coreset size and a seed and returns (points, weights):
+  a size x dim memoryview of sampled points and their weights, ready for fit(..., weights=weights).
+   */
+  static char *kwlist[] = {"points", "size", "seed", "centers", "num_threads", NULL};
+  PyObject* points;
+  PyObject* points_py;
+  PyObject* weights_py;
+  struct Dataset* data;
+  struct Dataset* coreset;
+  struct RandomState random;
+  unsigned long seed;
+  int size;
+  int num_centers = CORESET_CENTERS;
+  int num_threads = get_num_threads();
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oik|ii", kwlist, &points, &size, &seed, &num_centers,
+                                   &num_threads)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-  while(ptr != NULL) {
-    print_point(ptr);
-    ptr = ptr->next;
+  data = unpack_dataset(points, 0);
+  if (data->storage != STORAGE_DENSE || size <= 0 || num_centers <= 0) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
+  if (num_centers > data->num_points) {
+    num_centers = data->num_points;
+  }
+
+  seed_random(&random, seed);
+  coreset = build_coreset(data, size, num_centers, num_threads, &random);
+  free_dataset(&data);
+
+  points_py = dataset_to_memoryview(coreset);
+  weights_py = convert_weights_pyobject(coreset->weights, coreset->num_points);
+  free_dataset(&coreset);
+  if (points_py == NULL || weights_py == NULL) {
+    Py_XDECREF(points_py);
+    Py_XDECREF(weights_py);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", points_py, weights_py);
 }
 
-void print_centroids(struct CentroidsList* list) {
-  struct Centroid* centroid_pointer = list->head;
-  struct Point* point_pointer = NULL;
+static PyObject* select_k_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in Points and a range of K and returns
+  {"k": [...], "inertias": [...], "elbow": K, "centroids": centroids of the elbow K}
+  The sweep runs without the GIL; MemoryError is raised if any of its fits runs out of memory.
+   */
+  static char *kwlist[] = {"points", "k_min", "k_max", "iter", "epsilon", "seed", "num_threads", "weights",
+                           "quantize", NULL};
+  PyObject* points;
+  PyObject* weights = Py_None;
+  PyObject* k_py;
+  PyObject* inertias_py;
+  PyObject* centroids_py;
+  struct Dataset* data;
+  struct KMeansOptions options;
+  struct RandomState random;
+  unsigned long seed = 0;
+  double* inertias;
+  double* centroids;
+  int k_min;
+  int k_max;
+  int quantize = 0;
+  int elbow;
+  int K;
+
+  default_options(&options);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii|idkiOp", kwlist, &points, &k_min, &k_max, &options.iter,
+                                   &options.epsilon, &seed, &options.num_threads, &weights, &quantize)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-  while(centroid_pointer != NULL) {
-    point_pointer = centroid_pointer->centroid;
-    print_point(point_pointer);
-    centroid_pointer = centroid_pointer->next;
+  data = unpack_dataset(points, quantize);
+  if (k_min < 1 || k_max < k_min || k_max > data->num_points) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (weights != Py_None) {
+    data->weights = unpack_weights(weights, data->num_points);
   }
-  
+
+  inertias = engine_malloc((size_t)(k_max - k_min + 1) * sizeof(double));
+  centroids = engine_malloc((size_t)k_max * data->dim * sizeof(double));
+  seed_random(&random, seed);
+  Py_BEGIN_ALLOW_THREADS
+  elbow = select_k(data, k_min, k_max, &options, &random, inertias, centroids);
+  Py_END_ALLOW_THREADS
+
+  /* No checkpoint is saved here, so running out of memory is the only way a fit fails */
+  if (elbow < 0) {
+    free(inertias);
+    free(centroids);
+    free_dataset(&data);
+    return PyErr_NoMemory();
+  }
+
+  k_py = PyList_New(k_max - k_min + 1);
+  if (k_py == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  for (K = k_min; K <= k_max; K++) {
+    PyList_SET_ITEM(k_py, K - k_min, PyLong_FromLong(K));
+  }
+  inertias_py = convert_weights_pyobject(inertias, k_max - k_min + 1);
+  centroids_py = convert_centroids_pyobject(centroids, elbow, data->dim);
+
+  free(inertias);
+  free(centroids);
+  free_dataset(&data);
+  if (inertias_py == NULL) {
+    Py_DECREF(k_py);
+    Py_DECREF(centroids_py);
+    return NULL;
+  }
+  return Py_BuildValue("{s:N,s:N,s:i,s:N}", "k", k_py, "inertias", inertias_py, "elbow", elbow,
+                       "centroids", centroids_py);
 }
 
+static PyObject* bisect_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in Points and K and returns {"centroids": [...], "tree": {...}} from bisecting
+  k-means, plus "labels" with return_labels. The tree is what predict(..., tree=tree) descends.
+  The computation runs without the GIL.
+   */
+  static char *kwlist[] = {"points", "K", "iter", "epsilon", "seed", "num_threads", "weights", "quantize",
+                           "spherical", "return_labels", NULL};
+  PyObject* points;
+  PyObject* weights = Py_None;
+  PyObject* result;
+  PyObject* labels_py;
+  struct Dataset* data;
+  struct BisectingTree* tree;
+  struct KMeansOptions options;
+  struct RandomState random;
+  unsigned long seed = 0;
+  double* centroids;
+  int* labels = NULL;
+  int K;
+  int quantize = 0;
+  int spherical = 0;
+  int return_labels = 0;
+
+  default_options(&options);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|idkiOppp", kwlist, &points, &K, &options.iter,
+                                   &options.epsilon, &seed, &options.num_threads, &weights, &quantize, &spherical,
+                                   &return_labels)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-/*
-  COORDINATE AND POINT FUNCTIONS
-*/
+  data = unpack_dataset(points, quantize);
+  if (K < 1 || K > data->num_points || options.num_threads < 1 || (spherical && quantize)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (spherical) {
+    normalize_dataset(data);
+  }
+  if (weights != Py_None) {
+    data->weights = unpack_weights(weights, data->num_points);
+  }
 
+  centroids = engine_malloc((size_t)K * data->dim * sizeof(double));
+  if (return_labels) {
+    labels = engine_malloc((size_t)data->num_points * sizeof(int));
+  }
+  seed_random(&random, seed);
+  Py_BEGIN_ALLOW_THREADS
+  tree = bisecting_kmeans(data, K, &options, &random, centroids, labels);
+  Py_END_ALLOW_THREADS
+
+  if (tree == NULL) {
+    PyErr_Format(PyExc_ValueError, "the points cannot be split into %d clusters", K);
+    result = NULL;
+  }
+  else {
+    result = Py_BuildValue("{s:N,s:N}", "centroids", convert_centroids_pyobject(centroids, K, data->dim),
+                           "tree", convert_tree_pyobject(tree));
+    labels_py = return_labels && result != NULL ? convert_labels_pyobject(labels, data->num_points) : NULL;
+    if (labels_py != NULL) {
+      PyDict_SetItemString(result, "labels", labels_py);
+      Py_DECREF(labels_py);
+    }
+  }
 
-void add_coord(struct Point* point, double val) {
-  struct PointCoords* ptr = malloc(sizeof(struct PointCoords));
+  free_bisecting_tree(&tree);
+  free(centroids);
+  free(labels);
+  free_dataset(&data);
+  return result;
+}
 
-  if (ptr == NULL) {
-    free_all_memory();
+static PyObject* serve_shard_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in a coordinator address, this worker's shard index, the number of shards and
+  optionally the shard's Points, and answers the coordinator's Lloyd steps until it ends the run.
+  Without points the shard is sent by a coordinator that was given them. Returns the number of
+  steps served. The computation runs without the GIL.
+   */
+  static char *kwlist[] = {"address", "shard", "num_shards", "points", "weights", "num_threads", "quantize", NULL};
+  const char* address;
+  PyObject* points = Py_None;
+  PyObject* weights = Py_None;
+  struct Dataset* data = NULL;
+  int shard;
+  int num_shards;
+  int num_threads = get_num_threads();
+  int quantize = 0;
+  int served;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sii|OOip", kwlist, &address, &shard, &num_shards, &points,
+                                   &weights, &num_threads, &quantize)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (shard < 0 || shard >= num_shards || num_threads < 1 || (points == Py_None && weights != Py_None)) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
   }
 
-  ptr->val = val;
-  ptr->next = NULL;
-
-  if (point->head == NULL) {
-    point->head = ptr;
-    point->last = ptr;
+  if (points != Py_None) {
+    data = unpack_dataset(points, quantize);
   }
-  else {
-    point->last->next = ptr;
-    point->last = ptr;
+  if (weights != Py_None) {
+    data->weights = unpack_weights(weights, data->num_points);
   }
+  Py_BEGIN_ALLOW_THREADS
+  served = serve_shard(address, shard, num_shards, data, num_threads);
+  Py_END_ALLOW_THREADS
+  free_dataset(&data);
+
+  if (served == -1) {
+    PyErr_Format(PyExc_ConnectionError, "shard %d lost its coordinator at %s", shard, address);
+    return NULL;
+  }
+  return PyLong_FromLong(served);
 }
 
-void add_point(struct PointsList* list) {
-  struct Point* ptr = (struct Point*)malloc(sizeof(struct Point));
+static PyObject* coordinate_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in an address, the number of workers and initial Centroids, waits for the workers
+  started with serve_shard and returns the centroids of Lloyd's algorithm over their shards.
+  Given Points, with their weights, each worker started without points is sent its contiguous
+  shard of them, after deduplicate collapses repeated rows; the points are dropped once every
+  worker has its shard. max_memory and resume act as in fit. The computation runs without the GIL.
+   */
+  static char *kwlist[] = {"address", "num_workers", "centroids", "iter", "epsilon", "points", "weights",
+                           "deduplicate", "resume", "max_memory", NULL};
+  const char* address;
+  const char* resume_path = NULL;
+  PyObject* centroids_py;
+  PyObject* points = Py_None;
+  PyObject* weights = Py_None;
+  PyObject* result;
+  struct KMeansOptions options;
+  struct Checkpoint *resumed;
+  struct MemoryPlan plan;
+  struct MemoryEstimate estimate;
+  struct Dataset* data = NULL;
+  struct Dataset* unique;
+  Py_ssize_t max_memory = 0;
+  long num_points;
+  double* centroids;
+  int* inverse;
+  int deduplicate = 0;
+  int num_workers;
+  int iterations;
+  int K;
+  int dim;
+  int points_dim;
 
-  if (ptr == NULL) {
-    free_all_memory();
+  default_options(&options);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "siO|idOOpzn", kwlist, &address, &num_workers, &centroids_py,
+                                   &options.iter, &options.epsilon, &points, &weights, &deduplicate, &resume_path,
+                                   &max_memory)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (num_workers < 1 || !PyList_Check(centroids_py) || max_memory < 0
+      || (points == Py_None && (weights != Py_None || deduplicate || max_memory > 0))) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
   }
 
-  ptr->head = NULL;
-  ptr->last = NULL;
-  ptr->next = NULL;
+  /* The points are held here until the workers have them, so the cap is checked against all of them */
+  centroids = unpack_matrix(centroids_py, &K, &dim);
+  if (max_memory > 0) {
+    dataset_shape(points, &num_points, &points_dim, &plan);
+    plan.allow_quantize = 0;
+    plan.labels = 0;
+    plan.weights = weights != Py_None;
+    plan.deduplicate = deduplicate;
+    plan.numa = 0;
+    plan.checkpoint = 0;
+    plan.checkpoint_labels = 0;
+    if (plan_memory(num_points, points_dim, K, (size_t)max_memory, &plan, &estimate) == -1) {
+      PyErr_Format(PyExc_MemoryError, "coordinate needs at least %zu bytes, max_memory is %zd", estimate.total,
+                   max_memory);
+      free(centroids);
+      return NULL;
+    }
+  }
 
-  if (list->head == NULL) {
-    list->head = ptr;
-    list->last = ptr;
+  if (points != Py_None) {
+    data = unpack_dataset(points, 0);
+    if (weights != Py_None) {
+      data->weights = unpack_weights(weights, data->num_points);
+    }
+    if (data->storage != STORAGE_DENSE || data->dim != dim) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
   }
-  else {
-    list->last->next = ptr;
-    list->last = ptr;
+  if (deduplicate) {
+    inverse = engine_malloc((size_t)data->num_points * sizeof(int));
+    unique = collapse_duplicates(data, inverse);
+    free(inverse);
+    if (unique == NULL) {
+      free_dataset(&data);
+      free(centroids);
+      return PyErr_NoMemory();
+    }
+    free_dataset(&data);
+    data = unique;
   }
-}
 
-void add_centroid(struct CentroidsList* list, struct Point* point) {
-  struct Centroid* centroid = (struct Centroid*)malloc(sizeof(struct Centroid));
-
-  if (centroid == NULL) {
-    free_all_memory();
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+  if (resume_path != NULL) {
+    resumed = read_checkpoint(resume_path);
+    if (resumed == NULL || resumed->K != K || resumed->dim != dim) {
+      printf("An Error has Occurred\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(centroids, resumed->centroids, (size_t)K * dim * sizeof(double));
+    options.start_iteration = resumed->iteration;
+    free_checkpoint(&resumed);
   }
 
-  centroid->centroid = point;
-  centroid->centroid_next_pos = NULL;
-  centroid->num_points = 0;
-  centroid->next = NULL;
+  Py_BEGIN_ALLOW_THREADS
+  iterations = coordinate_shards(address, num_workers, &data, centroids, K, dim, &options);
+  Py_END_ALLOW_THREADS
 
-  if (list->head == NULL) {
-    list->head = centroid;
+  if (iterations == -1) {
+    PyErr_Format(PyExc_ConnectionError, "sharded fit at %s failed", address);
+    result = NULL;
   }
   else {
-    centroid->next = list->head;
-    list->head = centroid;
+    result = convert_centroids_pyobject(centroids, K, dim);
   }
+  free(centroids);
+  return result;
 }
 
-struct Point* deep_copy_point(struct Point* point) {
-  struct Point* deep_copy = malloc(sizeof(struct Point));
-  struct PointCoords* cur_coordinate;
+static PyObject* silhouette_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in Points and their Labels and returns {"score": s, "half_width": h, "sample_size": n}.
+  Above sample_size points the score is estimated from a sample, with s +- h a 95% confidence interval.
+  The computation runs without the GIL.
+   */
+  static char *kwlist[] = {"points", "labels", "sample_size", "seed", "num_threads", "weights", "quantize", NULL};
+  PyObject* points;
+  PyObject* labels_py;
+  PyObject* weights = Py_None;
+  struct Dataset* data;
+  struct RandomState random;
+  unsigned long seed = 0;
+  double score;
+  double half_width;
+  int* labels;
+  int sample_size = SILHOUETTE_SAMPLE;
+  int num_threads = get_num_threads();
+  int quantize = 0;
+  int K;
 
-  if (deep_copy == NULL) {
-    free_all_memory();
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ikiOp", kwlist, &points, &labels_py, &sample_size, &seed,
+                                   &num_threads, &weights, &quantize)) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
   }
 
-  deep_copy->head = NULL;
-  deep_copy->last = NULL;
-  deep_copy->next = NULL;
-  cur_coordinate = point->head;
-
-  while(cur_coordinate != NULL) {
-    add_coord(deep_copy, cur_coordinate->val);
-    cur_coordinate = cur_coordinate->next;
+  data = unpack_dataset(points, quantize);
+  labels = unpack_labels(labels_py, data->num_points, &K);
+  if (weights != Py_None) {
+    data->weights = unpack_weights(weights, data->num_points);
   }
-  
-  return deep_copy;
-}
+  seed_random(&random, seed);
 
-void point_addition(struct Point* point, struct Point* other) {
-  /*
-  Set point coordinates to be the sum of point and other's coordinates.
-  Precondition: point is the centroid next-in-line
-   */
-  struct PointCoords* point_coord = point->head;
-  struct PointCoords* other_coord = other->head;
+  Py_BEGIN_ALLOW_THREADS
+  score = silhouette_score(data, labels, K, sample_size, num_threads, &random, &half_width);
+  Py_END_ALLOW_THREADS
 
-  while (point_coord != NULL && other_coord != NULL) {
-    point_coord->val = point_coord->val + other_coord->val;
-    point_coord = point_coord->next;
-    other_coord = other_coord->next;
+  if (sample_size <= 0 || sample_size > data->num_points) {
+    sample_size = data->num_points;
   }
+  free(labels);
+  free_dataset(&data);
+  return Py_BuildValue("{s:d,s:d,s:i}", "score", score, "half_width", half_width, "sample_size", sample_size);
 }
 
-void point_division(struct Point* point, int divisor) {
+static PyObject* read_files_c_wrapper(PyObject *self, PyObject *args) {
   /*
-  Set point coordinates to be the division of point's coordinates by divisior.
-  Precondition: point is the centroid next-in-line
+  Wrapper takes in two file paths and returns their key-joined points as a 2D memoryview.
+  Given a third path of key,weight rows it returns (points, weights) instead.
    */
-  struct PointCoords* point_coord = point->head;
+  const char *path1;
+  const char *path2;
+  const char *weights_path = NULL;
+  PyObject *points_py;
+  PyObject *weights_py;
+  struct Dataset *data;
+  double *keys;
+
+  if (!PyArg_ParseTuple(args, "ss|z", &path1, &path2, &weights_path)) {
+    return NULL;
+  }
 
-  while(point_coord != NULL) {
-    point_coord->val = point_coord->val / divisor;
-    point_coord = point_coord->next;
+  data = read_joined_files(path1, path2, &keys);
+  if (data == NULL) {
+    PyErr_Format(PyExc_OSError, "could not read %s and %s", path1, path2);
+    return NULL;
+  }
+  if (weights_path != NULL) {
+    data->weights = read_weights_file(weights_path, keys, data->num_points);
+  }
+  free(keys);
+  if (weights_path != NULL && data->weights == NULL) {
+    free_dataset(&data);
+    PyErr_Format(PyExc_OSError, "could not read a weight for every point from %s", weights_path);
+    return NULL;
   }
-}
 
-double euclidean_distance(struct Point* point, struct Point* other) {
-  double total = 0.0;
-  struct PointCoords* point_coord = point->head;
-  struct PointCoords* other_coord = other->head;
+  points_py = dataset_to_memoryview(data);
+  if (points_py == NULL || weights_path == NULL) {
+    free_dataset(&data);
+    return points_py;
+  }
 
-  while(point_coord != NULL) {
-    total += pow(point_coord->val - other_coord->val, 2);
-    point_coord = point_coord->next;
-    other_coord = other_coord->next;
+  weights_py = convert_weights_pyobject(data->weights, data->num_points);
+  free_dataset(&data);
+  if (weights_py == NULL) {
+    Py_DECREF(points_py);
+    return NULL;
   }
-  return sqrt(total);
+  return Py_BuildValue("(NN)", points_py, weights_py);
 }
 
+
 /*
-CENTROID FUNCTIONS
-*/
-
-struct CentroidsList* initialize_centroids(const struct PointsList* points_list, const int num_centroids) {
-  struct Point* traversal_pointer = points_list->head;
-  struct Point* curr_point;
-  struct CentroidsList* centroid_list_ptr = malloc(sizeof(struct CentroidsList));
-  struct Centroid* prev_centroid = malloc(sizeof(struct Centroid));
-  struct Centroid* curr_centroid_ptr;
-  int i;
+ONLINE MODEL TYPE
+ */
 
-  if (centroid_list_ptr == NULL || prev_centroid == NULL) {
-    free_all_memory();
+typedef struct {
+  PyObject_HEAD
+  struct OnlineModel *model;
+} OnlineKMeansObject;
+
+static int online_kmeans_init(OnlineKMeansObject *self, PyObject *args, PyObject *kwargs) {
+  /* OnlineKMeans(centroids, mini_batch=False, decay=1.0) */
+  static char *kwlist[] = {"centroids", "mini_batch", "decay", NULL};
+  PyObject* centroids_py;
+  double* centroids;
+  double decay = 1.0;
+  int mini_batch = 0;
+  int K;
+  int dim;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pd", kwlist, &centroids_py, &mini_batch, &decay)) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
   }
 
-  curr_point = deep_copy_point(traversal_pointer);
-  prev_centroid->centroid = curr_point;
-  prev_centroid->centroid_next_pos = NULL;
-  prev_centroid->num_points = 0;
-
-  centroid_list_ptr->head = prev_centroid;
-  
-  traversal_pointer = traversal_pointer->next;
-
-  for (i = 1; i < num_centroids; i++) {
-    curr_centroid_ptr = malloc(sizeof(struct Centroid));
-
-    if (curr_centroid_ptr == NULL) {
-      free_all_memory();
-      printf("An Error has Occurred\n");
-      exit(EXIT_FAILURE);
-    }
-
-    curr_point = deep_copy_point(traversal_pointer);
-    prev_centroid->next = curr_centroid_ptr;
-    prev_centroid->centroid_next_pos = NULL;
-    curr_centroid_ptr->centroid = curr_point;
-    curr_centroid_ptr->num_points = 0;
-    prev_centroid = curr_centroid_ptr;
-    traversal_pointer = traversal_pointer->next;
+  if (!PyList_Check(centroids_py) || !(decay > 0.0 && decay <= 1.0)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
 
-  prev_centroid->centroid_next_pos = NULL;
-  prev_centroid->next = NULL;
-  return centroid_list_ptr;
+  centroids = unpack_matrix(centroids_py, &K, &dim);
+  free_online_model(&self->model);
+  self->model = create_online_model(centroids, K, dim, mini_batch, decay);
+  free(centroids);
+  return 0;
 }
 
-void update_centroid(struct Centroid* centroid, struct Point* point) {
-  if (centroid->centroid_next_pos == NULL) {
-    centroid->centroid_next_pos = deep_copy_point(point);
-  }
-  else {
-    point_addition(centroid->centroid_next_pos, point);
-  }
-  centroid->num_points++;
+static void online_kmeans_dealloc(OnlineKMeansObject *self) {
+  free_online_model(&self->model);
+  Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
+static PyObject* online_kmeans_partial_fit(OnlineKMeansObject *self, PyObject *args, PyObject *kwargs) {
+  /* Folds a batch of points (any layout fit accepts) into the centroids and returns the model */
+  static char *kwlist[] = {"batch", "weights", "quantize", NULL};
+  PyObject* batch_py;
+  PyObject* weights = Py_None;
+  struct Dataset* batch;
+  int quantize = 0;
 
-double finalize_next_centroid_pos(struct Centroid **centroid_ptr_address) {
-  struct Point* prev_centroid_pos;
-  struct Point* prev_centroid;
-  struct Centroid *centroid_ptr;
-  double distance;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Op", kwlist, &batch_py, &weights, &quantize)) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
 
-  if (centroid_ptr_address == NULL) {
-    return 0.0;
+  if (self->model == NULL) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
   }
 
-  if ((*centroid_ptr_address)->num_points == 0) {
-    return 0.0;
+  batch = unpack_dataset(batch_py, quantize);
+  if (batch->dim != self->model->dim) {
+    printf("An Error has Occurred\n");
+    exit(EXIT_FAILURE);
+  }
+  if (weights != Py_None) {
+    batch->weights = unpack_weights(weights, batch->num_points);
   }
 
-  centroid_ptr = *centroid_ptr_address;
-  prev_centroid_pos = deep_copy_point(centroid_ptr->centroid_next_pos);
-  point_division(centroid_ptr->centroid_next_pos, centroid_ptr->num_points);
+  online_update(self->model, batch);
+  free_dataset(&batch);
+
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
 
-  prev_centroid = centroid_ptr->centroid;
-  
-  centroid_ptr->centroid = centroid_ptr->centroid_next_pos;  
-  centroid_ptr->centroid_next_pos = NULL;
-  centroid_ptr->num_points = 0;
+static PyObject* online_kmeans_get_centroids(OnlineKMeansObject *self, void *closure) {
+  (void)closure;
+  return convert_centroids_pyobject(self->model->centroids, self->model->K, self->model->dim);
+}
 
-  distance = euclidean_distance(centroid_ptr->centroid, prev_centroid);
+static PyObject* online_kmeans_get_counts(OnlineKMeansObject *self, void *closure) {
+  (void)closure;
+  return convert_weights_pyobject(self->model->counts, self->model->K);
+}
 
-  free_point(&prev_centroid_pos);
-  free_point(&prev_centroid);
-  return distance;
+static PyObject* online_kmeans_get_num_batches(OnlineKMeansObject *self, void *closure) {
+  (void)closure;
+  return PyLong_FromLong(self->model->num_batches);
 }
 
-/*
-CENTROID MANAGEMENT FUNCTIONS
-*/
+static PyMethodDef OnlineKMeansMethods[] = {
+  {
+    "partial_fit",
+    (PyCFunction)(void(*)(void)) online_kmeans_partial_fit,
+    METH_VARARGS | METH_KEYWORDS,
+    "Update the centroids with one batch of points"
+  },
+  {NULL, NULL, 0, NULL}
+};
 
-struct Centroid* closest_centroid(struct CentroidsList* centroids_list_ptr, struct Point* point_ptr) {
-  struct Centroid* curr_centroid_ptr = centroids_list_ptr->head;
-  double closest_dist = euclidean_distance(point_ptr, curr_centroid_ptr->centroid);
-  struct Centroid* closest_centroid = NULL;
+static PyGetSetDef OnlineKMeansGetters[] = {
+  {"centroids", (getter) online_kmeans_get_centroids, NULL, "Current centroids", NULL},
+  {"counts", (getter) online_kmeans_get_counts, NULL, "Decayed weight absorbed by every centroid", NULL},
+  {"num_batches", (getter) online_kmeans_get_num_batches, NULL, "Batches seen so far", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
 
-  while(curr_centroid_ptr != NULL) {
-    double dist = euclidean_distance(point_ptr, curr_centroid_ptr->centroid);
-    if (dist <= closest_dist) {
-      closest_dist = dist;
-      closest_centroid = curr_centroid_ptr;
-    }
-    curr_centroid_ptr = curr_centroid_ptr->next;
-  }
+static PyTypeObject OnlineKMeansType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "mykmeanssp.OnlineKMeans",
+};
 
-   return closest_centroid;
+static void init_online_kmeans_type(void) {
+  OnlineKMeansType.tp_basicsize = sizeof(OnlineKMeansObject);
+  OnlineKMeansType.tp_flags = Py_TPFLAGS_DEFAULT;
+  OnlineKMeansType.tp_doc = "Streaming k-means: OnlineKMeans(centroids, mini_batch=False, decay=1.0).partial_fit(batch)";
+  OnlineKMeansType.tp_new = PyType_GenericNew;
+  OnlineKMeansType.tp_init = (initproc) online_kmeans_init;
+  OnlineKMeansType.tp_dealloc = (destructor) online_kmeans_dealloc;
+  OnlineKMeansType.tp_methods = OnlineKMeansMethods;
+  OnlineKMeansType.tp_getset = OnlineKMeansGetters;
 }
 
 
-
 /*
-PARSE INPUT
+ASYNCHRONOUS FIT
  */
-struct PointsList *parse() {
-  struct PointsList* points_list_ptr = malloc(sizeof(struct PointsList));
-  char line[1024];
-  char* ptr;
-  double value = 0;
+typedef struct {
+  PyObject_HEAD
+  struct FitJob job;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int done;
+  volatile int cancel;
+  int cancelled;
+  /* asyncio futures of the coroutines awaiting the fit, only touched with the GIL held */
+  PyObject *waiters;
+  PyObject *result;
+} FitFutureObject;
+
+static PyTypeObject FitFutureType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "mykmeanssp.FitFuture",
+};
 
-  if (points_list_ptr == NULL) {
-    free_all_memory();
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
-  }
+static PyObject* cancelled_error(void) {
+  /* concurrent.futures.CancelledError, what Future.result raises after a cancel */
+  PyObject *futures = PyImport_ImportModule("concurrent.futures");
+  PyObject *error;
 
-  points_list_ptr->head = NULL;
-  points_list_ptr->last = NULL;
+  if (futures == NULL) {
+    return NULL;
+  }
+  error = PyObject_GetAttrString(futures, "CancelledError");
+  Py_DECREF(futures);
+  return error;
+}
 
-  while (fgets(line, sizeof(line), stdin)) {
-    add_point(points_list_ptr);
+static PyObject* fit_future_outcome(FitFutureObject *self) {
+  /* Result of a finished fit, built once; raises CancelledError if it was cancelled */
+  PyObject *error;
 
-    ptr = line;
-    while (sscanf(ptr, "%lf", &value) == 1) {
-        add_coord(points_list_ptr->last, value);
-        while (*ptr != ',' && *ptr != '\n' && *ptr != '\0') {
-          ptr++;
-        }
-        if (*ptr == ',' || *ptr == '\n') {
-          ptr++;
-        }
+  if (self->cancelled) {
+    error = cancelled_error();
+    if (error != NULL) {
+      PyErr_SetNone(error);
+      Py_DECREF(error);
     }
+    return NULL;
   }
-  return points_list_ptr;
+  if (self->result == NULL) {
+    self->result = fit_job_result(&self->job);
+  }
+  Py_XINCREF(self->result);
+  return self->result;
 }
 
-
-
-
-
-
-
-struct PointsList* unpack_points_list(PyObject *points_list_py_ptr) {
-  /* Assumes valid Python List Object is passed to function, meaning error checks for type should be external */
-  Py_ssize_t num_points;
-  Py_ssize_t num_coords;
+static void *fit_future_thread(void *arg) {
+  /* Runs the fit without the GIL, then wakes the result() callers and the awaiting event loops */
+  FitFutureObject *self = arg;
+  PyGILState_STATE gil;
+  PyObject *resolve;
+  PyObject *waiter;
+  PyObject *loop;
+  PyObject *scheduled;
   Py_ssize_t i;
-  Py_ssize_t j;
-  PyObject *py_point;
-  PyObject *py_coord;
-  double coord;
-  struct PointsList* points_list_ptr = malloc(sizeof(struct PointsList));
 
-  if (points_list_ptr == NULL) {
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+  run_fit_job(&self->job);
+  /* result() only needs the centroids, labels and stats, the future may be kept long after */
+  free_fit_inputs(&self->job);
+
+  pthread_mutex_lock(&self->lock);
+  self->done = 1;
+  self->cancelled = self->cancel;
+  if (self->cancelled) {
+    free(self->job.centroids);
+    free(self->job.labels);
+    free_stats(&self->job.stats);
+    self->job.centroids = NULL;
+    self->job.labels = NULL;
   }
-
-  points_list_ptr->head = NULL;
-  points_list_ptr->last = NULL;
-
-  num_points = PyList_Size(points_list_py_ptr);
-
-
-  for (i = 0; i < num_points; i++) {
-    add_point(points_list_ptr);
-    py_point = PyList_GetItem(points_list_py_ptr, i);
-    if (!PyList_Check(py_point)) {
-      printf("An Error has Occurred\n");
-      exit(EXIT_FAILURE);
-    }
-    num_coords = PyList_Size(py_point);
-    for (j = 0; j < num_coords; j++) {
-      py_coord = PyList_GetItem(py_point, j);
-      if (Py_IS_TYPE(py_coord, &PyFloat_Type) == 0) {
-        printf("An Error has Occurred\n");
-        exit(EXIT_FAILURE);
-      }
-      coord = PyFloat_AsDouble(py_coord);
-      add_coord(points_list_ptr->last, coord);
+  pthread_cond_broadcast(&self->finished);
+  pthread_mutex_unlock(&self->lock);
+
+  gil = PyGILState_Ensure();
+  resolve = PyObject_GetAttrString((PyObject *)self, "_resolve");
+  for (i = 0; resolve != NULL && i < PyList_GET_SIZE(self->waiters); i++) {
+    waiter = PyList_GET_ITEM(self->waiters, i);
+    loop = PyObject_CallMethod(waiter, "get_loop", NULL);
+    scheduled = loop == NULL ? NULL : PyObject_CallMethod(loop, "call_soon_threadsafe", "OO", resolve, waiter);
+    if (scheduled == NULL) {
+      /* The loop may be closed already, nobody is left to tell */
+      PyErr_Clear();
     }
+    Py_XDECREF(scheduled);
+    Py_XDECREF(loop);
   }
-  return points_list_ptr;
+  PyErr_Clear();
+  Py_XDECREF(resolve);
+  Py_CLEAR(self->waiters);
+  /* The thread held a reference so the job outlives a future nobody keeps */
+  Py_DECREF(self);
+  PyGILState_Release(gil);
+  return NULL;
 }
 
-struct CentroidsList* unpack_centroids_list(PyObject *centroids_list_py_ptr) {
-  /* Assumes valid Python List Object is passed to function, meaning error checks for type should be external */
-  Py_ssize_t num_centroids;
-  Py_ssize_t i;
-  struct Point *traversal_ptr;
-  struct CentroidsList *centroids_list_ptr = malloc(sizeof(struct CentroidsList));
-  struct PointsList *temp_list_ptr = malloc(sizeof(struct PointsList));
+static PyObject* fit_async_c_wrapper(PyObject *module, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes the arguments of fit and returns a FitFuture at once, while Lloyd's algorithm
+  runs on a native background thread. The future can be awaited, polled with done() or waited
+  on with result(timeout), and cancel() stops the run before its next iteration.
+   */
+  FitFutureObject *self;
+  pthread_t thread;
+  pthread_attr_t attr;
 
-  if (centroids_list_ptr == NULL) {
+  self = PyObject_New(FitFutureObject, &FitFutureType);
+  if (self == NULL) {
+    return NULL;
+  }
+  prepare_fit_job(args, kwargs, &self->job);
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->finished, NULL);
+  self->done = 0;
+  self->cancel = 0;
+  self->cancelled = 0;
+  self->result = NULL;
+  self->waiters = PyList_New(0);
+  self->job.options.cancel = &self->cancel;
+  if (self->waiters == NULL) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
   }
 
-  if (temp_list_ptr == NULL) {
+  Py_INCREF(self);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, fit_future_thread, self) != 0) {
     printf("An Error has Occurred\n");
     exit(EXIT_FAILURE);
-  } 
-  
-  centroids_list_ptr->head = NULL;
-  temp_list_ptr = unpack_points_list(centroids_list_py_ptr);
-  traversal_ptr = temp_list_ptr->head;
-  num_centroids = PyList_Size(centroids_list_py_ptr);
-  
-  for(i = 0; i < num_centroids; i++) {
-    add_centroid(centroids_list_ptr, traversal_ptr);
-    traversal_ptr = traversal_ptr->next;
   }
+  pthread_attr_destroy(&attr);
+  return (PyObject *)self;
+}
 
-  return centroids_list_ptr;
+static PyObject* fit_future_done(FitFutureObject *self, PyObject *Py_UNUSED(ignored)) {
+  int done;
+
+  pthread_mutex_lock(&self->lock);
+  done = self->done;
+  pthread_mutex_unlock(&self->lock);
+  return PyBool_FromLong(done);
 }
 
+static PyObject* fit_future_cancelled(FitFutureObject *self, PyObject *Py_UNUSED(ignored)) {
+  int cancelled;
 
-PyObject* convert_centroids_pyobject(struct CentroidsList* centroid_list_ptr, int K) {
-  int i;
-  int appended;
-  struct Centroid* curr_centroid_ptr = centroid_list_ptr->head;
-  struct PointCoords* curr_coord_ptr;
-  PyObject* centroids_list_py_ptr = PyList_New(0);
-  PyObject* temp_list_py;
-  PyObject* temp_coord_py;
-  
-  if (centroids_list_py_ptr == NULL) {
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+  pthread_mutex_lock(&self->lock);
+  cancelled = self->done && self->cancelled;
+  pthread_mutex_unlock(&self->lock);
+  return PyBool_FromLong(cancelled);
+}
+
+static PyObject* fit_future_cancel(FitFutureObject *self, PyObject *Py_UNUSED(ignored)) {
+  /* Ask the run to stop; False if it had already finished */
+  int running;
+
+  pthread_mutex_lock(&self->lock);
+  running = !self->done;
+  if (running) {
+    self->cancel = 1;
   }
-  
-  for (i = 0; i < K; i++) {
-    temp_list_py = PyList_New(0);
-    
-    if (temp_list_py == NULL) {
-      printf("An Error has Occurred\n");
-      exit(EXIT_FAILURE);
-    }
-    
-    curr_coord_ptr = curr_centroid_ptr->centroid->head;
-    while(curr_coord_ptr != NULL) {
-      temp_coord_py = PyFloat_FromDouble(curr_coord_ptr->val);
-      if (temp_coord_py == NULL) {
-        printf("An Error has Occurred\n");
-        exit(EXIT_FAILURE);
-      }
-      appended = PyList_Append(temp_list_py, temp_coord_py);
-      
-      if (appended == -1) {
-        printf("An Error has Occurred\n");
-        exit(EXIT_FAILURE);
-      }
-      
-      curr_coord_ptr = curr_coord_ptr->next;
-    }
+  pthread_mutex_unlock(&self->lock);
+  return PyBool_FromLong(running);
+}
 
-    curr_centroid_ptr = curr_centroid_ptr->next;
-    appended = PyList_Append(centroids_list_py_ptr, temp_list_py);
+static PyObject* fit_future_result(FitFutureObject *self, PyObject *args, PyObject *kwargs) {
+  /* result(timeout=None): wait for the fit without holding the GIL, TimeoutError after timeout seconds */
+  static char *kwlist[] = {"timeout", NULL};
+  PyObject *timeout_py = Py_None;
+  double timeout = -1.0;
+  struct timespec deadline;
+  int done;
 
-    if (appended == -1) {
-      printf("An Error has Occurred\n");
-      exit(EXIT_FAILURE);
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout_py)) {
+    return NULL;
+  }
+  if (timeout_py != Py_None) {
+    timeout = PyFloat_AsDouble(timeout_py);
+    if (timeout == -1.0 && PyErr_Occurred()) {
+      return NULL;
     }
+    timeout = timeout < 0.0 ? 0.0 : timeout;
   }
 
-  return centroids_list_py_ptr;
-}
+  Py_BEGIN_ALLOW_THREADS
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)timeout;
+  deadline.tv_nsec += (long)((timeout - floor(timeout)) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&self->lock);
+  while (!self->done) {
+    if (timeout < 0.0) {
+      pthread_cond_wait(&self->finished, &self->lock);
+    }
+    else if (pthread_cond_timedwait(&self->finished, &self->lock, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  done = self->done;
+  pthread_mutex_unlock(&self->lock);
+  Py_END_ALLOW_THREADS
 
+  if (!done) {
+    PyErr_SetString(PyExc_TimeoutError, "fit is still running");
+    return NULL;
+  }
+  return fit_future_outcome(self);
+}
 
+static PyObject* fit_future_resolve(FitFutureObject *self, PyObject *waiter) {
+  /* Completes an asyncio future with the outcome of the fit, on the thread of its event loop */
+  PyObject *outcome;
+  PyObject *status;
+  PyObject *type;
+  PyObject *value;
+  PyObject *traceback;
+  PyObject *is_done = PyObject_CallMethod(waiter, "done", NULL);
+
+  if (is_done == NULL) {
+    return NULL;
+  }
+  if (PyObject_IsTrue(is_done)) {
+    Py_DECREF(is_done);
+    Py_RETURN_NONE;
+  }
+  Py_DECREF(is_done);
 
-void kmeans(struct Lists *lists, int K, int iter, double epsilon) {
-  struct Centroid* curr_centroid_ptr;
-  struct Centroid* closest_cluster;
-  struct Point* curr_point;
-  int i;
-  int j;
-  int m;
-  int converge;
-  int num_points;
-  double delta;
-  struct PointsList *points_list_ptr = *(lists->points_list_address);
-  struct CentroidsList *centroid_list_ptr = *(lists->centroids_list_address);
-  curr_point = points_list_ptr->head;
-
-  num_points = 0;
-  curr_point = points_list_ptr->head;
-
-  while (curr_point != NULL) {
-    num_points++;
-    curr_point = curr_point->next;
-  }
-
-  curr_centroid_ptr = NULL;
-  converge = 1;
-  closest_cluster = NULL;
-  delta = 0.0;
-  
-  /* Perform K-Means iter times */
-  for (i = 0; i < iter; i++) {
-    /* Go over all points to assign the closest cluster*/
-    curr_point = points_list_ptr->head;
-    for (j = 0; j < num_points; j++) {
-      closest_cluster = closest_centroid(centroid_list_ptr, curr_point);
-      update_centroid(closest_cluster, curr_point);
-      curr_point = curr_point->next;
-    }
-    converge = 1;
-    /* Go over clusters to check for convergence */
-    curr_centroid_ptr = centroid_list_ptr->head;
-    for (m = 0; m < K; m++) {
-      delta = finalize_next_centroid_pos(&curr_centroid_ptr);
-      curr_centroid_ptr = curr_centroid_ptr->next;
-      if (delta > epsilon) {
-        converge = 0;
-      }
+  outcome = fit_future_outcome(self);
+  if (outcome != NULL) {
+    status = PyObject_CallMethod(waiter, "set_result", "(O)", outcome);
+    Py_DECREF(outcome);
+  }
+  else if (self->cancelled) {
+    PyErr_Clear();
+    status = PyObject_CallMethod(waiter, "cancel", NULL);
+  }
+  else {
+    /* The exception a progress callback raised goes to the awaiting coroutine */
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    if (traceback != NULL) {
+      PyException_SetTraceback(value, traceback);
     }
+    status = PyObject_CallMethod(waiter, "set_exception", "(O)", value);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+  }
+  if (status == NULL) {
+    return NULL;
+  }
+  Py_DECREF(status);
+  Py_RETURN_NONE;
+}
 
-    if (converge) {
-      break;
-    }
+static PyObject* fit_future_waiter_done(FitFutureObject *self, PyObject *waiter) {
+  /* A coroutine awaiting the fit was cancelled (e.g. by asyncio.wait_for): stop the run too */
+  PyObject *cancelled = PyObject_CallMethod(waiter, "cancelled", NULL);
 
+  if (cancelled == NULL) {
+    return NULL;
   }
+  if (PyObject_IsTrue(cancelled)) {
+    Py_DECREF(fit_future_cancel(self, NULL));
+  }
+  Py_DECREF(cancelled);
+  Py_RETURN_NONE;
 }
 
+static PyObject* fit_future_await(FitFutureObject *self) {
+  /* await future: an asyncio future of the running loop, completed from the fit thread */
+  PyObject *asyncio;
+  PyObject *loop;
+  PyObject *waiter;
+  PyObject *callback;
+  PyObject *status;
+  PyObject *iterator = NULL;
+  int done;
+
+  asyncio = PyImport_ImportModule("asyncio");
+  if (asyncio == NULL) {
+    return NULL;
+  }
+  loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+  Py_DECREF(asyncio);
+  if (loop == NULL) {
+    return NULL;
+  }
+  waiter = PyObject_CallMethod(loop, "create_future", NULL);
+  Py_DECREF(loop);
+  if (waiter == NULL) {
+    return NULL;
+  }
 
+  callback = PyObject_GetAttrString((PyObject *)self, "_waiter_done");
+  status = callback == NULL ? NULL : PyObject_CallMethod(waiter, "add_done_callback", "O", callback);
+  Py_XDECREF(callback);
+  if (status == NULL) {
+    Py_DECREF(waiter);
+    return NULL;
+  }
+  Py_DECREF(status);
+
+  /* The fit thread reads waiters only after setting done and taking the GIL, which we hold */
+  pthread_mutex_lock(&self->lock);
+  done = self->done;
+  pthread_mutex_unlock(&self->lock);
+  if (done) {
+    status = fit_future_resolve(self, waiter);
+  }
+  else {
+    status = PyList_Append(self->waiters, waiter) == 0 ? Py_None : NULL;
+    Py_XINCREF(status);
+  }
+  if (status != NULL) {
+    Py_DECREF(status);
+    iterator = PyObject_CallMethod(waiter, "__await__", NULL);
+  }
+  Py_DECREF(waiter);
+  return iterator;
+}
 
+static void fit_future_dealloc(FitFutureObject *self) {
+  /* The fit thread holds a reference until it is done, so the job is never freed under it */
+  free_fit_job(&self->job);
+  pthread_mutex_destroy(&self->lock);
+  pthread_cond_destroy(&self->finished);
+  Py_XDECREF(self->waiters);
+  Py_XDECREF(self->result);
+  PyObject_Del(self);
+}
 
-static PyObject* k_means_plus_plus_c_wrapper(PyObject *self, PyObject *args) {
-  /* Wrapper takes in Points, Initial Centroids, K, Iter */
-  PyObject* points;
-  PyObject* initial_centroids;
-  int K;
-  int iter;
-  double epsilon;
-  PyObject* final_centroids;
-  struct PointsList* points_list_ptr;
-  struct CentroidsList* centroids_list_ptr;
+static PyMethodDef FitFutureMethods[] = {
+  {"done", (PyCFunction) fit_future_done, METH_NOARGS, "True once the fit has finished or stopped"},
+  {"cancelled", (PyCFunction) fit_future_cancelled, METH_NOARGS, "True if the fit stopped because of cancel()"},
+  {"cancel", (PyCFunction) fit_future_cancel, METH_NOARGS, "Stop the fit before its next iteration"},
+  {
+    "result",
+    (PyCFunction)(void(*)(void)) fit_future_result,
+    METH_VARARGS | METH_KEYWORDS,
+    "Wait for the fit and return what fit would have"
+  },
+  {"_resolve", (PyCFunction) fit_future_resolve, METH_O, NULL},
+  {"_waiter_done", (PyCFunction) fit_future_waiter_done, METH_O, NULL},
+  {NULL, NULL, 0, NULL}
+};
 
-  if (!PyArg_ParseTuple(args, "OOiid", &points, &initial_centroids, &K, &iter, &epsilon)) {
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+static PyAsyncMethods FitFutureAsync = {
+  (unaryfunc) fit_future_await,
+  NULL,
+  NULL
+};
+
+static void init_fit_future_type(void) {
+  FitFutureType.tp_basicsize = sizeof(FitFutureObject);
+  FitFutureType.tp_flags = Py_TPFLAGS_DEFAULT;
+  FitFutureType.tp_doc = "Handle of a fit started by fit_async: await it, or poll done() and call result()";
+  FitFutureType.tp_dealloc = (destructor) fit_future_dealloc;
+  FitFutureType.tp_methods = FitFutureMethods;
+  FitFutureType.tp_as_async = &FitFutureAsync;
+}
+
+
+static PyObject* estimate_memory_c_wrapper(PyObject *self, PyObject *args, PyObject *kwargs) {
+  /*
+  Wrapper takes in N, D, K and the options of fit that change its memory, weights, deduplicate,
+  numa, checkpoint and checkpoint_labels being flags here, and returns the bytes fit would allocate as {"points",
+  "copies", "labels", "reduction", "centroids", "overhead", "total"} together with the layout
+  {"storage", "max_chunks", "return_labels"}. Given max_memory the layout is the one fit would
+  pick under that cap, and MemoryError is raised if none fits. nnz describes a CSR input.
+   */
+  static char *kwlist[] = {"num_points", "dim", "K", "quantize", "return_labels", "nnz", "max_memory", "weights",
+                           "deduplicate", "numa", "checkpoint", "allow_quantize", "checkpoint_labels", NULL};
+  struct MemoryPlan plan;
+  struct MemoryEstimate estimate;
+  long num_points;
+  long nnz = -1;
+  Py_ssize_t max_memory = 0;
+  int dim;
+  int K;
+  int quantize = 0;
+  int allow_quantize = 0;
+
+  plan.labels = 0;
+  plan.weights = 0;
+  plan.deduplicate = 0;
+  plan.numa = 0;
+  plan.checkpoint = 0;
+  plan.checkpoint_labels = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "lii|pplnpppppp", kwlist, &num_points, &dim, &K, &quantize,
+                                   &plan.labels, &nnz, &max_memory, &plan.weights, &plan.deduplicate, &plan.numa,
+                                   &plan.checkpoint, &allow_quantize, &plan.checkpoint_labels)) {
+    return NULL;
   }
-  
-  if (!PyList_Check(points) || !PyList_Check(initial_centroids)) {
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+  if (num_points < 1 || dim < 1 || K < 1 || max_memory < 0) {
+    PyErr_SetString(PyExc_ValueError, "num_points, dim and K must be positive and max_memory non-negative");
+    return NULL;
   }
 
-  points_list_ptr = unpack_points_list(points);
-  centroids_list_ptr = unpack_centroids_list(initial_centroids);
+  plan.storage = nnz >= 0 ? STORAGE_CSR : quantize ? STORAGE_QUANTIZED : STORAGE_DENSE;
+  plan.allow_quantize = allow_quantize && !plan.deduplicate;
+  plan.max_chunks = 0;
+  plan.nnz = nnz;
+  if (max_memory == 0) {
+    estimate_memory(num_points, dim, K, &plan, &estimate);
+  }
+  else if (plan_memory(num_points, dim, K, (size_t)max_memory, &plan, &estimate) == -1) {
+    PyErr_Format(PyExc_MemoryError, "fit needs at least %zu bytes, max_memory is %zd", estimate.total, max_memory);
+    return NULL;
+  }
 
- lists = malloc(sizeof(struct Lists));
+  return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:s,s:i,s:O}", "points", (Py_ssize_t)estimate.points,
+                       "copies", (Py_ssize_t)estimate.copies, "labels", (Py_ssize_t)estimate.labels,
+                       "reduction", (Py_ssize_t)estimate.reduction, "centroids", (Py_ssize_t)estimate.centroids,
+                       "overhead", (Py_ssize_t)estimate.overhead, "total", (Py_ssize_t)estimate.total,
+                       "storage", storage_names[plan.storage], "max_chunks", plan.max_chunks,
+                       "return_labels", plan.labels ? Py_True : Py_False);
+}
 
-  if (lists == NULL) {
-    printf("An Error has Occurred\n");
-    exit(EXIT_FAILURE);
+static PyObject* load_checkpoint_c_wrapper(PyObject *self, PyObject *args) {
+  /*
+  Wrapper takes in a checkpoint path and returns {"centroids": [...], "iteration": n, "labels": [...] or None,
+  "random_state": np.random state tuple or None}. The labels, saved with checkpoint_labels, are
+  those of the points the run was given, one per distinct row when it deduplicated them.
+   */
+  const char *path;
+  struct Checkpoint *checkpoint;
+  PyObject *labels_py = Py_None;
+  PyObject *random_py = Py_None;
+  PyObject *centroids_py;
+  PyObject *result;
+
+  if (!PyArg_ParseTuple(args, "s", &path)) {
+    return NULL;
+  }
+  checkpoint = read_checkpoint(path);
+  if (checkpoint == NULL) {
+    PyErr_Format(PyExc_OSError, "could not read a checkpoint from %s", path);
+    return NULL;
   }
 
-  lists->points_list_address = &points_list_ptr;
-  lists->centroids_list_address = &centroids_list_ptr;
+  centroids_py = convert_centroids_pyobject(checkpoint->centroids, checkpoint->K, checkpoint->dim);
+  if (checkpoint->labels != NULL) {
+    labels_py = convert_labels_pyobject(checkpoint->labels, checkpoint->num_points);
+  }
+  else {
+    Py_INCREF(labels_py);
+  }
+  if (checkpoint->has_random) {
+    random_py = convert_random_pyobject(&checkpoint->random);
+  }
+  else {
+    Py_INCREF(random_py);
+  }
+  if (centroids_py == NULL || labels_py == NULL || random_py == NULL) {
+    Py_XDECREF(centroids_py);
+    Py_XDECREF(labels_py);
+    Py_XDECREF(random_py);
+    free_checkpoint(&checkpoint);
+    return NULL;
+  }
 
+  result = Py_BuildValue("{s:N,s:i,s:N,s:N}", "centroids", centroids_py, "iteration", checkpoint->iteration,
+                         "labels", labels_py, "random_state", random_py);
+  free_checkpoint(&checkpoint);
+  return result;
+}
 
-  kmeans(lists, K, iter, epsilon);
+static PyObject* set_num_threads_c_wrapper(PyObject *self, PyObject *args) {
+  /* Wrapper takes in the thread count used whenever a num_threads argument is left out */
+  int num_threads;
 
-  final_centroids = convert_centroids_pyobject(centroids_list_ptr, K);
-  free_all_memory();
+  if (!PyArg_ParseTuple(args, "i", &num_threads)) {
+    return NULL;
+  }
+  if (num_threads < 1) {
+    PyErr_SetString(PyExc_ValueError, "num_threads must be at least 1");
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  set_num_threads(num_threads);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
 
-  return final_centroids;
+static PyObject* get_num_threads_c_wrapper(PyObject *self, PyObject *args) {
+  return PyLong_FromLong(get_num_threads());
 }
 
 
 static PyMethodDef KMeansPPMethods[] = {
   {
-    "fit", 
-    (PyCFunction) k_means_plus_plus_c_wrapper,
-    METH_VARARGS,
+    "fit",
+    (PyCFunction)(void(*)(void)) k_means_plus_plus_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
     "K-Means Plus Plus C Wrapper"
   },
+  {
+    "fit_async",
+    (PyCFunction)(void(*)(void)) fit_async_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Start fit on a background thread and return an awaitable FitFuture"
+  },
+  {
+    "predict",
+    (PyCFunction)(void(*)(void)) predict_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Index of the closest centroid of every point"
+  },
+  {
+    "coreset",
+    (PyCFunction)(void(*)(void)) coreset_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Sensitivity sampled weighted coreset of dense points"
+  },
+  {
+    "select_k",
+    (PyCFunction)(void(*)(void)) select_k_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Inertia of every K in [k_min, k_max] and the elbow of the curve"
+  },
+  {
+    "bisect",
+    (PyCFunction)(void(*)(void)) bisect_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Bisecting k-means: K centroids and the tree of splits that assigns points in O(log K)"
+  },
+  {
+    "serve_shard",
+    (PyCFunction)(void(*)(void)) serve_shard_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Worker of a sharded fit: serve the Lloyd steps of a coordinator over one shard of the points"
+  },
+  {
+    "coordinate",
+    (PyCFunction)(void(*)(void)) coordinate_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Coordinator of a sharded fit: run Lloyd's algorithm over the shards of num_workers workers"
+  },
+  {
+    "silhouette",
+    (PyCFunction)(void(*)(void)) silhouette_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Mean silhouette of labelled points, exact or estimated from a sample"
+  },
+  {
+    "estimate_memory",
+    (PyCFunction)(void(*)(void)) estimate_memory_c_wrapper,
+    METH_VARARGS | METH_KEYWORDS,
+    "Bytes fit allocates for N points of D dimensions and K clusters, and the layout it picks under max_memory"
+  },
+  {
+    "load_checkpoint",
+    (PyCFunction) load_checkpoint_c_wrapper,
+    METH_VARARGS,
+    "Centroids, iteration, labels and random state saved by a checkpointed fit"
+  },
+  {
+    "set_num_threads",
+    (PyCFunction) set_num_threads_c_wrapper,
+    METH_VARARGS,
+    "Set the default thread count of the module's persistent thread pool"
+  },
+  {
+    "get_num_threads",
+    (PyCFunction) get_num_threads_c_wrapper,
+    METH_NOARGS,
+    "Default thread count of the module's persistent thread pool"
+  },
+  {
+    "read_files",
+    (PyCFunction) read_files_c_wrapper,
+    METH_VARARGS,
+    "Inner join of two point files on their first column, sorted by key"
+  },
   {NULL, NULL, 0, NULL}
 };
-  
+
 
 static struct PyModuleDef KMeansPPModule = {
   PyModuleDef_HEAD_INIT,
@@ -731,9 +2356,29 @@ static struct PyModuleDef KMeansPPModule = {
 
 PyMODINIT_FUNC PyInit_mykmeanssp(void) {
     PyObject *module;
+
+    init_online_kmeans_type();
+    init_fit_future_type();
+    if (PyType_Ready(&OnlineKMeansType) < 0 || PyType_Ready(&FitFutureType) < 0) {
+        return NULL;
+    }
+
     module = PyModule_Create(&KMeansPPModule);
     if (!module) {
         return NULL;
     }
+
+    Py_INCREF(&OnlineKMeansType);
+    if (PyModule_AddObject(module, "OnlineKMeans", (PyObject *)&OnlineKMeansType) < 0) {
+        Py_DECREF(&OnlineKMeansType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&FitFutureType);
+    if (PyModule_AddObject(module, "FitFuture", (PyObject *)&FitFutureType) < 0) {
+        Py_DECREF(&FitFutureType);
+        Py_DECREF(module);
+        return NULL;
+    }
     return module;
-}
\ No newline at end of file
+}
@@ -1,9 +1,21 @@
+import os
 from setuptools import Extension, setup
 
-module = Extension("mykmeanssp", sources=['kmeansmodule.c'])
+# KMEANS_BLAS=<library> (e.g. openblas) routes the blocked distance kernel through cblas_dgemm
+blas = os.environ.get("KMEANS_BLAS")
+# KMEANS_NUMA=1 reads the NUMA topology through libnuma instead of sysfs
+numa = os.environ.get("KMEANS_NUMA")
+
+module = Extension("mykmeanssp",
+                   sources=['kmeansmodule.c', 'kmeans_engine.c'],
+                   depends=['kmeans_engine.h'],
+                   define_macros=([('KMEANS_USE_BLAS', '1')] if blas else [])
+                                 + ([('KMEANS_USE_NUMA', '1')] if numa else []),
+                   libraries=([blas] if blas else []) + (['numa'] if numa else []),
+                   extra_compile_args=['-pthread'],
+                   extra_link_args=['-pthread'])
 setup(name='mykmeanssp',
      version='1.0',
      description='Python wrapper for KMeans in C',
      ext_modules=[module]
     )
-
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Checkpoint and resume on input 1, for both programs: a run stopped after 4 iterations and
+# resumed from its checkpoint prints the centroids of output_1, the checkpoint holds the labels
+# of the 50 points when asked to, and a checkpoint that cannot be written ends the run with the
+# error message. Run by make check.
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+tail -n +2 tests/output_1.txt > "$tmp/expected"
+status=0
+
+for program in ./kmeans_pp "python3 kmeans_pp.py"; do
+  rm -f "$tmp/checkpoint"
+  $program --checkpoint "$tmp/checkpoint" --checkpoint-every 2 --checkpoint-labels 3 4 0 tests/input_1_db_1.txt \
+    tests/input_1_db_2.txt > /dev/null
+  labels=$(python3 -c "import sys, mykmeanssp; print(len(mykmeanssp.load_checkpoint(sys.argv[1])['labels']))" \
+    "$tmp/checkpoint")
+  if [ "$labels" != 50 ]; then
+    echo "$program: checkpoint holds $labels labels"
+    status=1
+  fi
+  $program --resume "$tmp/checkpoint" 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt > "$tmp/resumed"
+  if ! diff -qB "$tmp/expected" "$tmp/resumed" > /dev/null; then
+    echo "$program: resumed run differs from output_1"
+    status=1
+  fi
+  $program --checkpoint "$tmp/missing/checkpoint" 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt \
+    > "$tmp/failed"
+  if [ "$(cat "$tmp/failed")" != "An Error has Occurred" ]; then
+    echo "$program: unwritable checkpoint did not fail"
+    status=1
+  fi
+done
+exit $status
@@ -0,0 +1,47 @@
+#!/bin/sh
+# max_memory on input 1, for both programs: a roomy cap prints the centroids of output_1 and a cap
+# no layout fits under ends the run with the error message. Then a deduplicated, weighted fit of
+# 10^6 points run at exactly its estimate must not grow the peak resident set past it.
+# Run by make check.
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+tail -n +2 tests/output_1.txt > "$tmp/expected"
+status=0
+
+for program in ./kmeans_pp "python3 kmeans_pp.py"; do
+  $program --max-memory 100000000 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt > "$tmp/capped"
+  if ! diff -qB "$tmp/expected" "$tmp/capped" > /dev/null; then
+    echo "$program: run under a roomy cap differs from output_1"
+    status=1
+  fi
+  $program --max-memory 1000 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt > "$tmp/failed"
+  if [ "$(cat "$tmp/failed")" != "An Error has Occurred" ]; then
+    echo "$program: cap below every layout did not fail"
+    status=1
+  fi
+done
+
+# The peak is read from VmHWM, which Linux lets a process reset through clear_refs
+PYTHONPATH=. python3 - <<'PY' || status=1
+import re
+import numpy as np
+import mykmeanssp
+
+def peak():
+    return int(re.search(r'VmHWM:\s+(\d+)', open('/proc/self/status').read()).group(1)) * 1024
+
+rng = np.random.default_rng(0)
+points = np.round(rng.normal(size=(10 ** 6, 4)), 1)
+weights = rng.random(10 ** 6)
+estimate = mykmeanssp.estimate_memory(10 ** 6, 4, 8, weights=True, deduplicate=True)
+with open('/proc/self/clear_refs', 'w') as clear_refs:
+    clear_refs.write('5')
+before = peak()
+mykmeanssp.fit(points, points[:8].tolist(), 8, 10, 0.0, weights=weights, deduplicate=True,
+               max_memory=estimate['total'])
+if peak() - before > estimate['total']:
+    print('fit grew by %d bytes, max_memory was %d' % (peak() - before, estimate['total']))
+    raise SystemExit(1)
+PY
+exit $status
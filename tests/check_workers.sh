@@ -0,0 +1,40 @@
+#!/bin/sh
+# Sharded fits on input 1, for both programs: --workers 1 to 3 print the centroids of output_1,
+# as do workers started separately with --worker against a --coordinate run, and the flags that
+# belong to the single process loop are rejected with the error message. Run by make check.
+cd "$(dirname "$0")/.." || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+tail -n +2 tests/output_1.txt > "$tmp/expected"
+status=0
+
+for program in ./kmeans_pp "python3 kmeans_pp.py"; do
+  for workers in 1 2 3; do
+    $program --workers $workers 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt > "$tmp/sharded"
+    if ! diff -qB "$tmp/expected" "$tmp/sharded" > /dev/null; then
+      echo "$program: --workers $workers differs from output_1"
+      status=1
+    fi
+  done
+  for flag in --numa "--checkpoint $tmp/checkpoint"; do
+    $program --workers 2 $flag 3 333 0 tests/input_1_db_1.txt tests/input_1_db_2.txt > "$tmp/failed"
+    if [ "$(cat "$tmp/failed")" != "An Error has Occurred" ]; then
+      echo "$program: --workers accepted $flag"
+      status=1
+    fi
+  done
+done
+
+./kmeans_pp --workers 3 --coordinate "unix:$tmp/coordinator.sock" 3 333 0 tests/input_1_db_1.txt \
+  tests/input_1_db_2.txt > "$tmp/coordinated" &
+coordinator=$!
+for shard in 0 1 2; do
+  ./kmeans_pp --worker "unix:$tmp/coordinator.sock" --shard $shard/3 &
+done
+wait $coordinator
+wait
+if ! diff -qB "$tmp/expected" "$tmp/coordinated" > /dev/null; then
+  echo "./kmeans_pp: --coordinate with separate workers differs from output_1"
+  status=1
+fi
+exit $status